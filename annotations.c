@@ -0,0 +1,353 @@
+#include "annotations.h"
+
+#include <math.h>
+
+struct _Annotation {
+    ToolType tool;
+    ShapeStyle style;
+    double x1, y1, x2, y2;      /* drag, for shapes and redact */
+    RedactMode redact_mode;     /* redact only */
+    guint32 seed;               /* jitter redact only */
+    Stroke *stroke;             /* pen only, finished */
+    double bx1, by1, bx2, by2;  /* everything drawing may touch */
+};
+
+struct _DisplayList {
+    Canvas *base;
+    GPtrArray *annotations;     /* Annotation, oldest first */
+    guint cursor;               /* annotations[cursor..] are undone */
+};
+
+static Annotation *annotation_new(ToolType tool, const ShapeStyle *style) {
+    Annotation *annotation = g_new0(Annotation, 1);
+    annotation->tool = tool;
+    if (style) annotation->style = *style;
+    return annotation;
+}
+
+Annotation *annotation_new_shape(ToolType tool, const ShapeStyle *style,
+                                 double x1, double y1, double x2, double y2) {
+    Annotation *annotation = annotation_new(tool, style);
+    annotation->x1 = x1;
+    annotation->y1 = y1;
+    annotation->x2 = x2;
+    annotation->y2 = y2;
+    shape_bounds(tool, style, x1, y1, x2, y2,
+                 &annotation->bx1, &annotation->by1, &annotation->bx2, &annotation->by2);
+    return annotation;
+}
+
+Annotation *annotation_new_stroke(const ShapeStyle *style, Stroke *stroke) {
+    Annotation *annotation = annotation_new(TOOL_PEN, style);
+    annotation->stroke = stroke;
+    stroke_finish(stroke);
+    stroke_get_bounds(stroke, style,
+                      &annotation->bx1, &annotation->by1, &annotation->bx2, &annotation->by2);
+    return annotation;
+}
+
+Annotation *annotation_new_redact(double x1, double y1, double x2, double y2,
+                                  RedactMode mode, guint32 seed) {
+    ShapeStyle none = { 0 };
+    Annotation *annotation = annotation_new_shape(TOOL_REDACT, &none, x1, y1, x2, y2);
+    annotation->redact_mode = mode;
+    annotation->seed = seed;
+    return annotation;
+}
+
+void annotation_free(Annotation *annotation) {
+    if (!annotation) return;
+
+    stroke_free(annotation->stroke);
+    g_free(annotation);
+}
+
+/* Integer pixels of the given bounds inside canvas; empty if none. */
+static cairo_rectangle_int_t area_rect(const Canvas *canvas,
+                                       double x1, double y1, double x2, double y2) {
+    cairo_rectangle_int_t r;
+    r.x = MAX((int)floor(x1), 0);
+    r.y = MAX((int)floor(y1), 0);
+    r.width = MAX(MIN((int)ceil(x2), canvas_get_width(canvas)) - r.x, 0);
+    r.height = MAX(MIN((int)ceil(y2), canvas_get_height(canvas)) - r.y, 0);
+    return r;
+}
+
+static gboolean overlaps(const Annotation *annotation, const cairo_rectangle_int_t *r) {
+    return annotation->bx1 < r->x + r->width && annotation->bx2 > r->x &&
+           annotation->by1 < r->y + r->height && annotation->by2 > r->y;
+}
+
+typedef struct {
+    const Annotation *annotation;
+    const cairo_rectangle_int_t *clip;
+} DrawJob;
+
+static void draw_annotation_tile(cairo_t *cr, gpointer data) {
+    const DrawJob *job = data;
+    const Annotation *a = job->annotation;
+
+    cairo_rectangle(cr, job->clip->x, job->clip->y, job->clip->width, job->clip->height);
+    cairo_clip(cr);
+    if (a->tool == TOOL_PEN) {
+        stroke_fill(cr, a->stroke, &a->style);
+    } else {
+        draw_shape(cr, a->tool, &a->style, a->x1, a->y1, a->x2, a->y2);
+    }
+}
+
+/* Draws the part of annotation inside clip. A redaction is always drawn
+ * whole, so clip must contain it. */
+static void draw_annotation(const Annotation *a, Canvas *target, const cairo_rectangle_int_t *clip) {
+    if (a->tool == TOOL_REDACT) {
+        apply_redact(target, a->x1, a->y1, a->x2, a->y2, a->redact_mode, a->seed);
+        return;
+    }
+
+    DrawJob job = { a, clip };
+    canvas_draw(target, fmax(a->bx1, clip->x), fmax(a->by1, clip->y),
+                fmin(a->bx2, clip->x + clip->width), fmin(a->by2, clip->y + clip->height),
+                draw_annotation_tile, &job);
+}
+
+DisplayList *display_list_new(Canvas *base) {
+    DisplayList *list = g_new0(DisplayList, 1);
+    list->base = base;
+    list->annotations = g_ptr_array_new_with_free_func((GDestroyNotify)annotation_free);
+    return list;
+}
+
+void display_list_free(DisplayList *list) {
+    if (!list) return;
+
+    g_ptr_array_free(list->annotations, TRUE);
+    canvas_free(list->base);
+    g_free(list);
+}
+
+int display_list_get_length(const DisplayList *list) {
+    return list->cursor;
+}
+
+int display_list_get_redo_length(const DisplayList *list) {
+    return list->annotations->len - list->cursor;
+}
+
+Canvas *display_list_get_base(const DisplayList *list) {
+    return list->base;
+}
+
+void display_list_drop_base(DisplayList *list) {
+    g_clear_pointer(&list->base, canvas_free);
+}
+
+const Annotation *display_list_get_nth(const DisplayList *list, int i) {
+    return g_ptr_array_index(list->annotations, i);
+}
+
+gsize display_list_get_size(const DisplayList *list) {
+    gsize size = sizeof(DisplayList) + list->annotations->len * sizeof(gpointer);
+    for (guint i = 0; i < list->annotations->len; i++) {
+        const Annotation *a = g_ptr_array_index(list->annotations, i);
+        size += sizeof(Annotation) + (a->stroke ? stroke_get_size(a->stroke) : 0);
+    }
+    return size;
+}
+
+void display_list_add(DisplayList *list, Canvas *composite, Annotation *annotation,
+                      cairo_rectangle_int_t *changed) {
+    g_ptr_array_set_size(list->annotations, list->cursor);
+    g_ptr_array_add(list->annotations, annotation);
+    list->cursor++;
+
+    *changed = area_rect(composite, annotation->bx1, annotation->by1,
+                         annotation->bx2, annotation->by2);
+    draw_annotation(annotation, composite, changed);
+}
+
+/* Bounds of the pixels a redaction reads: its own, and for jitter the
+ * reach of the offsets around them. */
+static void redaction_input(const Annotation *a, double *x1, double *y1, double *x2, double *y2) {
+    double before = a->redact_mode == REDACT_JITTER ? REDACT_JITTER_REACH_BEFORE : 0;
+    double after = a->redact_mode == REDACT_JITTER ? REDACT_JITTER_REACH_AFTER : 0;
+    *x1 = a->bx1 - before;
+    *y1 = a->by1 - before;
+    *x2 = a->bx2 + after;
+    *y2 = a->by2 + after;
+}
+
+/* Grows r until every redaction below the cursor that overlaps it reads
+ * only pixels inside it. Pixels outside r hold the composite as it is
+ * now, not as it was when the redaction was drawn, so rebuilding one from
+ * them could give a different result. Growing for one redaction can take
+ * in another, so this repeats until r stops changing. */
+static void grow_for_redactions(const DisplayList *list, cairo_rectangle_int_t *r) {
+    gboolean grown = TRUE;
+    while (grown) {
+        grown = FALSE;
+        for (guint i = list->cursor; i-- > 0;) {
+            const Annotation *a = g_ptr_array_index(list->annotations, i);
+            if (a->tool != TOOL_REDACT || !overlaps(a, r)) continue;
+
+            double x1, y1, x2, y2;
+            redaction_input(a, &x1, &y1, &x2, &y2);
+            cairo_rectangle_int_t input = area_rect(list->base, x1, y1, x2, y2);
+            int right = MAX(r->x + r->width, input.x + input.width);
+            int bottom = MAX(r->y + r->height, input.y + input.height);
+            int left = MIN(r->x, input.x);
+            int top = MIN(r->y, input.y);
+            if (left == r->x && top == r->y &&
+                right == r->x + r->width && bottom == r->y + r->height) continue;
+
+            *r = (cairo_rectangle_int_t){ left, top, right - left, bottom - top };
+            grown = TRUE;
+        }
+    }
+}
+
+/* Rebuilds r of composite from the base and the annotations below the
+ * cursor. */
+static void rebuild(const DisplayList *list, Canvas *composite, const cairo_rectangle_int_t *r) {
+    canvas_copy(composite, list->base, r);
+    for (guint i = 0; i < list->cursor; i++) {
+        const Annotation *a = g_ptr_array_index(list->annotations, i);
+        if (overlaps(a, r)) draw_annotation(a, composite, r);
+    }
+}
+
+void display_list_set_base(DisplayList *list, Canvas *base, Canvas *composite) {
+    canvas_free(list->base);
+    list->base = base;
+    cairo_rectangle_int_t all = { 0, 0, canvas_get_width(base), canvas_get_height(base) };
+    rebuild(list, composite, &all);
+}
+
+gboolean display_list_undo(DisplayList *list, Canvas *composite, cairo_rectangle_int_t *changed) {
+    if (list->cursor == 0) return FALSE;
+
+    const Annotation *a = g_ptr_array_index(list->annotations, --list->cursor);
+    *changed = area_rect(composite, a->bx1, a->by1, a->bx2, a->by2);
+    grow_for_redactions(list, changed);
+    rebuild(list, composite, changed);
+    return TRUE;
+}
+
+gboolean display_list_redo(DisplayList *list, Canvas *composite, cairo_rectangle_int_t *changed) {
+    if (list->cursor == list->annotations->len) return FALSE;
+
+    const Annotation *a = g_ptr_array_index(list->annotations, list->cursor++);
+    *changed = area_rect(composite, a->bx1, a->by1, a->bx2, a->by2);
+    draw_annotation(a, composite, changed);
+    return TRUE;
+}
+
+GVariant *annotation_serialize(const Annotation *a) {
+    GVariantBuilder points;
+    g_variant_builder_init(&points, G_VARIANT_TYPE("a(ddd)"));
+
+    if (a->stroke) {
+        for (int j = 0; j < stroke_get_n_points(a->stroke); j++) {
+            double x, y, pressure;
+            stroke_get_point(a->stroke, j, &x, &y, &pressure);
+            g_variant_builder_add(&points, "(ddd)", x, y, pressure);
+        }
+    } else {
+        g_variant_builder_add(&points, "(ddd)", a->x1, a->y1, 1.0);
+        g_variant_builder_add(&points, "(ddd)", a->x2, a->y2, 1.0);
+    }
+
+    return g_variant_new(ANNOTATION_FORMAT, (guchar)a->tool,
+                         a->style.red, a->style.green, a->style.blue, a->style.alpha,
+                         a->style.size, (guchar)a->redact_mode, a->seed, &points);
+}
+
+Annotation *annotation_deserialize(GVariant *variant) {
+    if (!g_variant_is_of_type(variant, G_VARIANT_TYPE(ANNOTATION_FORMAT))) return NULL;
+
+    guchar tool;
+    ShapeStyle style;
+    guchar mode;
+    guint32 seed;
+    GVariant *points;
+    g_variant_get(variant, ANNOTATION_FORMAT, &tool, &style.red, &style.green, &style.blue,
+                  &style.alpha, &style.size, &mode, &seed, &points);
+
+    Annotation *annotation = NULL;
+    gsize n = g_variant_n_children(points);
+    if (tool == TOOL_PEN && n > 0) {
+        Stroke *stroke = stroke_new();
+        for (gsize i = 0; i < n; i++) {
+            double x, y, pressure;
+            g_variant_get_child(points, i, "(ddd)", &x, &y, &pressure);
+            stroke_add_point(stroke, x, y, pressure);
+        }
+        stroke_finish_simplified(stroke);
+        annotation = annotation_new_stroke(&style, stroke);
+    } else if (tool <= TOOL_REDACT && tool != TOOL_PEN && mode <= REDACT_PIXELATE && n == 2) {
+        double x1, y1, x2, y2, pressure;
+        g_variant_get_child(points, 0, "(ddd)", &x1, &y1, &pressure);
+        g_variant_get_child(points, 1, "(ddd)", &x2, &y2, &pressure);
+        annotation = tool == TOOL_REDACT ? annotation_new_redact(x1, y1, x2, y2, mode, seed)
+                                         : annotation_new_shape(tool, &style, x1, y1, x2, y2);
+    }
+
+    g_variant_unref(points);
+    return annotation;
+}
+
+char *display_list_sidecar_name(const char *filename) {
+    return g_strconcat(filename, ".crayons", NULL);
+}
+
+GBytes *display_list_serialize(const DisplayList *list, const DisplayListBase *base) {
+    GVariantBuilder annotations;
+    g_variant_builder_init(&annotations, G_VARIANT_TYPE("a" ANNOTATION_FORMAT));
+
+    for (guint i = 0; i < list->cursor; i++) {
+        Annotation copy = *(const Annotation *)g_ptr_array_index(list->annotations, i);
+        copy.seed = 0;
+        g_variant_builder_add_value(&annotations, annotation_serialize(&copy));
+    }
+
+    GVariant *variant = g_variant_ref_sink(
+        g_variant_new(DISPLAY_LIST_FORMAT, (guint32)DISPLAY_LIST_VERSION,
+                      base->width, base->height, base->filename ? base->filename : "",
+                      base->mtime, base->size, &annotations));
+    GBytes *bytes = g_variant_get_data_as_bytes(variant);
+    g_variant_unref(variant);
+    return bytes;
+}
+
+DisplayList *display_list_deserialize(GBytes *bytes, DisplayListBase *base) {
+    GVariant *variant = g_variant_ref_sink(
+        g_variant_new_from_bytes(G_VARIANT_TYPE(DISPLAY_LIST_FORMAT), bytes, FALSE));
+    guint32 version;
+    const char *filename;
+    GVariant *annotations;
+    g_variant_get(variant, "(u(ii&sxt)@a" ANNOTATION_FORMAT ")", &version,
+                  &base->width, &base->height, &filename, &base->mtime, &base->size,
+                  &annotations);
+
+    DisplayList *list = NULL;
+    if (version == DISPLAY_LIST_VERSION && base->width > 0 && base->height > 0) {
+        list = display_list_new(NULL);
+        gsize n = g_variant_n_children(annotations);
+        for (gsize i = 0; i < n && list; i++) {
+            GVariant *child = g_variant_get_child_value(annotations, i);
+            Annotation *a = annotation_deserialize(child);
+            g_variant_unref(child);
+            if (!a) {
+                g_clear_pointer(&list, display_list_free);
+                break;
+            }
+            if (a->tool == TOOL_REDACT) a->seed = g_random_int();
+            g_ptr_array_add(list->annotations, a);
+        }
+        if (list) list->cursor = list->annotations->len;
+    }
+    base->filename = list && *filename ? g_strdup(filename) : NULL;
+
+    g_variant_unref(annotations);
+    g_variant_unref(variant);
+    return list;
+}
@@ -0,0 +1,124 @@
+#ifndef CRAYONS_ANNOTATIONS_H
+#define CRAYONS_ANNOTATIONS_H
+
+#include "canvas.h"
+#include "shapes.h"
+#include "stroke.h"
+
+/*
+ * Retained annotations.
+ *
+ * The loaded image stays untouched as the base canvas, and every edit is an
+ * Annotation object in a display list drawn over it. The editor's canvas is
+ * only a cached composite of the two: adding or redoing an annotation draws
+ * it on top, undoing one moves the list's cursor and rebuilds the composite
+ * inside the annotation's bounds from the base and whatever else overlaps
+ * there. Nothing is copied per step, so undo memory is the size of the
+ * annotations themselves.
+ *
+ * Redactions read the pixels below them, and jitter the pixels around
+ * them too, so rebuilding an area that overlaps one first grows to
+ * everything it reads.
+ */
+
+typedef struct _Annotation Annotation;
+typedef struct _DisplayList DisplayList;
+
+/* A rectangle, ellipse or arrow dragged from (x1, y1) to (x2, y2). */
+Annotation *annotation_new_shape(ToolType tool, const ShapeStyle *style,
+                                 double x1, double y1, double x2, double y2);
+
+/* A pen stroke; takes ownership of stroke, which gets finished. */
+Annotation *annotation_new_stroke(const ShapeStyle *style, Stroke *stroke);
+
+/* A redaction of the rectangle dragged from (x1, y1) to (x2, y2); seed is
+ * only used by REDACT_JITTER. */
+Annotation *annotation_new_redact(double x1, double y1, double x2, double y2,
+                                  RedactMode mode, guint32 seed);
+
+void annotation_free(Annotation *annotation);
+
+/* Takes ownership of base, which must not be written to afterwards. */
+DisplayList *display_list_new(Canvas *base);
+void display_list_free(DisplayList *list);
+
+/* Number of annotations drawn, and of undone ones that can be redone. */
+int display_list_get_length(const DisplayList *list);
+int display_list_get_redo_length(const DisplayList *list);
+
+/* The image the annotations are drawn over; NULL after it was dropped. */
+Canvas *display_list_get_base(const DisplayList *list);
+
+/* Frees the base to save memory, keeping the annotations. Nothing but
+ * display_list_set_base() and freeing may be done with the list until
+ * then. */
+void display_list_drop_base(DisplayList *list);
+
+/* Takes ownership of base, which must not be written to afterwards, and
+ * redraws all of composite, of the same size, from it. */
+void display_list_set_base(DisplayList *list, Canvas *base, Canvas *composite);
+
+/* Annotation i, counting the undone ones after the drawn ones. */
+const Annotation *display_list_get_nth(const DisplayList *list, int i);
+
+/* Bytes held by all annotations, including undone ones. */
+gsize display_list_get_size(const DisplayList *list);
+
+/* Drops the redo tail, appends annotation and draws it into composite.
+ * changed receives the area drawn. */
+void display_list_add(DisplayList *list, Canvas *composite, Annotation *annotation,
+                      cairo_rectangle_int_t *changed);
+
+gboolean display_list_undo(DisplayList *list, Canvas *composite, cairo_rectangle_int_t *changed);
+gboolean display_list_redo(DisplayList *list, Canvas *composite, cairo_rectangle_int_t *changed);
+
+/*
+ * Serialization.
+ *
+ * An annotation serializes to a GVariant of ANNOTATION_FORMAT: its tool,
+ * RGBA colour, size, redact mode and seed and points as (x, y, pressure).
+ * Shapes and redactions store their two drag points, pen strokes their
+ * simplified points. The seed makes a jitter redaction reversible, so whole
+ * annotations only go into private files such as the crash journal.
+ *
+ * Saving NAME.png also writes the drawn annotations to NAME.png.crayons, a
+ * GVariant of DISPLAY_LIST_FORMAT: format version, the base as
+ * DISPLAY_LIST_BASE_FORMAT and the annotations with every seed zeroed.
+ * Reading it back gives each jitter redaction a fresh seed instead.
+ */
+
+#define ANNOTATION_FORMAT "(y(dddd)dyua(ddd))"
+#define DISPLAY_LIST_VERSION 3
+#define DISPLAY_LIST_BASE_FORMAT "(iisxt)"
+#define DISPLAY_LIST_FORMAT "(u" DISPLAY_LIST_BASE_FORMAT "a" ANNOTATION_FORMAT ")"
+
+/* The image annotations are drawn over, as a file written for a later
+ * session describes it: width, height, image file or "" for a blank white
+ * canvas, and the file's modification time and size. */
+typedef struct {
+    char *filename;         /* NULL for a blank canvas */
+    int width, height;
+    gint64 mtime;           /* of filename when it was loaded */
+    guint64 size;
+} DisplayListBase;
+
+/* One annotation as a floating GVariant of ANNOTATION_FORMAT. */
+GVariant *annotation_serialize(const Annotation *annotation);
+
+/* Rebuilds an annotation from annotation_serialize(), or returns NULL if
+ * variant is not one. */
+Annotation *annotation_deserialize(GVariant *variant);
+
+/* Sidecar name for an image saved as filename. */
+char *display_list_sidecar_name(const char *filename);
+
+/* The drawn annotations of list over base, without seeds. */
+GBytes *display_list_serialize(const DisplayList *list, const DisplayListBase *base);
+
+/* Reads display_list_serialize() back into a list without a base, as
+ * display_list_drop_base() leaves it, and the base it was drawn over; free
+ * base->filename with g_free(). Returns NULL if bytes are not of this
+ * version. */
+DisplayList *display_list_deserialize(GBytes *bytes, DisplayListBase *base);
+
+#endif
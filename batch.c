@@ -0,0 +1,400 @@
+#include "batch.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gdk/gdk.h>
+
+#include "imageio.h"
+#include "parallel.h"
+#include "shapes.h"
+#include "stroke.h"
+
+#define BATCH_ERROR (g_quark_from_static_string("crayons-batch-error"))
+
+typedef struct {
+    ToolType tool;
+    ShapeStyle style;
+    double *points;             /* n_points (x, y) pairs */
+    int n_points;
+    Stroke *stroke;             /* pen only, finished once and shared by every image */
+    RedactMode redact_mode;     /* redact only */
+} BatchOp;
+
+typedef struct {
+    const char *input;
+    char *output;
+    int width, height;
+    gint64 load_us, draw_us, save_us;
+    gboolean ok;
+} BatchImage;
+
+static GArray *script = NULL;   /* BatchOp */
+static const char *extension = "png";
+static ExportPreset preset = EXPORT_BALANCED;
+
+static void free_op(gpointer data) {
+    BatchOp *op = data;
+    g_free(op->points);
+    stroke_free(op->stroke);
+}
+
+static gboolean parse_numbers(char **tokens, int n, double *out) {
+    for (int i = 0; i < n; i++) {
+        char *end;
+        out[i] = g_ascii_strtod(tokens[i], &end);
+        if (end == tokens[i] || *end) return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean parse_line(char **tokens, ShapeStyle *style, GArray *ops, GError **error) {
+    static const struct {
+        const char *name;
+        ToolType tool;
+        RedactMode redact_mode;
+    } shapes[] = {
+        { "rect", TOOL_RECT },
+        { "ellipse", TOOL_ELLIPSE },
+        { "arrow", TOOL_ARROW },
+        { "pen", TOOL_PEN },
+        { "redact", TOOL_REDACT, REDACT_JITTER },
+        { "blur", TOOL_REDACT, REDACT_BLUR },
+        { "pixelate", TOOL_REDACT, REDACT_PIXELATE },
+    };
+    const char *cmd = tokens[0];
+    int n_args = g_strv_length(tokens) - 1;
+
+    if (strcmp(cmd, "color") == 0) {
+        GdkRGBA rgba;
+        if (n_args != 1 || !gdk_rgba_parse(&rgba, tokens[1])) {
+            g_set_error(error, BATCH_ERROR, 0, "color expects one colour");
+            return FALSE;
+        }
+        style->red = rgba.red;
+        style->green = rgba.green;
+        style->blue = rgba.blue;
+        style->alpha = rgba.alpha;
+        return TRUE;
+    }
+    if (strcmp(cmd, "size") == 0) {
+        if (n_args != 1 || !parse_numbers(tokens + 1, 1, &style->size) || style->size <= 0) {
+            g_set_error(error, BATCH_ERROR, 0, "size expects one positive number");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    for (gsize i = 0; i < G_N_ELEMENTS(shapes); i++) {
+        if (strcmp(cmd, shapes[i].name) != 0) continue;
+
+        gboolean polyline = shapes[i].tool == TOOL_PEN;
+        if (polyline ? n_args < 4 || n_args % 2 : n_args != 4) {
+            g_set_error(error, BATCH_ERROR, 0, "%s expects %s", cmd,
+                        polyline ? "two or more X Y pairs" : "X1 Y1 X2 Y2");
+            return FALSE;
+        }
+
+        BatchOp op = { shapes[i].tool, *style, g_new(double, n_args), n_args / 2, NULL,
+                       shapes[i].redact_mode };
+        if (!parse_numbers(tokens + 1, n_args, op.points)) {
+            g_free(op.points);
+            g_set_error(error, BATCH_ERROR, 0, "%s expects numbers", cmd);
+            return FALSE;
+        }
+        if (polyline) {
+            op.stroke = stroke_new();
+            for (int j = 0; j < op.n_points; j++) {
+                stroke_add_point(op.stroke, op.points[2 * j], op.points[2 * j + 1], 1);
+            }
+            stroke_finish(op.stroke);
+        }
+        g_array_append_val(ops, op);
+        return TRUE;
+    }
+
+    g_set_error(error, BATCH_ERROR, 0, "unknown command \"%s\"", cmd);
+    return FALSE;
+}
+
+static GArray *load_script(const char *filename, GError **error) {
+    char *contents;
+    if (!g_file_get_contents(filename, &contents, NULL, error)) return NULL;
+
+    GArray *ops = g_array_new(FALSE, FALSE, sizeof(BatchOp));
+    g_array_set_clear_func(ops, free_op);
+    ShapeStyle style = { 0, 0, 0, 1, 3.0 };
+
+    char **lines = g_strsplit(contents, "\n", -1);
+    GError *line_error = NULL;
+
+    for (int i = 0; lines[i] && !line_error; i++) {
+        char *line = g_strstrip(lines[i]);
+        if (!*line || *line == '#') continue;
+
+        /* Split on runs of blanks, dropping the empty tokens between them. */
+        char **tokens = g_strsplit_set(line, " \t", -1);
+        int n = 0;
+        for (int j = 0; tokens[j]; j++) {
+            if (*tokens[j]) tokens[n++] = tokens[j];
+            else g_free(tokens[j]);
+        }
+        tokens[n] = NULL;
+
+        if (!parse_line(tokens, &style, ops, &line_error)) {
+            g_prefix_error(&line_error, "%s:%d: ", filename, i + 1);
+        }
+        g_strfreev(tokens);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (line_error) {
+        g_propagate_error(error, line_error);
+        g_array_free(ops, TRUE);
+        return NULL;
+    }
+    return ops;
+}
+
+static void draw_op_shape(cairo_t *cr, gpointer data) {
+    const BatchOp *op = data;
+    draw_shape(cr, op->tool, &op->style, op->points[0], op->points[1],
+               op->points[2], op->points[3]);
+}
+
+static void draw_op_stroke(cairo_t *cr, gpointer data) {
+    const BatchOp *op = data;
+    stroke_fill(cr, op->stroke, &op->style);
+}
+
+static void annotate(Canvas *canvas) {
+    for (guint i = 0; i < script->len; i++) {
+        BatchOp *op = &g_array_index(script, BatchOp, i);
+        const double *p = op->points;
+        double bx1, by1, bx2, by2;
+
+        if (op->tool == TOOL_REDACT) {
+            /* A fresh seed per image, as in the editor, so the jitter
+             * cannot be replayed against the output. */
+            apply_redact(canvas, p[0], p[1], p[2], p[3], op->redact_mode, g_random_int());
+        } else if (op->tool == TOOL_PEN) {
+            stroke_get_bounds(op->stroke, &op->style, &bx1, &by1, &bx2, &by2);
+            canvas_draw(canvas, bx1, by1, bx2, by2, draw_op_stroke, op);
+        } else {
+            shape_bounds(op->tool, &op->style, p[0], p[1], p[2], p[3], &bx1, &by1, &bx2, &by2);
+            canvas_draw(canvas, bx1, by1, bx2, by2, draw_op_shape, op);
+        }
+    }
+}
+
+static char *output_path(const char *input, const char *output_dir) {
+    char *base = g_path_get_basename(input);
+    char *dot = strrchr(base, '.');
+    if (dot && dot != base) *dot = '\0';
+
+    char *path;
+    if (output_dir) {
+        char *name = g_strconcat(base, ".", extension, NULL);
+        path = g_build_filename(output_dir, name, NULL);
+        g_free(name);
+    } else {
+        char *dir = g_path_get_dirname(input);
+        char *name = g_strconcat(base, "-annotated.", extension, NULL);
+        path = g_build_filename(dir, name, NULL);
+        g_free(name);
+        g_free(dir);
+    }
+    g_free(base);
+    return path;
+}
+
+/* Key identifying filename on disk, so paths spelled differently or
+ * through links still match; NULL if it does not exist yet. */
+static char *file_key(const char *filename) {
+    GStatBuf st;
+    if (g_stat(filename, &st) != 0) return NULL;
+    return g_strdup_printf("%ju:%ju", (uintmax_t)st.st_dev, (uintmax_t)st.st_ino);
+}
+
+/* Refuses outputs that would overwrite an input or each other, before
+ * anything is written. */
+static gboolean check_outputs(const BatchImage *images, int n_images) {
+    GHashTable *inputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gboolean ok = TRUE;
+
+    for (int i = 0; i < n_images; i++) {
+        g_hash_table_insert(inputs, g_canonicalize_filename(images[i].input, NULL),
+                            (gpointer)images[i].input);
+        char *key = file_key(images[i].input);
+        if (key) g_hash_table_insert(inputs, key, (gpointer)images[i].input);
+    }
+
+    for (int i = 0; i < n_images && ok; i++) {
+        char *path = g_canonicalize_filename(images[i].output, NULL);
+        char *key = file_key(images[i].output);
+        const char *input = g_hash_table_lookup(inputs, path);
+        if (!input && key) input = g_hash_table_lookup(inputs, key);
+        const BatchImage *other = g_hash_table_lookup(outputs, path);
+
+        if (input) {
+            g_printerr("%s would overwrite input %s\n", images[i].output, input);
+            ok = FALSE;
+        } else if (other) {
+            g_printerr("%s and %s would both be written to %s\n",
+                       other->input, images[i].input, images[i].output);
+            ok = FALSE;
+        }
+        g_hash_table_insert(outputs, path, (gpointer)&images[i]);
+        g_free(key);
+    }
+
+    g_hash_table_destroy(outputs);
+    g_hash_table_destroy(inputs);
+    return ok;
+}
+
+static double megapixels(const BatchImage *image) {
+    return (double)image->width * image->height / 1e6;
+}
+
+static void process_image(gpointer data, gpointer user_data) {
+    BatchImage *image = data;
+    GError *error = NULL;
+
+    gint64 t0 = g_get_monotonic_time();
+    Canvas *canvas = imageio_load(image->input, &error);
+    gint64 t1 = g_get_monotonic_time();
+    if (!canvas) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    annotate(canvas);
+    gint64 t2 = g_get_monotonic_time();
+    ExportOptions options;
+    export_options_init(&options, export_format_from_name(image->output), preset);
+    image->ok = imageio_save(canvas, image->output, &options, NULL, NULL, &error);
+    gint64 t3 = g_get_monotonic_time();
+
+    image->width = canvas_get_width(canvas);
+    image->height = canvas_get_height(canvas);
+    image->load_us = t1 - t0;
+    image->draw_us = t2 - t1;
+    image->save_us = t3 - t2;
+    canvas_free(canvas);
+
+    if (!image->ok) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    g_print("%s: %dx%d, load %.1f ms, annotate %.1f ms, save %.1f ms, %.1f MP/s\n",
+            image->output, image->width, image->height,
+            image->load_us / 1e3, image->draw_us / 1e3, image->save_us / 1e3,
+            megapixels(image) / MAX(t3 - t0, 1) * 1e6);
+}
+
+int batch_main(int argc, char **argv) {
+    char *script_file = NULL;
+    char *output_dir = NULL;
+    int jobs = 0;
+    char *format = NULL;
+    char *preset_name = NULL;
+    char **inputs = NULL;
+    GOptionEntry entries[] = {
+        { "script", 's', 0, G_OPTION_ARG_FILENAME, &script_file, "Annotation script", "SCRIPT" },
+        { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Write results into DIR", "DIR" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Images to process at once", "JOBS" },
+        { "format", 'f', 0, G_OPTION_ARG_STRING, &format, "png (default), jpg or webp", "FORMAT" },
+        { "preset", 'p', 0, G_OPTION_ARG_STRING, &preset_name,
+          "fast, balanced (default) or smallest", "PRESET" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL, "IMAGE..." },
+        { NULL }
+    };
+
+    GOptionContext *context = g_option_context_new("- annotate images without a display");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    GError *error = NULL;
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if (!script_file || !inputs) {
+        g_printerr("Usage: crayons --batch -s SCRIPT [-o DIR] [-j JOBS] [-f FORMAT] "
+                   "[-p PRESET] IMAGE...\n");
+        return EXIT_FAILURE;
+    }
+    if (format) {
+        char *name = g_strconcat(".", format, NULL);
+        gboolean known = export_format_from_name(name) != EXPORT_PNG ||
+                         g_ascii_strcasecmp(format, "png") == 0;
+        g_free(name);
+        if (!known) {
+            g_printerr("Unknown format %s\n", format);
+            return EXIT_FAILURE;
+        }
+        extension = format;
+    }
+    if (preset_name && !export_preset_from_name(preset_name, &preset)) {
+        g_printerr("Unknown preset %s\n", preset_name);
+        return EXIT_FAILURE;
+    }
+
+    script = load_script(script_file, &error);
+    if (!script) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if (output_dir && g_mkdir_with_parents(output_dir, 0755) != 0) {
+        g_printerr("Could not create %s: %s\n", output_dir, g_strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int n_images = g_strv_length(inputs);
+    BatchImage *images = g_new0(BatchImage, n_images);
+    if (jobs <= 0) jobs = parallel_threads();
+    jobs = MIN(jobs, n_images);
+
+    for (int i = 0; i < n_images; i++) {
+        images[i].input = inputs[i];
+        images[i].output = output_path(inputs[i], output_dir);
+    }
+    if (!check_outputs(images, n_images)) return EXIT_FAILURE;
+
+    gint64 start = g_get_monotonic_time();
+    GThreadPool *pool = g_thread_pool_new(process_image, NULL, jobs, TRUE, NULL);
+    for (int i = 0; i < n_images; i++) g_thread_pool_push(pool, &images[i], NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    int failed = 0;
+    double total_mp = 0;
+    for (int i = 0; i < n_images; i++) {
+        if (images[i].ok) total_mp += megapixels(&images[i]);
+        else failed++;
+        g_free(images[i].output);
+    }
+    g_print("%d images (%d failed) on %d threads in %.2f s: %.1f images/s, %.1f MP/s\n",
+            n_images, failed, jobs, elapsed / 1e6,
+            (n_images - failed) / (elapsed / 1e6), total_mp / (elapsed / 1e6));
+
+    g_free(images);
+    g_array_free(script, TRUE);
+    g_strfreev(inputs);
+    g_free(preset_name);
+    g_free(format);
+    g_free(output_dir);
+    g_free(script_file);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef CRAYONS_BATCH_H
+#define CRAYONS_BATCH_H
+
+/*
+ * Headless batch annotation.
+ *
+ *     crayons --batch -s SCRIPT [-o DIR] [-j JOBS] [-f FORMAT] [-p PRESET] IMAGE...
+ *
+ * Applies the same annotation script to every image and writes the results
+ * as FORMAT, PNG by default, either into DIR or next to the input as
+ * NAME-annotated.png, with the export.h preset PRESET. Nothing is written if
+ * a result would replace an input or two results would share a name.
+ * Images are processed in parallel on JOBS threads, all cores by default.
+ * Nothing here opens a display.
+ *
+ * The script has one command per line; blank lines and lines starting with
+ * '#' are ignored. Coordinates are canvas pixels.
+ *
+ *     color COLOR                  any colour gdk_rgba_parse() accepts
+ *     size WIDTH                   line width
+ *     rect X1 Y1 X2 Y2
+ *     ellipse X1 Y1 X2 Y2
+ *     arrow X1 Y1 X2 Y2            points from (X1, Y1) to (X2, Y2)
+ *     pen X1 Y1 X2 Y2 ...          polyline through two or more points
+ *     redact X1 Y1 X2 Y2           jitter filter
+ *     blur X1 Y1 X2 Y2
+ *     pixelate X1 Y1 X2 Y2
+ *
+ * color and size apply to the commands after them.
+ */
+
+/* argv[0] is "--batch". Returns the process exit status. */
+int batch_main(int argc, char **argv);
+
+#endif
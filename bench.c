@@ -0,0 +1,392 @@
+/*
+ * Benchmarks for the drawing hot paths.
+ *
+ *     crayons-bench [-o FILE] [-r RUNS] [-s WxH,WxH...]
+ *
+ * Times the redaction filters and the first frame of their previews,
+ * snapshots, adding and undoing every annotation tool, pen stroke
+ * geometry, saving with the export presets and PNG load on synthetic
+ * canvases from 800x600 up to 8K. Results are
+ * written as JSON to FILE, or stdout, so they can be compared across
+ * versions. Nothing here opens a display.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "annotations.h"
+#include "imageio.h"
+#include "parallel.h"
+#include "shapes.h"
+#include "stroke.h"
+
+#define DEFAULT_SIZES "800x600,1920x1080,3840x2160,7680x4320"
+#define DEFAULT_RUNS 5
+
+/* Input samples in the benchmark pen stroke, about two seconds of a
+ * 1000 Hz mouse. */
+#define PEN_SAMPLES 2000
+
+/* Time the editor gives each redact preview frame, as in main.c. */
+#define PREVIEW_BUDGET_US 8000
+
+typedef void (*BenchFunc)(gpointer data);
+
+typedef struct {
+    Canvas *canvas;             /* composite */
+    DisplayList *list;
+    char *png;                  /* scratch file for save and load */
+    int width, height;
+} BenchCanvas;
+
+typedef struct {
+    BenchCanvas *bc;
+    ExportOptions options;
+    char *filename;
+} SaveBench;
+
+static GString *json = NULL;
+static int runs = DEFAULT_RUNS;
+static gboolean first_result = TRUE;
+
+static int compare_times(const void *a, const void *b) {
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+/* Runs func runs times, after setup if given, and records min and median.
+ * items, if positive, adds a throughput figure for what one run processes. */
+static void bench(const char *name, const BenchCanvas *bc, BenchFunc setup, BenchFunc func,
+                  gpointer data, int items) {
+    gint64 *times = g_new(gint64, runs);
+
+    for (int i = 0; i < runs; i++) {
+        if (setup) setup(data);
+        gint64 start = g_get_monotonic_time();
+        func(data);
+        times[i] = g_get_monotonic_time() - start;
+    }
+    qsort(times, runs, sizeof(gint64), compare_times);
+
+    double min_ms = times[0] / 1e3;
+    double median_ms = times[runs / 2] / 1e3;
+    g_free(times);
+
+    g_printerr("%-18s %5dx%-5d  min %9.3f ms  median %9.3f ms\n",
+               name, bc->width, bc->height, min_ms, median_ms);
+
+    g_string_append_printf(json, "%s\n    { \"name\": \"%s\", \"width\": %d, \"height\": %d, "
+                           "\"runs\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f",
+                           first_result ? "" : ",", name, bc->width, bc->height,
+                           runs, min_ms, median_ms);
+    if (items > 0) {
+        g_string_append_printf(json, ", \"items\": %d, \"items_per_s\": %.0f",
+                               items, items / fmax(min_ms / 1e3, 1e-9));
+    }
+    g_string_append(json, " }");
+    first_result = FALSE;
+}
+
+/* Fills the canvas with a smooth gradient plus noise, so every tile is
+ * allocated and PNG compression has realistic work to do. */
+static Canvas *make_canvas(int width, int height) {
+    Canvas *canvas = canvas_new(width, height, CANVAS_WHITE);
+    guint32 *row = g_new(guint32, width);
+    GRand *rand = g_rand_new_with_seed(1);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            guint32 noise = g_rand_int(rand) & 0x0F;
+            guint32 r = (x * 255 / width) ^ noise;
+            guint32 g = (y * 255 / height) ^ noise;
+            guint32 b = ((x + y) & 0xFF) ^ noise;
+            row[x] = 0xFF000000u | (r << 16) | (g << 8) | b;
+        }
+        cairo_rectangle_int_t r = { 0, y, width, 1 };
+        canvas_write(canvas, &r, (const guint8 *)row, width * 4);
+    }
+
+    g_rand_free(rand);
+    g_free(row);
+    return canvas;
+}
+
+/* A scribble across the middle half of the canvas. */
+static Stroke *make_stroke(const BenchCanvas *bc) {
+    Stroke *stroke = stroke_new();
+    for (int i = 0; i < PEN_SAMPLES; i++) {
+        double t = (double)i / (PEN_SAMPLES - 1);
+        double x = bc->width * (0.25 + 0.5 * t);
+        double y = bc->height * (0.5 + 0.2 * sin(t * 12 * M_PI));
+        stroke_add_point(stroke, x, y, 0.5 + 0.5 * sin(t * 5 * M_PI));
+    }
+    return stroke;
+}
+
+static const ShapeStyle bench_style = { 0.9, 0.1, 0.1, 0.7, 5.0 };
+
+typedef struct {
+    BenchCanvas *bc;
+    ToolType tool;
+} ToolBench;
+
+static Annotation *make_annotation(const ToolBench *tb) {
+    const BenchCanvas *bc = tb->bc;
+    double x1 = bc->width * 0.25, y1 = bc->height * 0.25;
+    double x2 = bc->width * 0.75, y2 = bc->height * 0.75;
+
+    switch (tb->tool) {
+    case TOOL_PEN: return annotation_new_stroke(&bench_style, make_stroke(bc));
+    case TOOL_REDACT: return annotation_new_redact(x1, y1, x2, y2, REDACT_JITTER, 1234);
+    default: return annotation_new_shape(tb->tool, &bench_style, x1, y1, x2, y2);
+    }
+}
+
+static void run_add(gpointer data) {
+    ToolBench *tb = data;
+    cairo_rectangle_int_t changed;
+    display_list_add(tb->bc->list, tb->bc->canvas, make_annotation(tb), &changed);
+}
+
+static void run_undo(gpointer data) {
+    ToolBench *tb = data;
+    cairo_rectangle_int_t changed;
+    display_list_undo(tb->bc->list, tb->bc->canvas, &changed);
+}
+
+static void run_redo(gpointer data) {
+    ToolBench *tb = data;
+    cairo_rectangle_int_t changed;
+    display_list_redo(tb->bc->list, tb->bc->canvas, &changed);
+}
+
+/* Each undo needs something on the list to take back. */
+static void setup_undo(gpointer data) {
+    ToolBench *tb = data;
+    if (display_list_get_length(tb->bc->list) == 0) run_redo(data);
+}
+
+static void redact_middle(BenchCanvas *bc, RedactMode mode) {
+    apply_redact(bc->canvas, bc->width * 0.25, bc->height * 0.25,
+                 bc->width * 0.75, bc->height * 0.75, mode, 1234);
+}
+
+static void run_redact(gpointer data) {
+    redact_middle(data, REDACT_JITTER);
+}
+
+/* The whole canvas, so 3840x2160 gives the figure for a full 4K region. */
+static void run_redact_full(gpointer data) {
+    BenchCanvas *bc = data;
+    apply_redact(bc->canvas, 0, 0, bc->width, bc->height, REDACT_JITTER, 1234);
+}
+
+static void run_blur(gpointer data) {
+    redact_middle(data, REDACT_BLUR);
+}
+
+static void run_pixelate(gpointer data) {
+    redact_middle(data, REDACT_PIXELATE);
+}
+
+/* The first frame of a drag over the middle of the canvas, all of it on
+ * screen: how far past its deadline a frame that cannot finish runs. */
+static void preview_middle(BenchCanvas *bc, RedactMode mode) {
+    cairo_rectangle_int_t rect = {
+        bc->width / 4, bc->height / 4, bc->width / 2, bc->height / 2,
+    };
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                          rect.width, rect.height);
+    cairo_t *cr = cairo_create(surface);
+    cairo_translate(cr, -rect.x, -rect.y);
+
+    redact_preview_begin(mode, 1234);
+    redact_preview_draw(cr, bc->canvas, &rect, &rect, g_get_monotonic_time() + PREVIEW_BUDGET_US);
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+}
+
+static void run_preview_redact(gpointer data) {
+    preview_middle(data, REDACT_JITTER);
+}
+
+static void run_preview_blur(gpointer data) {
+    preview_middle(data, REDACT_BLUR);
+}
+
+static void run_preview_pixelate(gpointer data) {
+    preview_middle(data, REDACT_PIXELATE);
+}
+
+static void run_snapshot(gpointer data) {
+    BenchCanvas *bc = data;
+    canvas_free(canvas_snapshot(bc->canvas));
+}
+
+static void run_stroke(gpointer data) {
+    BenchCanvas *bc = data;
+    Stroke *stroke = make_stroke(bc);
+    stroke_finish(stroke);
+    stroke_free(stroke);
+}
+
+static void run_save(gpointer data) {
+    SaveBench *sb = data;
+    GError *error = NULL;
+    if (!imageio_save(sb->bc->canvas, sb->filename, &sb->options, NULL, NULL, &error)) {
+        g_printerr("%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void run_load(gpointer data) {
+    BenchCanvas *bc = data;
+    GError *error = NULL;
+    Canvas *canvas = imageio_load(bc->png, &error);
+    if (!canvas) {
+        g_printerr("%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    canvas_free(canvas);
+}
+
+static void bench_size(int width, int height, const char *dir) {
+    static const struct {
+        const char *name;
+        ToolType tool;
+    } tools[] = {
+        { "pen", TOOL_PEN },
+        { "rect", TOOL_RECT },
+        { "ellipse", TOOL_ELLIPSE },
+        { "arrow", TOOL_ARROW },
+        { "redact", TOOL_REDACT },
+    };
+    /* The PNG saved last is the one load_png reads. Lossless WebP takes
+     * much longer than the rest, so only its fast preset is timed. */
+    static const struct {
+        const char *name;
+        const char *file;
+        ExportFormat format;
+        ExportPreset preset;
+    } saves[] = {
+        { "save_png_fast", "bench.png", EXPORT_PNG, EXPORT_FAST },
+        { "save_png_smallest", "bench.png", EXPORT_PNG, EXPORT_SMALLEST },
+        { "save_png", "bench.png", EXPORT_PNG, EXPORT_BALANCED },
+        { "save_jpeg", "bench.jpg", EXPORT_JPEG, EXPORT_BALANCED },
+        { "save_webp_fast", "bench.webp", EXPORT_WEBP, EXPORT_FAST },
+    };
+    BenchCanvas bc = { make_canvas(width, height), NULL, NULL, width, height };
+    bc.list = display_list_new(canvas_snapshot(bc.canvas));
+    bc.png = g_build_filename(dir, "bench.png", NULL);
+
+    bench("apply_redact", &bc, NULL, run_redact, &bc, 0);
+    bench("apply_redact_full", &bc, NULL, run_redact_full, &bc, 0);
+    bench("apply_blur", &bc, NULL, run_blur, &bc, 0);
+    bench("apply_pixelate", &bc, NULL, run_pixelate, &bc, 0);
+    bench("preview_redact", &bc, NULL, run_preview_redact, &bc, 0);
+    bench("preview_blur", &bc, NULL, run_preview_blur, &bc, 0);
+    bench("preview_pixelate", &bc, NULL, run_preview_pixelate, &bc, 0);
+    redact_preview_reset();
+    bench("snapshot", &bc, NULL, run_snapshot, &bc, 0);
+    bench("stroke_finish", &bc, NULL, run_stroke, &bc, PEN_SAMPLES);
+
+    for (gsize i = 0; i < G_N_ELEMENTS(tools); i++) {
+        ToolBench tb = { &bc, tools[i].tool };
+        char *add = g_strconcat("add_", tools[i].name, NULL);
+        char *undo = g_strconcat("undo_", tools[i].name, NULL);
+
+        bench(add, &bc, NULL, run_add, &tb, 0);
+        bench(undo, &bc, setup_undo, run_undo, &tb, 0);
+
+        /* Start every tool from the bare image. */
+        display_list_free(bc.list);
+        canvas_free(bc.canvas);
+        bc.canvas = make_canvas(width, height);
+        bc.list = display_list_new(canvas_snapshot(bc.canvas));
+        g_free(undo);
+        g_free(add);
+    }
+
+    for (gsize i = 0; i < G_N_ELEMENTS(saves); i++) {
+        SaveBench sb = { &bc };
+        export_options_init(&sb.options, saves[i].format, saves[i].preset);
+        sb.filename = g_build_filename(dir, saves[i].file, NULL);
+        bench(saves[i].name, &bc, NULL, run_save, &sb, 0);
+        if (saves[i].format != EXPORT_PNG) g_unlink(sb.filename);
+        g_free(sb.filename);
+    }
+    bench("load_png", &bc, NULL, run_load, &bc, 0);
+
+    g_unlink(bc.png);
+    g_free(bc.png);
+    display_list_free(bc.list);
+    canvas_free(bc.canvas);
+}
+
+int main(int argc, char **argv) {
+    char *output = NULL;
+    char *sizes = NULL;
+    GOptionEntry entries[] = {
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write JSON results to FILE", "FILE" },
+        { "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Runs per benchmark", "RUNS" },
+        { "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes, "Canvas sizes, e.g. " DEFAULT_SIZES, "WxH,..." },
+        { NULL }
+    };
+
+    GOptionContext *context = g_option_context_new("- time the drawing hot paths");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    GError *error = NULL;
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    runs = MAX(runs, 1);
+
+    char *dir = g_dir_make_tmp("crayons-bench-XXXXXX", &error);
+    if (!dir) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+
+    json = g_string_new(NULL);
+    g_string_append_printf(json, "{\n  \"threads\": %d,\n  \"results\": [", parallel_threads());
+
+    char **list = g_strsplit(sizes ? sizes : DEFAULT_SIZES, ",", -1);
+    for (int i = 0; list[i]; i++) {
+        int width, height;
+        if (sscanf(list[i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+            g_printerr("Invalid size \"%s\"\n", list[i]);
+            return EXIT_FAILURE;
+        }
+        bench_size(width, height, dir);
+    }
+    g_strfreev(list);
+    g_rmdir(dir);
+    g_free(dir);
+
+    g_string_append(json, "\n  ]\n}\n");
+    int status = EXIT_SUCCESS;
+    if (output) {
+        if (!g_file_set_contents(output, json->str, json->len, &error)) {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+            status = EXIT_FAILURE;
+        }
+    } else {
+        fputs(json->str, stdout);
+    }
+
+    g_string_free(json, TRUE);
+    g_free(sizes);
+    g_free(output);
+    return status;
+}
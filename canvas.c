@@ -0,0 +1,307 @@
+#include "canvas.h"
+
+#include <math.h>
+#include <string.h>
+
+struct _Canvas {
+    int width, height;
+    int tiles_x, tiles_y;
+    guint32 fill;
+    cairo_surface_t **tiles;    /* tiles_x * tiles_y, NULL until written */
+};
+
+Canvas *canvas_new(int width, int height, guint32 fill) {
+    Canvas *canvas = g_new0(Canvas, 1);
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->fill = fill;
+    canvas->tiles = g_new0(cairo_surface_t *, (gsize)canvas->tiles_x * canvas->tiles_y);
+    return canvas;
+}
+
+void canvas_free(Canvas *canvas) {
+    if (!canvas) return;
+
+    for (gsize i = 0; i < (gsize)canvas->tiles_x * canvas->tiles_y; i++) {
+        if (canvas->tiles[i]) cairo_surface_destroy(canvas->tiles[i]);
+    }
+    g_free(canvas->tiles);
+    g_free(canvas);
+}
+
+int canvas_get_width(const Canvas *canvas) {
+    return canvas->width;
+}
+
+int canvas_get_height(const Canvas *canvas) {
+    return canvas->height;
+}
+
+guint32 canvas_get_fill(const Canvas *canvas) {
+    return canvas->fill;
+}
+
+cairo_surface_t *canvas_peek_tile(const Canvas *canvas, int tx, int ty) {
+    return canvas->tiles[(gsize)ty * canvas->tiles_x + tx];
+}
+
+cairo_surface_t *canvas_get_tile(Canvas *canvas, int tx, int ty) {
+    cairo_surface_t **slot = &canvas->tiles[(gsize)ty * canvas->tiles_x + tx];
+    cairo_surface_t *shared = *slot;
+    if (shared && cairo_surface_get_reference_count(shared) == 1) return shared;
+
+    /* Edge tiles are allocated full size too, which keeps every tile's
+     * layout the same; pixels past the canvas edge are never shown. */
+    cairo_surface_t *tile = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                       CANVAS_TILE_SIZE, CANVAS_TILE_SIZE);
+    guint8 *data = cairo_image_surface_get_data(tile);
+    int stride = cairo_image_surface_get_stride(tile);
+
+    if (shared) {
+        /* A snapshot still references the tile, so write to a copy. */
+        const guint8 *in = cairo_image_surface_get_data(shared);
+        int in_stride = cairo_image_surface_get_stride(shared);
+        for (int y = 0; y < CANVAS_TILE_SIZE; y++) {
+            memcpy(data + (size_t)y * stride, in + (size_t)y * in_stride, CANVAS_TILE_SIZE * 4);
+        }
+        cairo_surface_destroy(shared);
+    } else {
+        for (int y = 0; y < CANVAS_TILE_SIZE; y++) {
+            guint32 *row = (guint32 *)(data + (size_t)y * stride);
+            for (int x = 0; x < CANVAS_TILE_SIZE; x++) row[x] = canvas->fill;
+        }
+    }
+    cairo_surface_mark_dirty(tile);
+
+    *slot = tile;
+    return tile;
+}
+
+Canvas *canvas_snapshot(const Canvas *canvas) {
+    Canvas *copy = canvas_new(canvas->width, canvas->height, canvas->fill);
+
+    for (gsize i = 0; i < (gsize)canvas->tiles_x * canvas->tiles_y; i++) {
+        if (!canvas->tiles[i]) continue;
+        cairo_surface_flush(canvas->tiles[i]);
+        copy->tiles[i] = cairo_surface_reference(canvas->tiles[i]);
+    }
+    return copy;
+}
+
+guint32 canvas_get_pixel(const Canvas *canvas, int x, int y) {
+    cairo_surface_t *tile = canvas_peek_tile(canvas, x / CANVAS_TILE_SIZE, y / CANVAS_TILE_SIZE);
+    if (!tile) return canvas->fill;
+
+    const guint8 *data = cairo_image_surface_get_data(tile);
+    int stride = cairo_image_surface_get_stride(tile);
+    return *(const guint32 *)(data + (size_t)(y % CANVAS_TILE_SIZE) * stride
+                                    + (size_t)(x % CANVAS_TILE_SIZE) * 4);
+}
+
+/* Loops over the tiles intersecting the canvas rectangle r. */
+#define FOR_EACH_TILE(r, tx, ty)                                                         \
+    for (int ty = (r)->y / CANVAS_TILE_SIZE;                                             \
+         ty <= ((r)->y + (r)->height - 1) / CANVAS_TILE_SIZE; ty++)                      \
+        for (int tx = (r)->x / CANVAS_TILE_SIZE;                                         \
+             tx <= ((r)->x + (r)->width - 1) / CANVAS_TILE_SIZE; tx++)
+
+/* The part of r inside tile (tx, ty), in canvas coordinates. */
+static cairo_rectangle_int_t tile_part(const cairo_rectangle_int_t *r, int tx, int ty) {
+    cairo_rectangle_int_t part;
+    part.x = MAX(r->x, tx * CANVAS_TILE_SIZE);
+    part.y = MAX(r->y, ty * CANVAS_TILE_SIZE);
+    part.width = MIN(r->x + r->width, (tx + 1) * CANVAS_TILE_SIZE) - part.x;
+    part.height = MIN(r->y + r->height, (ty + 1) * CANVAS_TILE_SIZE) - part.y;
+    return part;
+}
+
+void canvas_read(const Canvas *canvas, const cairo_rectangle_int_t *r,
+                 guint8 *dst, int dst_stride) {
+    if (r->width <= 0 || r->height <= 0) return;
+
+    FOR_EACH_TILE(r, tx, ty) {
+        cairo_rectangle_int_t part = tile_part(r, tx, ty);
+        guint8 *out = dst + (size_t)(part.y - r->y) * dst_stride + (size_t)(part.x - r->x) * 4;
+        cairo_surface_t *tile = canvas_peek_tile(canvas, tx, ty);
+
+        if (!tile) {
+            for (int y = 0; y < part.height; y++) {
+                guint32 *row = (guint32 *)(out + (size_t)y * dst_stride);
+                for (int x = 0; x < part.width; x++) row[x] = canvas->fill;
+            }
+            continue;
+        }
+
+        cairo_surface_flush(tile);
+        const guint8 *data = cairo_image_surface_get_data(tile);
+        int stride = cairo_image_surface_get_stride(tile);
+        const guint8 *in = data + (size_t)(part.y % CANVAS_TILE_SIZE) * stride
+                                + (size_t)(part.x % CANVAS_TILE_SIZE) * 4;
+        for (int y = 0; y < part.height; y++) {
+            memcpy(out + (size_t)y * dst_stride, in + (size_t)y * stride, (size_t)part.width * 4);
+        }
+    }
+}
+
+gsize canvas_get_size(const Canvas *canvas, const Canvas *other) {
+    gsize n = (gsize)canvas->tiles_x * canvas->tiles_y;
+    gsize tiles = 0;
+    for (gsize i = 0; i < n; i++) {
+        if (canvas->tiles[i] && (!other || other->tiles[i] != canvas->tiles[i])) tiles++;
+    }
+    return tiles * CANVAS_TILE_SIZE * CANVAS_TILE_SIZE * 4;
+}
+
+char *canvas_checksum(const Canvas *canvas) {
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    guint32 size[2] = { GUINT32_TO_LE(canvas->width), GUINT32_TO_LE(canvas->height) };
+    g_checksum_update(checksum, (const guchar *)size, sizeof(size));
+
+    guint8 *row = g_malloc((size_t)canvas->width * 4);
+    for (int y = 0; y < canvas->height; y++) {
+        cairo_rectangle_int_t r = { 0, y, canvas->width, 1 };
+        canvas_read(canvas, &r, row, canvas->width * 4);
+        g_checksum_update(checksum, row, (gssize)canvas->width * 4);
+    }
+    g_free(row);
+
+    char *hex = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return hex;
+}
+
+void canvas_write(Canvas *canvas, const cairo_rectangle_int_t *r,
+                  const guint8 *src, int src_stride) {
+    if (r->width <= 0 || r->height <= 0) return;
+
+    FOR_EACH_TILE(r, tx, ty) {
+        cairo_rectangle_int_t part = tile_part(r, tx, ty);
+        cairo_surface_t *tile = canvas_get_tile(canvas, tx, ty);
+        cairo_surface_flush(tile);
+
+        guint8 *data = cairo_image_surface_get_data(tile);
+        int stride = cairo_image_surface_get_stride(tile);
+        int lx = part.x % CANVAS_TILE_SIZE;
+        int ly = part.y % CANVAS_TILE_SIZE;
+        const guint8 *in = src + (size_t)(part.y - r->y) * src_stride + (size_t)(part.x - r->x) * 4;
+        for (int y = 0; y < part.height; y++) {
+            memcpy(data + (size_t)(ly + y) * stride + (size_t)lx * 4,
+                   in + (size_t)y * src_stride, (size_t)part.width * 4);
+        }
+        cairo_surface_mark_dirty_rectangle(tile, lx, ly, part.width, part.height);
+    }
+}
+
+void canvas_copy(Canvas *dst, const Canvas *src, const cairo_rectangle_int_t *r) {
+    if (r->width <= 0 || r->height <= 0) return;
+
+    guint8 *buffer = NULL;
+    FOR_EACH_TILE(r, tx, ty) {
+        cairo_rectangle_int_t part = tile_part(r, tx, ty);
+        cairo_surface_t **slot = &dst->tiles[(gsize)ty * dst->tiles_x + tx];
+        cairo_surface_t *tile = canvas_peek_tile(src, tx, ty);
+        gboolean whole = part.width == MIN(CANVAS_TILE_SIZE, dst->width - tx * CANVAS_TILE_SIZE) &&
+                         part.height == MIN(CANVAS_TILE_SIZE, dst->height - ty * CANVAS_TILE_SIZE);
+
+        if (whole && (tile || src->fill == dst->fill)) {
+            if (tile) {
+                cairo_surface_flush(tile);
+                cairo_surface_reference(tile);
+            }
+            if (*slot) cairo_surface_destroy(*slot);
+            *slot = tile;
+            continue;
+        }
+
+        if (!buffer) buffer = g_malloc((size_t)CANVAS_TILE_SIZE * CANVAS_TILE_SIZE * 4);
+        canvas_read(src, &part, buffer, part.width * 4);
+        canvas_write(dst, &part, buffer, part.width * 4);
+    }
+    g_free(buffer);
+}
+
+/* Integer canvas pixels touched by the given bounds, clipped to the canvas. */
+static gboolean canvas_bounds(const Canvas *canvas, double x1, double y1, double x2, double y2,
+                              cairo_rectangle_int_t *r) {
+    int left = MAX((int)floor(fmin(x1, x2)), 0);
+    int top = MAX((int)floor(fmin(y1, y2)), 0);
+    int right = MIN((int)ceil(fmax(x1, x2)), canvas->width);
+    int bottom = MIN((int)ceil(fmax(y1, y2)), canvas->height);
+
+    r->x = left;
+    r->y = top;
+    r->width = right - left;
+    r->height = bottom - top;
+    return r->width > 0 && r->height > 0;
+}
+
+void canvas_draw(Canvas *canvas, double x1, double y1, double x2, double y2,
+                 CanvasDrawFunc func, gpointer data) {
+    cairo_rectangle_int_t r;
+    if (!canvas_bounds(canvas, x1, y1, x2, y2, &r)) return;
+
+    FOR_EACH_TILE(&r, tx, ty) {
+        cairo_t *cr = cairo_create(canvas_get_tile(canvas, tx, ty));
+        cairo_translate(cr, -tx * CANVAS_TILE_SIZE, -ty * CANVAS_TILE_SIZE);
+        cairo_rectangle(cr, tx * CANVAS_TILE_SIZE, ty * CANVAS_TILE_SIZE,
+                        CANVAS_TILE_SIZE, CANVAS_TILE_SIZE);
+        cairo_clip(cr);
+        func(cr, data);
+        cairo_destroy(cr);
+    }
+}
+
+void canvas_paint(const Canvas *canvas, cairo_t *cr,
+                  double x1, double y1, double x2, double y2, cairo_filter_t filter) {
+    cairo_rectangle_int_t r;
+    if (!canvas_bounds(canvas, x1, y1, x2, y2, &r)) return;
+
+    double fa = (canvas->fill >> 24) / 255.0;
+    double fr = fa > 0 ? ((canvas->fill >> 16) & 0xFF) / 255.0 / fa : 0;
+    double fg = fa > 0 ? ((canvas->fill >> 8) & 0xFF) / 255.0 / fa : 0;
+    double fb = fa > 0 ? (canvas->fill & 0xFF) / 255.0 / fa : 0;
+
+    cairo_save(cr);
+    /* Without antialiasing every device pixel belongs to exactly one tile,
+     * so neighbouring tiles meet without a seam at fractional zoom. */
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+
+    FOR_EACH_TILE(&r, tx, ty) {
+        cairo_rectangle_int_t part = tile_part(&r, tx, ty);
+        cairo_surface_t *tile = canvas_peek_tile(canvas, tx, ty);
+
+        if (tile) {
+            cairo_set_source_surface(cr, tile, tx * CANVAS_TILE_SIZE, ty * CANVAS_TILE_SIZE);
+            cairo_pattern_set_filter(cairo_get_source(cr), filter);
+            cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+        } else {
+            cairo_set_source_rgba(cr, fr, fg, fb, fa);
+        }
+        cairo_rectangle(cr, part.x, part.y, part.width, part.height);
+        cairo_fill(cr);
+    }
+    cairo_restore(cr);
+}
+
+void canvas_mask(const Canvas *mask, cairo_t *cr, double x1, double y1, double x2, double y2) {
+    cairo_rectangle_int_t r;
+    if (!canvas_bounds(mask, x1, y1, x2, y2, &r)) return;
+
+    cairo_save(cr);
+    cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+
+    FOR_EACH_TILE(&r, tx, ty) {
+        cairo_surface_t *tile = canvas_peek_tile(mask, tx, ty);
+        if (!tile) continue;
+
+        cairo_rectangle_int_t part = tile_part(&r, tx, ty);
+        cairo_save(cr);
+        cairo_rectangle(cr, part.x, part.y, part.width, part.height);
+        cairo_clip(cr);
+        cairo_mask_surface(cr, tile, tx * CANVAS_TILE_SIZE, ty * CANVAS_TILE_SIZE);
+        cairo_restore(cr);
+    }
+    cairo_restore(cr);
+}
@@ -0,0 +1,85 @@
+#ifndef CRAYONS_CANVAS_H
+#define CRAYONS_CANVAS_H
+
+#include <cairo.h>
+#include <glib.h>
+
+/*
+ * Tiled ARGB32 canvas.
+ *
+ * The image is split into CANVAS_TILE_SIZE square cairo image surfaces that
+ * are only allocated the first time something writes to them; until then a
+ * tile reads as the canvas fill colour. There is no single contiguous
+ * allocation, so the canvas is neither limited by cairo's 32767 pixel
+ * surface size nor by the largest block malloc can find.
+ *
+ * Reading is safe from several threads at once. Anything that writes or
+ * allocates tiles must run on one thread. To hand the image to another
+ * thread while editing continues, take a snapshot: it shares every tile
+ * with the canvas, and whichever side writes to a shared tile first copies
+ * it.
+ */
+
+#define CANVAS_TILE_SIZE 256
+#define CANVAS_WHITE 0xFFFFFFFFu
+
+typedef struct _Canvas Canvas;
+
+/* fill is a premultiplied ARGB32 pixel, e.g. 0xFFFFFFFF for white. */
+Canvas *canvas_new(int width, int height, guint32 fill);
+void canvas_free(Canvas *canvas);
+
+int canvas_get_width(const Canvas *canvas);
+int canvas_get_height(const Canvas *canvas);
+guint32 canvas_get_fill(const Canvas *canvas);
+
+/* Tile (tx, ty), or NULL if it has never been written. */
+cairo_surface_t *canvas_peek_tile(const Canvas *canvas, int tx, int ty);
+
+/* Tile (tx, ty) for writing, allocated and filled on first use and
+ * unshared from any snapshot. Callers writing to its data directly must
+ * flush and mark it dirty like any image surface. */
+cairo_surface_t *canvas_get_tile(Canvas *canvas, int tx, int ty);
+
+/* Copy-on-write copy of canvas in O(tiles). The snapshot may be read or
+ * freed on another thread while canvas keeps being edited. */
+Canvas *canvas_snapshot(const Canvas *canvas);
+
+guint32 canvas_get_pixel(const Canvas *canvas, int x, int y);
+
+/* Bytes of canvas's allocated tiles, leaving out those it shares with
+ * other, a canvas of the same size or NULL. */
+gsize canvas_get_size(const Canvas *canvas, const Canvas *other);
+
+/* Hex SHA-256 of the size and pixels, independent of which tiles are
+ * allocated. Free with g_free(). */
+char *canvas_checksum(const Canvas *canvas);
+
+/* Copies r, which must lie inside the canvas, to or from a packed buffer. */
+void canvas_read(const Canvas *canvas, const cairo_rectangle_int_t *r,
+                 guint8 *dst, int dst_stride);
+void canvas_write(Canvas *canvas, const cairo_rectangle_int_t *r,
+                  const guint8 *src, int src_stride);
+
+/* Copies r, which must lie inside both, from src into dst of the same size.
+ * Tiles r covers entirely are shared with src instead of copied. */
+void canvas_copy(Canvas *dst, const Canvas *src, const cairo_rectangle_int_t *r);
+
+typedef void (*CanvasDrawFunc)(cairo_t *cr, gpointer data);
+
+/* Calls func once for every tile intersecting the given canvas-space bounds,
+ * with cr in canvas coordinates and clipped to that tile. */
+void canvas_draw(Canvas *canvas, double x1, double y1, double x2, double y2,
+                 CanvasDrawFunc func, gpointer data);
+
+/* Paints the given canvas-space area into cr, which must be in canvas
+ * coordinates, sampling tiles with filter. */
+void canvas_paint(const Canvas *canvas, cairo_t *cr,
+                  double x1, double y1, double x2, double y2, cairo_filter_t filter);
+
+/* Paints cr's current source through the alpha of mask over the given
+ * canvas-space area, like cairo_mask_surface(). Tiles never written mask
+ * nothing, so mask's fill must be transparent. */
+void canvas_mask(const Canvas *mask, cairo_t *cr, double x1, double y1, double x2, double y2);
+
+#endif
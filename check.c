@@ -0,0 +1,464 @@
+/*
+ * Regression checks.
+ *
+ *     crayons-check
+ *
+ * Runs every check below on synthetic canvases, prints one line per check
+ * and exits with failure if any of them did not pass. Nothing here opens a
+ * display.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <png.h>
+
+#include "annotations.h"
+#include "imageio.h"
+#include "journal.h"
+#include "pixels.h"
+#include "redact.h"
+
+#define CHECK_WIDTH 400
+#define CHECK_HEIGHT 300
+
+typedef gboolean (*CheckFunc)(void);
+
+static const ShapeStyle check_style = { 0.1, 0.4, 0.9, 0.8, 4.0 };
+
+/* A gradient with noise, so every redaction changes what it reads. */
+static Canvas *make_canvas(int width, int height) {
+    Canvas *canvas = canvas_new(width, height, CANVAS_WHITE);
+    guint32 *row = g_new(guint32, width);
+    GRand *rand = g_rand_new_with_seed(1);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            guint32 noise = g_rand_int(rand) & 0x3F;
+            guint32 r = (x * 255 / width) ^ noise;
+            guint32 g = (y * 255 / height) ^ noise;
+            guint32 b = ((x + y) & 0xFF) ^ noise;
+            row[x] = 0xFF000000u | (r << 16) | (g << 8) | b;
+        }
+        cairo_rectangle_int_t r = { 0, y, width, 1 };
+        canvas_write(canvas, &r, (const guint8 *)row, width * 4);
+    }
+
+    g_rand_free(rand);
+    g_free(row);
+    return canvas;
+}
+
+/* Whether composite matches list drawn from scratch over its base. */
+static gboolean matches_rebuild(DisplayList *list, const Canvas *composite, const char *step) {
+    Canvas *fresh = canvas_new(canvas_get_width(composite), canvas_get_height(composite), 0);
+    display_list_set_base(list, canvas_snapshot(display_list_get_base(list)), fresh);
+
+    char *expected = canvas_checksum(fresh);
+    char *actual = canvas_checksum(composite);
+    gboolean same = strcmp(expected, actual) == 0;
+    if (!same) g_printerr("  after %s: canvas %s, rebuilt %s\n", step, actual, expected);
+
+    g_free(actual);
+    g_free(expected);
+    canvas_free(fresh);
+    return same;
+}
+
+/* Undo rebuilds the composite only around the annotation taken back. A
+ * jitter redaction read pixels beside it when it was drawn, and whatever
+ * was drawn there since must not leak into it when it is redrawn. */
+static gboolean check_undo_near_redaction(void) {
+    Canvas *composite = make_canvas(CHECK_WIDTH, CHECK_HEIGHT);
+    DisplayList *list = display_list_new(canvas_snapshot(composite));
+    cairo_rectangle_int_t changed;
+    gboolean ok = TRUE;
+
+    /* Neighbours inside the jitter's reach right of and below it, then a
+     * shape across it whose undo redraws the redaction. */
+    display_list_add(list, composite, annotation_new_redact(100, 80, 200, 180, REDACT_JITTER, 1234),
+                     &changed);
+    display_list_add(list, composite,
+                     annotation_new_shape(TOOL_RECT, &check_style, 210, 90, 235, 170), &changed);
+    display_list_add(list, composite,
+                     annotation_new_shape(TOOL_ELLIPSE, &check_style, 110, 190, 190, 215), &changed);
+    display_list_add(list, composite,
+                     annotation_new_shape(TOOL_ARROW, &check_style, 60, 60, 250, 230), &changed);
+    ok &= matches_rebuild(list, composite, "adding");
+
+    int n = display_list_get_length(list);
+    for (int i = 0; i < n; i++) {
+        display_list_undo(list, composite, &changed);
+        ok &= matches_rebuild(list, composite, "undo");
+    }
+    for (int i = 0; i < n; i++) {
+        display_list_redo(list, composite, &changed);
+        ok &= matches_rebuild(list, composite, "redo");
+    }
+    display_list_undo(list, composite, &changed);
+    display_list_undo(list, composite, &changed);
+    display_list_redo(list, composite, &changed);
+    ok &= matches_rebuild(list, composite, "undo, undo, redo");
+
+    display_list_free(list);
+    canvas_free(composite);
+    return ok;
+}
+
+/* Jitter chains are walked eight pixels at a time, and the lanes past the
+ * end of a row reach further right than out's window. Rendering each
+ * rectangle whole gathers from the window; one row at a time is too thin
+ * for the window and reads the canvas instead. Widths are not multiples of
+ * eight and the rectangles stop short of the right edge. */
+static gboolean check_redact_window(void) {
+    static const int widths[] = { 57, 101, 203, 250 };
+    Canvas *canvas = make_canvas(CHECK_WIDTH, CHECK_HEIGHT);
+    gboolean ok = TRUE;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(widths); i++) {
+        cairo_rectangle_int_t rect = { 20 + (int)i * 7, 60, widths[i], 120 };
+        int stride = rect.width * 4;
+        guint8 *whole = g_malloc((gsize)stride * rect.height);
+        guint8 *rows = g_malloc((gsize)stride * rect.height);
+
+        redact_render(canvas, whole, stride, &rect, &rect, 1234, REDACT_PASSES);
+        for (int y = 0; y < rect.height; y++) {
+            cairo_rectangle_int_t row = { rect.x, rect.y + y, rect.width, 1 };
+            redact_render(canvas, rows + (gsize)y * stride, stride, &row, &rect, 1234,
+                          REDACT_PASSES);
+        }
+        if (memcmp(whole, rows, (gsize)stride * rect.height) != 0) {
+            g_printerr("  %dx%d at %d,%d: window and canvas reads differ\n",
+                       rect.width, rect.height, rect.x, rect.y);
+            ok = FALSE;
+        }
+        g_free(rows);
+        g_free(whole);
+    }
+
+    canvas_free(canvas);
+    return ok;
+}
+
+/* The channel at shift of the pixel at x in check_premultiply(); each
+ * channel takes every value, offset so the three never agree. */
+static guint32 table_channel(int x, int shift) {
+    return (x + shift / 8 * 85) & 0xFF;
+}
+
+/* pixels_premultiply() and pixels_unpremultiply() against the scalar
+ * formulas for every colour and alpha, with alpha down the rows. Colours
+ * above alpha are not premultiplied, but files can still hold them. */
+static gboolean check_premultiply(void) {
+    const int stride = 256 * 4;
+    guint32 *pre = g_new(guint32, 256 * 256);
+    guint32 *unpre = g_new(guint32, 256 * 256);
+    int mismatches = 0;
+
+    for (int a = 0; a < 256; a++) {
+        for (int x = 0; x < 256; x++) {
+            guint32 p = (guint32)a << 24;
+            for (int shift = 0; shift < 24; shift += 8) p |= table_channel(x, shift) << shift;
+            pre[a * 256 + x] = unpre[a * 256 + x] = p;
+        }
+    }
+    pixels_premultiply((guint8 *)pre, stride, 256, 256);
+    pixels_unpremultiply((guint8 *)unpre, stride, 256, 256);
+
+    for (int a = 0; a < 256; a++) {
+        for (int x = 0; x < 256; x++) {
+            guint32 want_pre = (guint32)a << 24, want_unpre = (guint32)a << 24;
+            for (int shift = 0; shift < 24; shift += 8) {
+                guint32 c = table_channel(x, shift);
+                want_pre |= (c * a + 127) / 255 << shift;
+                want_unpre |= (a ? MIN((c * 255 + a / 2) / a, 255) : c) << shift;
+            }
+            guint32 got_pre = pre[a * 256 + x], got_unpre = unpre[a * 256 + x];
+            if ((got_pre != want_pre || got_unpre != want_unpre) && mismatches++ == 0) {
+                g_printerr("  alpha %d, colour %d: premultiplied %08x, want %08x; "
+                           "unpremultiplied %08x, want %08x\n",
+                           a, x, got_pre, want_pre, got_unpre, want_unpre);
+            }
+        }
+    }
+    if (mismatches > 1) g_printerr("  and %d more\n", mismatches - 1);
+
+    g_free(unpre);
+    g_free(pre);
+    return mismatches == 0;
+}
+
+/* Whether filename decodes with libpng, rather than our own loader, to
+ * the straight alpha RGBA of canvas. */
+static gboolean png_matches(const char *filename, const Canvas *canvas, const char *step) {
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    int stride = width * 4;
+    png_image image = { .version = PNG_IMAGE_VERSION };
+    guint8 *decoded = NULL;
+
+    if (png_image_begin_read_from_file(&image, filename)) {
+        image.format = PNG_FORMAT_RGBA;
+        if (image.width != (png_uint_32)width || image.height != (png_uint_32)height) {
+            g_printerr("  %s: decoded %ux%u, saved %dx%d\n", step,
+                       image.width, image.height, width, height);
+            png_image_free(&image);
+            return FALSE;
+        }
+        decoded = g_malloc(PNG_IMAGE_SIZE(image));
+        if (!png_image_finish_read(&image, NULL, decoded, stride, NULL)) {
+            g_free(decoded);
+            decoded = NULL;
+        }
+    }
+    if (!decoded) {
+        g_printerr("  %s: libpng could not decode it: %s\n", step, image.message);
+        png_image_free(&image);
+        return FALSE;
+    }
+
+    guint8 *pixels = g_malloc((gsize)stride * height);
+    guint8 *rgba = g_malloc((gsize)stride * height);
+    cairo_rectangle_int_t all = { 0, 0, width, height };
+    canvas_read(canvas, &all, pixels, stride);
+    pixels_to_rgba(pixels, stride, rgba, stride, width, height);
+
+    gboolean same = TRUE;
+    for (int y = 0; y < height && same; y++) {
+        if (memcmp(decoded + (gsize)y * stride, rgba + (gsize)y * stride, stride) != 0) {
+            g_printerr("  %s: row %d differs\n", step, y);
+            same = FALSE;
+        }
+    }
+
+    g_free(rgba);
+    g_free(pixels);
+    g_free(decoded);
+    return same;
+}
+
+/* The PNG encoder works a band of CANVAS_TILE_SIZE rows at a time and
+ * carries filter and deflate state from one band to the next; heights
+ * that are not multiples of it end on a short band. Every preset must
+ * give an image libpng reads back unchanged. */
+static gboolean check_png_round_trip(void) {
+    static const struct {
+        int width, height;
+    } sizes[] = {
+        { 301, 300 },
+        { 256, 513 },
+        { 517, 257 },
+        { 64, 1 },
+    };
+    char *dir = g_dir_make_tmp("crayons-check-XXXXXX", NULL);
+    if (!dir) return FALSE;
+    char *filename = g_build_filename(dir, "check.png", NULL);
+    gboolean ok = TRUE;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        Canvas *canvas = make_canvas(sizes[i].width, sizes[i].height);
+        for (ExportPreset preset = EXPORT_FAST; preset <= EXPORT_SMALLEST; preset++) {
+            char *step = g_strdup_printf("%dx%d %s", sizes[i].width, sizes[i].height,
+                                         export_preset_name(preset));
+            ExportOptions options;
+            GError *error = NULL;
+            export_options_init(&options, EXPORT_PNG, preset);
+            if (!imageio_save(canvas, filename, &options, NULL, NULL, &error)) {
+                g_printerr("  %s: %s\n", step, error->message);
+                g_error_free(error);
+                ok = FALSE;
+            } else {
+                ok &= png_matches(filename, canvas, step);
+            }
+            g_unlink(filename);
+            g_free(step);
+        }
+        canvas_free(canvas);
+    }
+
+    g_free(filename);
+    g_rmdir(dir);
+    g_free(dir);
+    return ok;
+}
+
+/* The sidecar saved next to a PNG keeps the annotations but no seeds, and
+ * reading it back draws everything that needs no seed the same. */
+static gboolean check_sidecar(void) {
+    Canvas *composite = make_canvas(CHECK_WIDTH, CHECK_HEIGHT);
+    DisplayList *list = display_list_new(canvas_snapshot(composite));
+    cairo_rectangle_int_t changed;
+    gboolean ok = TRUE;
+
+    display_list_add(list, composite, annotation_new_redact(100, 80, 200, 180, REDACT_BLUR, 0),
+                     &changed);
+    display_list_add(list, composite,
+                     annotation_new_shape(TOOL_ARROW, &check_style, 60, 60, 250, 230), &changed);
+    display_list_add(list, composite, annotation_new_redact(20, 20, 90, 70, REDACT_JITTER, 1234),
+                     &changed);
+    display_list_undo(list, composite, &changed);
+
+    DisplayListBase base = { "base.png", CHECK_WIDTH, CHECK_HEIGHT, 1700000000, 4096 };
+    GBytes *bytes = display_list_serialize(list, &base);
+    DisplayListBase loaded;
+    DisplayList *reread = display_list_deserialize(bytes, &loaded);
+    if (!reread) {
+        g_printerr("  sidecar not read back\n");
+        ok = FALSE;
+    } else {
+        ok &= loaded.filename && strcmp(loaded.filename, base.filename) == 0 &&
+              loaded.width == base.width && loaded.height == base.height &&
+              loaded.mtime == base.mtime && loaded.size == base.size;
+        ok &= display_list_get_length(reread) == display_list_get_length(list) &&
+              display_list_get_redo_length(reread) == 0;
+
+        Canvas *redrawn = canvas_new(CHECK_WIDTH, CHECK_HEIGHT, 0);
+        display_list_set_base(reread, canvas_snapshot(display_list_get_base(list)), redrawn);
+        char *expected = canvas_checksum(composite);
+        char *actual = canvas_checksum(redrawn);
+        if (strcmp(expected, actual) != 0) {
+            g_printerr("  sidecar redrawn as %s, saved %s\n", actual, expected);
+            ok = FALSE;
+        }
+        g_free(actual);
+        g_free(expected);
+        canvas_free(redrawn);
+        g_free(loaded.filename);
+        display_list_free(reread);
+    }
+
+    /* A jitter redaction drawn again must not take its seed along. */
+    display_list_add(list, composite, annotation_new_redact(20, 20, 90, 70, REDACT_JITTER, 1234),
+                     &changed);
+    g_bytes_unref(bytes);
+    bytes = display_list_serialize(list, &base);
+    GVariant *variant = g_variant_ref_sink(
+        g_variant_new_from_bytes(G_VARIANT_TYPE(DISPLAY_LIST_FORMAT), bytes, FALSE));
+    GVariant *annotations = g_variant_get_child_value(variant, 2);
+    for (gsize i = 0; i < g_variant_n_children(annotations); i++) {
+        GVariant *a = g_variant_get_child_value(annotations, i);
+        GVariant *seed = g_variant_get_child_value(a, 4);
+        if (g_variant_get_uint32(seed) != 0) {
+            g_printerr("  sidecar keeps the seed of annotation %d\n", (int)i);
+            ok = FALSE;
+        }
+        g_variant_unref(seed);
+        g_variant_unref(a);
+    }
+    g_variant_unref(annotations);
+    g_variant_unref(variant);
+    g_bytes_unref(bytes);
+
+    display_list_free(list);
+    canvas_free(composite);
+    return ok;
+}
+
+/* Whether a recovered canvas and list match the ones journaled. */
+static gboolean matches_recovered(const Canvas *canvas, const DisplayList *list,
+                                  const Canvas *recovered, const DisplayList *recovered_list,
+                                  const char *step) {
+    char *expected = canvas_checksum(canvas);
+    char *actual = canvas_checksum(recovered);
+    gboolean same = strcmp(expected, actual) == 0 &&
+                    display_list_get_length(list) == display_list_get_length(recovered_list) &&
+                    display_list_get_redo_length(list) ==
+                        display_list_get_redo_length(recovered_list);
+    if (!same) {
+        g_printerr("  after %s: canvas %s with %d+%d annotations, journaled %s with %d+%d\n",
+                   step, actual, display_list_get_length(recovered_list),
+                   display_list_get_redo_length(recovered_list), expected,
+                   display_list_get_length(list), display_list_get_redo_length(list));
+    }
+
+    g_free(actual);
+    g_free(expected);
+    return same;
+}
+
+/* A recovered journal goes on logging over the base it was started with,
+ * so a second crash after more edits loses none of them. Journals are
+ * left open as a crash would leave them. */
+static gboolean check_journal_recovery(void) {
+    char *dir = g_dir_make_tmp("crayons-check-XXXXXX", NULL);
+    if (!dir) return FALSE;
+
+    Canvas *composite = canvas_new(CHECK_WIDTH, CHECK_HEIGHT, CANVAS_WHITE);
+    DisplayList *list = display_list_new(canvas_snapshot(composite));
+    Journal *journal = journal_new(dir, NULL, CHECK_WIDTH, CHECK_HEIGHT, list);
+    cairo_rectangle_int_t changed;
+    gboolean ok = journal != NULL;
+
+    display_list_add(list, composite, annotation_new_redact(100, 80, 200, 180, REDACT_JITTER, 1234),
+                     &changed);
+    journal_add(journal, list);
+    display_list_add(list, composite,
+                     annotation_new_shape(TOOL_RECT, &check_style, 150, 90, 235, 170), &changed);
+    journal_add(journal, list);
+    display_list_undo(list, composite, &changed);
+    journal_undo(journal, list);
+
+    Canvas *recovered = NULL;
+    DisplayList *recovered_list = NULL;
+    DisplayListBase base;
+    Journal *first = journal_recover(dir, &recovered, &recovered_list, &base);
+    if (first) {
+        ok &= matches_recovered(composite, list, recovered, recovered_list, "recovery");
+        ok &= !base.filename && base.width == CHECK_WIDTH && base.height == CHECK_HEIGHT;
+        g_free(base.filename);
+
+        display_list_add(list, composite,
+                         annotation_new_shape(TOOL_ELLIPSE, &check_style, 50, 40, 180, 120),
+                         &changed);
+        display_list_add(recovered_list, recovered,
+                         annotation_new_shape(TOOL_ELLIPSE, &check_style, 50, 40, 180, 120),
+                         &changed);
+        journal_add(first, recovered_list);
+        canvas_free(recovered);
+        display_list_free(recovered_list);
+    }
+    ok &= first != NULL;
+
+    Journal *second = journal_recover(dir, &recovered, &recovered_list, &base);
+    if (second) {
+        ok &= matches_recovered(composite, list, recovered, recovered_list, "second recovery");
+        g_free(base.filename);
+        canvas_free(recovered);
+        display_list_free(recovered_list);
+    }
+    ok &= second != NULL;
+
+    journal_free(journal);
+    journal_free(first);
+    journal_free(second);
+    g_rmdir(dir);
+    g_free(dir);
+    display_list_free(list);
+    canvas_free(composite);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        CheckFunc func;
+    } checks[] = {
+        { "undo_near_redaction", check_undo_near_redaction },
+        { "journal_recovery", check_journal_recovery },
+        { "redact_window", check_redact_window },
+        { "sidecar", check_sidecar },
+        { "premultiply", check_premultiply },
+        { "png_round_trip", check_png_round_trip },
+    };
+    int failed = 0;
+
+    for (gsize i = 0; i < G_N_ELEMENTS(checks); i++) {
+        gboolean ok = checks[i].func();
+        g_printerr("%-24s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    if (failed) g_printerr("%d of %d checks failed\n", failed, (int)G_N_ELEMENTS(checks));
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,365 @@
+#include "document.h"
+
+#include <zlib.h>
+#include <glib/gstdio.h>
+
+#include "imageio.h"
+
+/* Eviction or restore running on a worker thread. */
+typedef struct {
+    Document *doc;
+    DocumentFunc done;
+    gpointer data;
+
+    const Canvas *source;       /* base being packed */
+    GBytes *packed;
+    Canvas *composite;          /* restored */
+    GError *error;
+
+    /* Main thread only. */
+    DocumentFunc restore_done;  /* switched back to while evicting */
+    gpointer restore_data;
+    gboolean freed;
+} DocumentJob;
+
+static Document *document_new(const char *title) {
+    static int created = 0;
+
+    Document *doc = g_new0(Document, 1);
+    doc->title = g_strdup(title);
+    doc->number = created++;
+    doc->zoom = 1.0;
+    doc->mipmap = mipmap_new();
+    return doc;
+}
+
+Document *document_new_blank(int width, int height) {
+    Document *doc = document_new("Untitled");
+    doc->base = DOCUMENT_BASE_BLANK;
+    doc->width = width;
+    doc->height = height;
+    doc->canvas = canvas_new(width, height, CANVAS_WHITE);
+    doc->display_list = display_list_new(canvas_snapshot(doc->canvas));
+    doc->state = DOCUMENT_RESIDENT;
+    return doc;
+}
+
+Document *document_new_canvas(const char *title, Canvas *canvas, DisplayList *list) {
+    Document *doc = document_new(title);
+    doc->base = DOCUMENT_BASE_PIXELS;
+    doc->width = canvas_get_width(canvas);
+    doc->height = canvas_get_height(canvas);
+    doc->canvas = canvas;
+    doc->display_list = list ? list : display_list_new(canvas_snapshot(canvas));
+    doc->state = DOCUMENT_RESIDENT;
+    return doc;
+}
+
+static gboolean file_unchanged(const Document *doc) {
+    GStatBuf st;
+    return g_stat(doc->filename, &st) == 0 && st.st_mtime == doc->file_mtime &&
+           (guint64)st.st_size == doc->file_size;
+}
+
+/* Takes over the annotations saved next to filename, if filename has not
+ * been written since and the base they are drawn over is unchanged, so
+ * restoring the document draws them over that base again. */
+static gboolean open_sidecar(Document *doc, const char *filename) {
+    char *name = display_list_sidecar_name(filename);
+    GStatBuf image, sidecar;
+    gchar *data = NULL;
+    gsize length;
+    if (g_stat(filename, &image) == 0 && g_stat(name, &sidecar) == 0 &&
+        image.st_mtime <= sidecar.st_mtime) {
+        g_file_get_contents(name, &data, &length, NULL);
+    }
+    g_free(name);
+    if (!data) return FALSE;
+
+    GBytes *bytes = g_bytes_new_take(data, length);
+    DisplayListBase base;
+    DisplayList *list = display_list_deserialize(bytes, &base);
+    g_bytes_unref(bytes);
+    if (!list) return FALSE;
+
+    doc->base = base.filename ? DOCUMENT_BASE_FILE : DOCUMENT_BASE_BLANK;
+    doc->filename = base.filename;
+    doc->file_mtime = base.mtime;
+    doc->file_size = base.size;
+    doc->width = base.width;
+    doc->height = base.height;
+    if (doc->base == DOCUMENT_BASE_FILE && !file_unchanged(doc)) {
+        display_list_free(list);
+        g_clear_pointer(&doc->filename, g_free);
+        return FALSE;
+    }
+    doc->display_list = list;
+    return TRUE;
+}
+
+Document *document_new_file(const char *filename) {
+    char *title = g_path_get_basename(filename);
+    Document *doc = document_new(title);
+    g_free(title);
+    doc->state = DOCUMENT_EVICTED;
+    if (!open_sidecar(doc, filename)) {
+        doc->base = DOCUMENT_BASE_FILE;
+        doc->filename = g_strdup(filename);
+    }
+    return doc;
+}
+
+void document_free(Document *doc) {
+    if (!doc) return;
+
+    g_clear_pointer(&doc->journal, journal_free);
+    g_clear_pointer(&doc->session, session_free);
+    if (doc->recovery_dir) session_remove_dir(doc->recovery_dir);
+    g_clear_pointer(&doc->recovery_dir, g_free);
+
+    DocumentJob *job = doc->job;
+    if (job) {
+        job->freed = TRUE;
+        return;
+    }
+    canvas_free(doc->canvas);
+    display_list_free(doc->display_list);
+    mipmap_free(doc->mipmap);
+    if (doc->packed) g_bytes_unref(doc->packed);
+    g_clear_error(&doc->error);
+    g_free(doc->filename);
+    g_free(doc->title);
+    g_free(doc);
+}
+
+void document_set_file(Document *doc, const char *filename) {
+    GStatBuf st;
+    if (!filename || g_stat(filename, &st) != 0) {
+        doc->base = DOCUMENT_BASE_PIXELS;
+        return;
+    }
+
+    char *copy = g_strdup(filename);
+    g_free(doc->filename);
+    doc->filename = copy;
+    doc->base = DOCUMENT_BASE_FILE;
+    doc->file_mtime = st.st_mtime;
+    doc->file_size = st.st_size;
+}
+
+gsize document_get_size(const Document *doc) {
+    gsize size = doc->packed ? g_bytes_get_size(doc->packed) : 0;
+    if (doc->display_list) size += display_list_get_size(doc->display_list);
+    if (!doc->canvas) return size;
+
+    /* The base shares every tile nothing was drawn on with the canvas. */
+    const Canvas *base = doc->display_list ? display_list_get_base(doc->display_list) : NULL;
+    size += canvas_get_size(doc->canvas, NULL) + mipmap_get_size(doc->mipmap);
+    if (base) size += canvas_get_size(base, doc->canvas);
+    return size;
+}
+
+gsize document_get_budget(void) {
+    static gsize budget = 0;
+
+    if (!budget) {
+        const char *value = g_getenv("CRAYONS_DOCUMENT_BUDGET_MB");
+        guint64 mb = value ? g_ascii_strtoull(value, NULL, 10) : 0;
+        budget = (gsize)(mb > 0 ? mb : DOCUMENT_BUDGET_MB) << 20;
+    }
+    return budget;
+}
+
+/* Deflates canvas a band of tiles at a time, so the only extra memory is
+ * one band and the output. */
+static GBytes *pack(const Canvas *canvas) {
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    guint8 *band = g_malloc((gsize)width * 4 * CANVAS_TILE_SIZE);
+    guint8 chunk[65536];
+    GByteArray *out = g_byte_array_new();
+
+    z_stream z = { 0 };
+    deflateInit(&z, Z_BEST_SPEED);
+    for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        canvas_read(canvas, &r, band, width * 4);
+        z.next_in = band;
+        z.avail_in = (uInt)r.height * width * 4;
+        int flush = y + r.height < height ? Z_NO_FLUSH : Z_FINISH;
+        do {
+            z.next_out = chunk;
+            z.avail_out = sizeof(chunk);
+            deflate(&z, flush);
+            g_byte_array_append(out, chunk, sizeof(chunk) - z.avail_out);
+        } while (z.avail_out == 0);
+    }
+    deflateEnd(&z);
+
+    g_free(band);
+    return g_byte_array_free_to_bytes(out);
+}
+
+static Canvas *unpack(GBytes *packed, int width, int height, GError **error) {
+    Canvas *canvas = canvas_new(width, height, 0);
+    guint8 *band = g_malloc((gsize)width * 4 * CANVAS_TILE_SIZE);
+    gsize size;
+
+    z_stream z = { 0 };
+    inflateInit(&z);
+    z.next_in = (Bytef *)g_bytes_get_data(packed, &size);
+    z.avail_in = size;
+    for (int y = 0; y < height && canvas; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        z.next_out = band;
+        z.avail_out = (uInt)r.height * width * 4;
+        int status = Z_OK;
+        while (z.avail_out > 0 && status == Z_OK) status = inflate(&z, Z_NO_FLUSH);
+        if (z.avail_out > 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Packed image is corrupt");
+            g_clear_pointer(&canvas, canvas_free);
+            break;
+        }
+        canvas_write(canvas, &r, band, width * 4);
+    }
+    inflateEnd(&z);
+
+    g_free(band);
+    return canvas;
+}
+
+static void drop_pixels(Document *doc) {
+    g_clear_pointer(&doc->canvas, canvas_free);
+    mipmap_reset(doc->mipmap);
+    if (doc->display_list) display_list_drop_base(doc->display_list);
+    doc->state = DOCUMENT_EVICTED;
+}
+
+static gboolean on_evicted(gpointer data) {
+    DocumentJob *job = data;
+    Document *doc = job->doc;
+    doc->job = NULL;
+
+    if (job->freed) {
+        g_bytes_unref(job->packed);
+        document_free(doc);
+    } else if (job->restore_done) {
+        /* Nothing was dropped yet, so the document is simply kept. */
+        g_bytes_unref(job->packed);
+        doc->state = DOCUMENT_RESIDENT;
+        job->restore_done(doc, job->restore_data);
+    } else {
+        doc->packed = job->packed;
+        drop_pixels(doc);
+        if (job->done) job->done(doc, job->data);
+    }
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer evict_thread(gpointer data) {
+    DocumentJob *job = data;
+    job->packed = pack(job->source);
+    g_idle_add(on_evicted, job);
+    return NULL;
+}
+
+void document_evict(Document *doc, DocumentFunc done, gpointer data) {
+    g_return_if_fail(doc->state == DOCUMENT_RESIDENT && doc->display_list);
+
+    if (doc->base == DOCUMENT_BASE_FILE && !file_unchanged(doc)) {
+        doc->base = DOCUMENT_BASE_PIXELS;
+    }
+    /* Unsaved edits must not depend on the file staying as it is, so their
+     * base is packed even though it could be loaded again. */
+    if (doc->base == DOCUMENT_BASE_BLANK ||
+        (doc->base == DOCUMENT_BASE_FILE && !doc->is_modified)) {
+        drop_pixels(doc);
+        if (done) done(doc, data);
+        return;
+    }
+
+    DocumentJob *job = g_new0(DocumentJob, 1);
+    job->doc = doc;
+    job->done = done;
+    job->data = data;
+    job->source = display_list_get_base(doc->display_list);
+    doc->job = job;
+    doc->state = DOCUMENT_EVICTING;
+    g_thread_unref(g_thread_new("evict", evict_thread, job));
+}
+
+static gboolean on_restored(gpointer data) {
+    DocumentJob *job = data;
+    Document *doc = job->doc;
+    doc->job = NULL;
+
+    if (job->freed) {
+        canvas_free(job->composite);
+        g_clear_error(&job->error);
+        document_free(doc);
+    } else {
+        doc->canvas = job->composite;
+        doc->error = job->error;
+        doc->state = doc->canvas ? DOCUMENT_RESIDENT : DOCUMENT_EVICTED;
+        if (doc->canvas) g_clear_pointer(&doc->packed, g_bytes_unref);
+        if (job->done) job->done(doc, job->data);
+    }
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer restore_thread(gpointer data) {
+    DocumentJob *job = data;
+    Document *doc = job->doc;
+    Canvas *base = NULL;
+
+    switch (doc->packed ? DOCUMENT_BASE_PIXELS : doc->base) {
+    case DOCUMENT_BASE_BLANK:
+        base = canvas_new(doc->width, doc->height, CANVAS_WHITE);
+        break;
+    case DOCUMENT_BASE_FILE:
+        if (!file_unchanged(doc)) {
+            g_set_error(&job->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "%s has changed on disk", doc->filename);
+            break;
+        }
+        base = imageio_load(doc->filename, &job->error);
+        if (base && (canvas_get_width(base) != doc->width ||
+                     canvas_get_height(base) != doc->height)) {
+            g_set_error(&job->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "%s has changed on disk", doc->filename);
+            g_clear_pointer(&base, canvas_free);
+        }
+        break;
+    case DOCUMENT_BASE_PIXELS:
+        base = unpack(doc->packed, doc->width, doc->height, &job->error);
+        break;
+    }
+
+    if (base) {
+        job->composite = canvas_new(doc->width, doc->height, canvas_get_fill(base));
+        display_list_set_base(doc->display_list, base, job->composite);
+    }
+    g_idle_add(on_restored, job);
+    return NULL;
+}
+
+void document_restore(Document *doc, DocumentFunc done, gpointer data) {
+    if (doc->state == DOCUMENT_EVICTING) {
+        DocumentJob *job = doc->job;
+        job->restore_done = done;
+        job->restore_data = data;
+        return;
+    }
+    g_return_if_fail(doc->state == DOCUMENT_EVICTED && doc->display_list);
+
+    g_clear_error(&doc->error);
+    DocumentJob *job = g_new0(DocumentJob, 1);
+    job->doc = doc;
+    job->done = done;
+    job->data = data;
+    doc->job = job;
+    doc->state = DOCUMENT_RESTORING;
+    g_thread_unref(g_thread_new("restore", restore_thread, job));
+}
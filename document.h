@@ -0,0 +1,121 @@
+#ifndef CRAYONS_DOCUMENT_H
+#define CRAYONS_DOCUMENT_H
+
+#include "annotations.h"
+#include "journal.h"
+#include "mipmap.h"
+#include "session.h"
+
+/*
+ * Open images.
+ *
+ * A Document is everything about one image the editor can switch to: its
+ * canvas, display list and view. To keep many of them open, inactive ones
+ * can be evicted. Their annotations are small and stay in memory, so undo
+ * history survives, but the pixels are dropped: a blank base, or the image
+ * file of a document without unsaved changes if it is unchanged on disk,
+ * can simply be loaded again; any other base is packed with zlib on a
+ * worker thread first. Restoring rebuilds the base on a worker thread and
+ * draws the annotations over it again.
+ *
+ * Documents belong to the main thread, which must leave a document's
+ * canvas and display list alone while it is being evicted or restored.
+ * Workers report back through the main loop.
+ */
+
+/* Resident documents past this many MiB get evicted, least recently used
+ * first; CRAYONS_DOCUMENT_BUDGET_MB overrides it. */
+#define DOCUMENT_BUDGET_MB 1024
+
+typedef enum {
+    DOCUMENT_RESIDENT,
+    DOCUMENT_EVICTING,          /* base being packed */
+    DOCUMENT_EVICTED,
+    DOCUMENT_RESTORING,
+} DocumentState;
+
+typedef enum {
+    DOCUMENT_BASE_BLANK,        /* white */
+    DOCUMENT_BASE_FILE,
+    DOCUMENT_BASE_PIXELS,       /* only in memory, e.g. a partly loaded image */
+} DocumentBase;
+
+typedef struct _Document Document;
+
+struct _Document {
+    char *title;
+    int number;                 /* order created in this session, from 0 */
+    DocumentBase base;
+    char *filename;             /* DOCUMENT_BASE_FILE */
+    gint64 file_mtime;          /* of filename when it was loaded */
+    guint64 file_size;
+    int width, height;
+
+    /* NULL while evicted, except that display_list keeps its annotations.
+     * A file that was never decoded has no display list either. */
+    Canvas *canvas;
+    DisplayList *display_list;
+
+    /* Kept while the document is switched away from, so switching back
+     * neither copies nor rebuilds anything. The editor fills in the crash
+     * recovery files, which are NULL while that is off. */
+    Mipmap *mipmap;
+    char *recovery_dir;
+    Session *session;
+    Journal *journal;           /* NULL unless the base can be loaded again */
+
+    double zoom, view_x, view_y;
+    gboolean is_modified;
+    guint64 edit_generation;
+    gint64 last_used;           /* g_get_monotonic_time() when last switched away */
+
+    DocumentState state;
+    GBytes *packed;             /* base while evicted, unless loaded again */
+    GError *error;              /* why the last restore failed */
+
+    /* Private. */
+    gpointer job;
+};
+
+/* Called on the main thread once an eviction or restore is over. */
+typedef void (*DocumentFunc)(Document *doc, gpointer data);
+
+/* A resident white canvas. */
+Document *document_new_blank(int width, int height);
+
+/* Takes ownership of canvas and of list, the annotations drawn into it, or
+ * makes canvas the base if list is NULL. The base only lives in memory. */
+Document *document_new_canvas(const char *title, Canvas *canvas, DisplayList *list);
+
+/* filename, not decoded yet; the editor streams it in when it first shows
+ * the document. If filename was saved with annotations that can be drawn
+ * again (see display_list_serialize()), the document is their base instead,
+ * evicted with the annotations, and restoring it draws them over it. */
+Document *document_new_file(const char *filename);
+
+/* The document is freed once any eviction or restore is over; its crash
+ * recovery files are removed at once. */
+void document_free(Document *doc);
+
+/* Records that the base came from filename, or from nowhere that can be
+ * loaded again if filename is NULL or cannot be read. */
+void document_set_file(Document *doc, const char *filename);
+
+/* Bytes of pixels, mip levels and annotations held in memory. */
+gsize document_get_size(const Document *doc);
+
+/* Bytes resident documents may take up together. */
+gsize document_get_budget(void);
+
+/* Drops a resident document's pixels. done may be called before this
+ * returns. */
+void document_evict(Document *doc, DocumentFunc done, gpointer data);
+
+/* Brings back the pixels of a document being evicted, or evicted with a
+ * display list after it was decoded or opened with its annotations. On
+ * failure the document stays evicted, error says why and restoring can be
+ * tried again. Only a document without unsaved changes can fail because
+ * its file changed. */
+void document_restore(Document *doc, DocumentFunc done, gpointer data);
+
+#endif
@@ -0,0 +1,489 @@
+#include "export.h"
+
+#include <setjmp.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <webp/encode.h>
+#include <zlib.h>
+
+#include "parallel.h"
+#include "pixels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+static const struct {
+    int level;
+    int strategy;
+    ExportFilter filter;
+    J_DCT_METHOD dct;
+    gboolean subsample;         /* 4:2:0 chroma rather than 4:4:4 */
+    int webp_effort;            /* 0 to 9, as WebPConfigLosslessPreset() takes it */
+} presets[] = {
+    [EXPORT_FAST] = { 1, Z_DEFAULT_STRATEGY, EXPORT_FILTER_UP, JDCT_IFAST, TRUE, 1 },
+    [EXPORT_BALANCED] = { 6, Z_DEFAULT_STRATEGY, EXPORT_FILTER_UP, JDCT_ISLOW, FALSE, 5 },
+    [EXPORT_SMALLEST] = { 9, Z_DEFAULT_STRATEGY, EXPORT_FILTER_ADAPTIVE, JDCT_ISLOW, TRUE, 9 },
+};
+
+static const char *preset_names[] = {
+    [EXPORT_FAST] = "fast",
+    [EXPORT_BALANCED] = "balanced",
+    [EXPORT_SMALLEST] = "smallest",
+};
+
+void export_options_init(ExportOptions *options, ExportFormat format, ExportPreset preset) {
+    options->format = format;
+    options->preset = preset;
+    options->quality = EXPORT_DEFAULT_QUALITY;
+    options->lossless = TRUE;
+    options->level = presets[preset].level;
+    options->strategy = presets[preset].strategy;
+    options->filter = presets[preset].filter;
+}
+
+ExportFormat export_format_from_name(const char *filename) {
+    char *name = g_ascii_strdown(filename, -1);
+    ExportFormat format = EXPORT_PNG;
+    if (g_str_has_suffix(name, ".jpg") || g_str_has_suffix(name, ".jpeg")) {
+        format = EXPORT_JPEG;
+    } else if (g_str_has_suffix(name, ".webp")) {
+        format = EXPORT_WEBP;
+    }
+    g_free(name);
+    return format;
+}
+
+const char *export_preset_name(ExportPreset preset) {
+    return preset_names[preset];
+}
+
+gboolean export_preset_from_name(const char *name, ExportPreset *preset) {
+    for (gsize i = 0; i < G_N_ELEMENTS(preset_names); i++) {
+        if (g_ascii_strcasecmp(name, preset_names[i]) == 0) {
+            *preset = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Deflate refers back at most this far, so a chunk primed with this much
+ * of what precedes it loses nothing but the odd match across the cut. */
+#define PNG_WINDOW 32768
+
+/* One band of a PNG on its way through filter_rows() and deflate_rows(). */
+typedef struct {
+    const ExportOptions *options;
+    int rows;
+    gboolean last;              /* band ends the image */
+    gsize stride;               /* of rgba */
+    gsize row_bytes;            /* filter type byte and row */
+
+    /* The row above the band, then the band, as straight alpha RGBA. */
+    const guint8 *rgba;
+    /* The band filtered, after history bytes of what came before it. */
+    guint8 *filtered;
+    gsize history;
+
+    /* By the band row each chunk starts at; chunks[y] is NULL elsewhere. */
+    guint8 **chunks;
+    gsize *chunk_sizes;
+    gsize *chunk_inputs;
+    uLong *chunk_adlers;
+    gint failed;
+} PngBand;
+
+static inline guint8 paeth(guint8 a, guint8 b, guint8 c) {
+    int pa = ABS(b - c);
+    int pb = ABS(a - c);
+    int pc = ABS(a + b - 2 * c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* Filters n bytes of RGBA in cur, given the row above it, into out. */
+KERNEL_CLONES
+static void filter_row(ExportFilter filter, const guint8 *cur, const guint8 *prev,
+                       guint8 *out, gsize n) {
+    *out++ = filter;
+    switch (filter) {
+    case EXPORT_FILTER_SUB:
+        for (gsize i = 0; i < 4; i++) out[i] = cur[i];
+        for (gsize i = 4; i < n; i++) out[i] = cur[i] - cur[i - 4];
+        break;
+    case EXPORT_FILTER_UP:
+        for (gsize i = 0; i < n; i++) out[i] = cur[i] - prev[i];
+        break;
+    case EXPORT_FILTER_AVERAGE:
+        for (gsize i = 0; i < 4; i++) out[i] = cur[i] - (prev[i] >> 1);
+        for (gsize i = 4; i < n; i++) out[i] = cur[i] - ((cur[i - 4] + prev[i]) >> 1);
+        break;
+    case EXPORT_FILTER_PAETH:
+        for (gsize i = 0; i < 4; i++) out[i] = cur[i] - prev[i];
+        for (gsize i = 4; i < n; i++) out[i] = cur[i] - paeth(cur[i - 4], prev[i], prev[i - 4]);
+        break;
+    default:
+        memcpy(out, cur, n);
+        break;
+    }
+}
+
+/* Sum of the filtered bytes taken as signed, libpng's guess at which filter
+ * will deflate best. */
+KERNEL_CLONES
+static guint64 filter_cost(const guint8 *out, gsize n) {
+    guint64 sum = 0;
+    for (gsize i = 1; i < n; i++) sum += ABS((gint8)out[i]);
+    return sum;
+}
+
+static void filter_rows(int y0, int y1, gpointer data) {
+    PngBand *band = data;
+    gsize n = band->stride;
+    ExportFilter filter = band->options->filter;
+    guint8 *scratch = filter == EXPORT_FILTER_ADAPTIVE ? g_malloc(2 * band->row_bytes) : NULL;
+
+    for (int y = y0; y < y1; y++) {
+        const guint8 *cur = band->rgba + (gsize)(y + 1) * n;
+        const guint8 *prev = cur - n;
+        guint8 *out = band->filtered + band->history + (gsize)y * band->row_bytes;
+        if (filter != EXPORT_FILTER_ADAPTIVE) {
+            filter_row(filter, cur, prev, out, n);
+            continue;
+        }
+
+        guint8 *best = scratch, *trial = scratch + band->row_bytes;
+        guint64 best_cost = G_MAXUINT64;
+        for (ExportFilter f = EXPORT_FILTER_NONE; f < EXPORT_FILTER_ADAPTIVE; f++) {
+            filter_row(f, cur, prev, trial, n);
+            guint64 cost = filter_cost(trial, band->row_bytes);
+            if (cost < best_cost) {
+                guint8 *t = best;
+                best = trial;
+                trial = t;
+                best_cost = cost;
+            }
+        }
+        memcpy(out, best, band->row_bytes);
+    }
+    g_free(scratch);
+}
+
+/* Deflates rows [y0, y1) of the filtered band as a raw deflate stream that
+ * either ends the image or stops at a byte boundary without ending. */
+static void deflate_rows(int y0, int y1, gpointer data) {
+    PngBand *band = data;
+    const guint8 *in = band->filtered + band->history + (gsize)y0 * band->row_bytes;
+    gsize length = (gsize)(y1 - y0) * band->row_bytes;
+    int flush = band->last && y1 == band->rows ? Z_FINISH : Z_SYNC_FLUSH;
+
+    z_stream z = { 0 };
+    if (deflateInit2(&z, band->options->level, Z_DEFLATED, -MAX_WBITS, 8,
+                     band->options->strategy) != Z_OK) {
+        g_atomic_int_set(&band->failed, 1);
+        return;
+    }
+    gsize dictionary = MIN(PNG_WINDOW, band->history + (gsize)y0 * band->row_bytes);
+    if (dictionary > 0) deflateSetDictionary(&z, in - dictionary, dictionary);
+
+    gsize size = deflateBound(&z, length) + 16;
+    guint8 *out = g_malloc(size);
+    z.next_in = (Bytef *)in;
+    z.avail_in = length;
+    z.next_out = out;
+    z.avail_out = size;
+    for (;;) {
+        int status = deflate(&z, flush);
+        if (status == Z_STREAM_END || (status == Z_OK && z.avail_out > 0)) break;
+        if (status != Z_OK) {
+            g_atomic_int_set(&band->failed, 1);
+            break;
+        }
+        size *= 2;
+        out = g_realloc(out, size);
+        z.next_out = out + z.total_out;
+        z.avail_out = size - z.total_out;
+    }
+
+    band->chunks[y0] = out;
+    band->chunk_sizes[y0] = z.total_out;
+    band->chunk_inputs[y0] = length;
+    band->chunk_adlers[y0] = adler32(adler32(0, NULL, 0), in, length);
+    deflateEnd(&z);
+}
+
+static void put_u32(FILE *fp, guint32 value) {
+    guint32 be = GUINT32_TO_BE(value);
+    fwrite(&be, 4, 1, fp);
+}
+
+/* Writes a chunk whose data is head followed by body; either may be empty. */
+static void put_chunk(FILE *fp, const char *type, const guint8 *head, gsize head_size,
+                      const guint8 *body, gsize body_size) {
+    uLong crc = crc32(0, (const Bytef *)type, 4);
+    if (head_size) crc = crc32(crc, head, head_size);
+    if (body_size) crc = crc32(crc, body, body_size);
+
+    put_u32(fp, head_size + body_size);
+    fwrite(type, 1, 4, fp);
+    fwrite(head, 1, head_size, fp);
+    fwrite(body, 1, body_size, fp);
+    put_u32(fp, crc);
+}
+
+static gboolean write_png(const Canvas *canvas, FILE *fp, const ExportOptions *options,
+                          ExportProgressFunc progress, gpointer data, char *message) {
+    static const guint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    int stride = width * 4;
+
+    guint8 ihdr[13];
+    guint32 be = GUINT32_TO_BE(width);
+    memcpy(ihdr, &be, 4);
+    be = GUINT32_TO_BE(height);
+    memcpy(ihdr + 4, &be, 4);
+    ihdr[8] = 8;                /* bits per channel */
+    ihdr[9] = 6;                /* RGBA */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    fwrite(signature, 1, sizeof(signature), fp);
+    put_chunk(fp, "IHDR", ihdr, sizeof(ihdr), NULL, 0);
+
+    /* The zlib header goes in front of the first chunk, the checksum of
+     * all the chunks after the last. */
+    int level = options->level;
+    guint8 zlib_header[2] = { 0x78, (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6 };
+    zlib_header[1] += 31 - (zlib_header[0] << 8 | zlib_header[1]) % 31;
+    uLong adler = adler32(0, NULL, 0);
+
+    PngBand band = { options };
+    band.stride = stride;
+    band.row_bytes = 1 + (gsize)stride;
+    guint8 *pixels = g_malloc((gsize)stride * CANVAS_TILE_SIZE);
+    guint8 *rgba = g_malloc0((gsize)stride * (CANVAS_TILE_SIZE + 1));
+    band.rgba = rgba;
+    band.filtered = g_malloc(PNG_WINDOW + band.row_bytes * CANVAS_TILE_SIZE);
+    band.chunks = g_new0(guint8 *, CANVAS_TILE_SIZE);
+    band.chunk_sizes = g_new(gsize, CANVAS_TILE_SIZE);
+    band.chunk_inputs = g_new(gsize, CANVAS_TILE_SIZE);
+    band.chunk_adlers = g_new(uLong, CANVAS_TILE_SIZE);
+
+    for (int y = 0; y < height && !band.failed; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        canvas_read(canvas, &r, pixels, stride);
+        pixels_to_rgba(pixels, stride, rgba + stride, stride, r.width, r.height);
+
+        band.rows = r.height;
+        band.last = y + r.height == height;
+        parallel_rows(0, r.height, filter_rows, &band);
+        parallel_rows(0, r.height, deflate_rows, &band);
+
+        for (int i = 0; i < r.height; i++) {
+            guint8 *chunk = band.chunks[i];
+            if (!chunk) continue;
+
+            gsize size = band.chunk_sizes[i];
+            adler = adler32_combine(adler, band.chunk_adlers[i], band.chunk_inputs[i]);
+            if (!band.failed) {
+                gboolean first = y == 0 && i == 0;
+                if (band.last && i + band.chunk_inputs[i] / band.row_bytes == (gsize)r.height) {
+                    chunk = g_realloc(chunk, size + 4);
+                    be = GUINT32_TO_BE(adler);
+                    memcpy(chunk + size, &be, 4);
+                    size += 4;
+                }
+                put_chunk(fp, "IDAT", zlib_header, first ? 2 : 0, chunk, size);
+            }
+            g_free(chunk);
+            band.chunks[i] = NULL;
+        }
+
+        /* Keep the last PNG_WINDOW bytes to prime the next band's first
+         * chunk, and the last row for filtering its first row. */
+        gsize total = band.history + band.row_bytes * r.height;
+        gsize keep = MIN(PNG_WINDOW, total);
+        memmove(band.filtered, band.filtered + total - keep, keep);
+        band.history = keep;
+        memcpy(rgba, rgba + (gsize)stride * r.height, stride);
+
+        if (progress) progress((double)(y + r.height) / height, data);
+    }
+    if (!band.failed) put_chunk(fp, "IEND", NULL, 0, NULL, 0);
+
+    g_free(band.chunk_adlers);
+    g_free(band.chunk_inputs);
+    g_free(band.chunk_sizes);
+    g_free(band.chunks);
+    g_free(band.filtered);
+    g_free(rgba);
+    g_free(pixels);
+
+    if (band.failed) g_strlcpy(message, "zlib could not compress the image", EXPORT_MESSAGE_SIZE);
+    return !band.failed;
+}
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char *message;
+} JpegError;
+
+static void jpeg_error_cb(j_common_ptr cinfo) {
+    JpegError *error = (JpegError *)cinfo->err;
+    char text[JMSG_LENGTH_MAX];
+    error->pub.format_message(cinfo, text);
+    g_strlcpy(error->message, text, EXPORT_MESSAGE_SIZE);
+    longjmp(error->jump, 1);
+}
+
+static void jpeg_message_cb(j_common_ptr cinfo) {
+}
+
+static gboolean write_jpeg(const Canvas *canvas, FILE *fp, const ExportOptions *options,
+                           ExportProgressFunc progress, gpointer data, char *message) {
+    struct jpeg_compress_struct cinfo;
+    JpegError error;
+    guint8 *volatile pixels = NULL;
+    guint8 *volatile rgb = NULL;
+
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = jpeg_error_cb;
+    error.pub.output_message = jpeg_message_cb;
+    error.message = message;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        g_free(pixels);
+        g_free(rgb);
+        return FALSE;
+    }
+
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, options->quality, TRUE);
+    cinfo.dct_method = presets[options->preset].dct;
+    if (!presets[options->preset].subsample) {
+        cinfo.comp_info[0].h_samp_factor = 1;
+        cinfo.comp_info[0].v_samp_factor = 1;
+    }
+    /* Optimized Huffman tables and progressive scans would buffer the
+     * whole image's coefficients. */
+    cinfo.optimize_coding = FALSE;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    int stride = width * 4;
+    int rgb_stride = width * 3;
+    pixels = g_malloc((gsize)stride * CANVAS_TILE_SIZE);
+    rgb = g_malloc((gsize)rgb_stride * CANVAS_TILE_SIZE);
+    JSAMPROW rows[CANVAS_TILE_SIZE];
+    for (int i = 0; i < CANVAS_TILE_SIZE; i++) rows[i] = rgb + (gsize)i * rgb_stride;
+
+    for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        canvas_read(canvas, &r, pixels, stride);
+        pixels_to_rgb(pixels, stride, rgb, rgb_stride, r.width, r.height);
+        for (int i = 0; i < r.height;) {
+            i += jpeg_write_scanlines(&cinfo, rows + i, r.height - i);
+        }
+        if (progress) progress((double)(y + r.height) / height, data);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    jpeg_destroy_compress(&cinfo);
+    g_free(pixels);
+    g_free(rgb);
+    return TRUE;
+}
+
+typedef struct {
+    FILE *fp;
+    ExportProgressFunc progress;
+    gpointer data;
+} WebpSink;
+
+static int webp_write_cb(const uint8_t *data, size_t size, const WebPPicture *picture) {
+    WebpSink *sink = picture->custom_ptr;
+    return fwrite(data, 1, size, sink->fp) == size;
+}
+
+static int webp_progress_cb(int percent, const WebPPicture *picture) {
+    WebpSink *sink = picture->custom_ptr;
+    if (sink->progress) sink->progress(percent / 100.0, sink->data);
+    return 1;
+}
+
+static const char *webp_error_message(WebPEncodingError code) {
+    switch (code) {
+    case VP8_ENC_ERROR_OUT_OF_MEMORY:
+    case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY: return "not enough memory";
+    case VP8_ENC_ERROR_BAD_DIMENSION: return "image too large for WebP";
+    case VP8_ENC_ERROR_BAD_WRITE: return "write failed";
+    default: return "WebP encoder failed";
+    }
+}
+
+static gboolean write_webp(const Canvas *canvas, FILE *fp, const ExportOptions *options,
+                           ExportProgressFunc progress, gpointer data, char *message) {
+    WebPConfig config;
+    WebPPicture picture;
+    if (!WebPConfigInit(&config) || !WebPPictureInit(&picture)) {
+        g_strlcpy(message, "libwebp version mismatch", EXPORT_MESSAGE_SIZE);
+        return FALSE;
+    }
+
+    int effort = presets[options->preset].webp_effort;
+    if (options->lossless) {
+        WebPConfigLosslessPreset(&config, effort);
+    } else {
+        config.quality = options->quality;
+        config.method = effort * 6 / 9;
+    }
+
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    picture.use_argb = 1;
+    picture.width = width;
+    picture.height = height;
+    if (!WebPPictureAlloc(&picture)) {
+        g_strlcpy(message, webp_error_message(picture.error_code), EXPORT_MESSAGE_SIZE);
+        return FALSE;
+    }
+
+    /* libwebp's ARGB is straight alpha canvas pixels, so the bands are
+     * read and unpremultiplied right where the encoder wants them. */
+    int stride = picture.argb_stride * 4;
+    for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        guint8 *band = (guint8 *)(picture.argb + (gsize)y * picture.argb_stride);
+        canvas_read(canvas, &r, band, stride);
+        pixels_unpremultiply(band, stride, r.width, r.height);
+    }
+
+    WebpSink sink = { fp, progress, data };
+    picture.writer = webp_write_cb;
+    picture.custom_ptr = &sink;
+    picture.progress_hook = webp_progress_cb;
+    gboolean ok = WebPEncode(&config, &picture);
+    if (!ok) g_strlcpy(message, webp_error_message(picture.error_code), EXPORT_MESSAGE_SIZE);
+
+    WebPPictureFree(&picture);
+    return ok;
+}
+
+gboolean export_write(const Canvas *canvas, FILE *fp, const ExportOptions *options,
+                      ExportProgressFunc progress, gpointer data, char *message) {
+    switch (options->format) {
+    case EXPORT_JPEG: return write_jpeg(canvas, fp, options, progress, data, message);
+    case EXPORT_WEBP: return write_webp(canvas, fp, options, progress, data, message);
+    default: return write_png(canvas, fp, options, progress, data, message);
+    }
+}
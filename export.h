@@ -0,0 +1,88 @@
+#ifndef CRAYONS_EXPORT_H
+#define CRAYONS_EXPORT_H
+
+#include <stdio.h>
+
+#include "canvas.h"
+
+/*
+ * Encoders for saving canvases as PNG, JPEG or WebP.
+ *
+ * Every encoder pulls the canvas out CANVAS_TILE_SIZE rows at a time and
+ * converts the band on its way to the file, so memory on top of the canvas
+ * is a couple of bands however large the image is.
+ *
+ * PNGs are written without libpng, so that each band can be filtered and
+ * deflated in parallel: parallel_rows() cuts it into chunks, each deflated
+ * on its own but primed with the 32 KiB in front of it and ended on a byte
+ * boundary with a sync flush. Joined up they make one zlib stream that
+ * compresses almost as well as a serial one.
+ *
+ * JPEGs go through libjpeg a scanline at a time, over white since JPEG has
+ * no alpha. WebP is the exception to the band rule: libwebp only encodes
+ * whole pictures, so the bands are converted straight into the picture
+ * libwebp allocates, and that is the one full-size copy.
+ */
+
+typedef enum {
+    EXPORT_PNG,
+    EXPORT_JPEG,
+    EXPORT_WEBP,
+} ExportFormat;
+
+/* Speed against file size, at the same quality. */
+typedef enum {
+    EXPORT_FAST,
+    EXPORT_BALANCED,
+    EXPORT_SMALLEST,
+} ExportPreset;
+
+/* PNG row filters. EXPORT_FILTER_ADAPTIVE picks, row by row, the one whose
+ * output has the smallest sum of absolute values, as libpng does. */
+typedef enum {
+    EXPORT_FILTER_NONE,
+    EXPORT_FILTER_SUB,
+    EXPORT_FILTER_UP,
+    EXPORT_FILTER_AVERAGE,
+    EXPORT_FILTER_PAETH,
+    EXPORT_FILTER_ADAPTIVE,
+} ExportFilter;
+
+#define EXPORT_DEFAULT_QUALITY 90
+#define EXPORT_MESSAGE_SIZE 256
+
+typedef struct {
+    ExportFormat format;
+    ExportPreset preset;        /* also picks the JPEG and WebP encoder settings */
+    int quality;                /* JPEG and lossy WebP, 1 to 100 */
+    gboolean lossless;          /* WebP */
+
+    /* PNG */
+    int level;                  /* zlib, 0 to 9 */
+    int strategy;               /* zlib, e.g. Z_FILTERED or Z_RLE */
+    ExportFilter filter;
+} ExportOptions;
+
+/* Called after each band with the fraction of the image written so far. */
+typedef void (*ExportProgressFunc)(double fraction, gpointer data);
+
+/* Fills in options for format with the settings of preset, lossless for
+ * WebP and EXPORT_DEFAULT_QUALITY. */
+void export_options_init(ExportOptions *options, ExportFormat format, ExportPreset preset);
+
+/* From the extension of filename, ignoring case; PNG for anything else. */
+ExportFormat export_format_from_name(const char *filename);
+
+/* "fast", "balanced" or "smallest". */
+const char *export_preset_name(ExportPreset preset);
+gboolean export_preset_from_name(const char *name, ExportPreset *preset);
+
+/* Encodes canvas into fp. On failure, copies the reason into message, which
+ * holds EXPORT_MESSAGE_SIZE bytes; write errors are left for the caller to
+ * find with ferror(). Runs on any thread, provided nothing writes to canvas
+ * meanwhile, but not from inside a parallel_rows() function. progress may
+ * be NULL. */
+gboolean export_write(const Canvas *canvas, FILE *fp, const ExportOptions *options,
+                      ExportProgressFunc progress, gpointer data, char *message);
+
+#endif
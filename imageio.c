@@ -0,0 +1,334 @@
+#include "imageio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <png.h>
+
+#include "pixels.h"
+
+#define PNG_HEADER_SIZE 29     /* signature and IHDR chunk up to the interlace byte */
+#define PNG_MESSAGE_SIZE 256
+
+static void png_error_cb(png_structp png, png_const_charp message) {
+    g_strlcpy(png_get_error_ptr(png), message, PNG_MESSAGE_SIZE);
+    png_longjmp(png, 1);
+}
+
+static void png_warning_cb(png_structp png, png_const_charp message) {
+}
+
+/* TRUE if header starts a PNG that can be read row by row. */
+static gboolean png_is_streamable(const guint8 *header, size_t len) {
+    return len == PNG_HEADER_SIZE && png_sig_cmp(header, 0, 8) == 0 &&
+           memcmp(header + 12, "IHDR", 4) == 0 && header[28] == PNG_INTERLACE_NONE;
+}
+
+static gboolean load_png(FILE *fp, const char *filename, const ImageioLoadFuncs *funcs,
+                         gpointer data, GCancellable *cancellable, GError **error) {
+    char message[PNG_MESSAGE_SIZE] = "";
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, message,
+                                             png_error_cb, png_warning_cb);
+    png_infop info = png_create_info_struct(png);
+    guint8 *volatile band = NULL;
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        g_free(band);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "Error loading %s: %s", filename, message);
+        return FALSE;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    if (width > G_MAXINT / 4 || height > G_MAXINT) png_error(png, "image too large");
+
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    png_set_bgr(png);
+    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+#else
+    png_set_swap_alpha(png);
+    png_set_filler(png, 0xFF, PNG_FILLER_BEFORE);
+#endif
+    png_read_update_info(png, info);
+
+    int stride = (int)width * 4;
+    funcs->size((int)width, (int)height, data);
+    band = g_malloc((size_t)stride * CANVAS_TILE_SIZE);
+
+    for (int y = 0; y < (int)height; y += CANVAS_TILE_SIZE) {
+        if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+            png_destroy_read_struct(&png, &info, NULL);
+            g_free(band);
+            return FALSE;
+        }
+
+        cairo_rectangle_int_t r = { 0, y, (int)width, MIN(CANVAS_TILE_SIZE, (int)height - y) };
+        for (int i = 0; i < r.height; i++) {
+            png_read_row(png, band + (size_t)i * stride, NULL);
+        }
+        pixels_premultiply(band, stride, r.width, r.height);
+        funcs->rows(&r, band, stride, data);
+    }
+    png_read_end(png, NULL);
+
+    png_destroy_read_struct(&png, &info, NULL);
+    g_free(band);
+    return TRUE;
+}
+
+/* State of a GdkPixbufLoader being fed from a file. */
+typedef struct {
+    const ImageioLoadFuncs *funcs;
+    gpointer data;
+    guint8 *band;
+} PixbufStream;
+
+static void on_area_prepared(GdkPixbufLoader *loader, gpointer user_data) {
+    PixbufStream *stream = user_data;
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    int width = gdk_pixbuf_get_width(pixbuf);
+
+    stream->funcs->size(width, gdk_pixbuf_get_height(pixbuf), stream->data);
+    stream->band = g_malloc((size_t)width * 4 * CANVAS_TILE_SIZE);
+}
+
+/* Passes the decoded area on one band of CANVAS_TILE_SIZE rows at a time. */
+static void on_area_updated(GdkPixbufLoader *loader, int x, int y, int width, int height,
+                            gpointer user_data) {
+    PixbufStream *stream = user_data;
+    GdkPixbuf *pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+    int stride = width * 4;
+
+    for (int y0 = y; y0 < y + height; y0 += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { x, y0, width, MIN(CANVAS_TILE_SIZE, y + height - y0) };
+        pixels_from_rgba(pixels + (size_t)y0 * rowstride + (size_t)x * channels, rowstride,
+                         channels, stream->band, stride, r.width, r.height);
+        stream->funcs->rows(&r, stream->band, stride, stream->data);
+    }
+}
+
+#define PIXBUF_CHUNK_SIZE 65536
+
+static gboolean load_pixbuf(FILE *fp, const ImageioLoadFuncs *funcs, gpointer data,
+                            GCancellable *cancellable, GError **error) {
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    PixbufStream stream = { funcs, data, NULL };
+    g_signal_connect(loader, "area-prepared", G_CALLBACK(on_area_prepared), &stream);
+    g_signal_connect(loader, "area-updated", G_CALLBACK(on_area_updated), &stream);
+
+    guint8 *chunk = g_malloc(PIXBUF_CHUNK_SIZE);
+    gboolean ok = TRUE;
+    size_t len;
+    while (ok && (len = fread(chunk, 1, PIXBUF_CHUNK_SIZE, fp)) > 0) {
+        ok = !g_cancellable_set_error_if_cancelled(cancellable, error) &&
+             gdk_pixbuf_loader_write(loader, chunk, len, error);
+    }
+    if (ok && ferror(fp)) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Could not read image: %s", g_strerror(saved_errno));
+        ok = FALSE;
+    }
+
+    /* Closing also flushes whatever the loader still holds back. */
+    if (ok) {
+        ok = gdk_pixbuf_loader_close(loader, error);
+    } else {
+        gdk_pixbuf_loader_close(loader, NULL);
+    }
+
+    g_free(chunk);
+    g_free(stream.band);
+    g_object_unref(loader);
+    return ok;
+}
+
+/* name is only used in messages. */
+static gboolean load_fp(FILE *fp, const char *name, const ImageioLoadFuncs *funcs, gpointer data,
+                        GCancellable *cancellable, GError **error) {
+    guint8 header[PNG_HEADER_SIZE];
+    size_t len = fread(header, 1, sizeof(header), fp);
+    rewind(fp);
+
+    if (png_is_streamable(header, len)) {
+        return load_png(fp, name, funcs, data, cancellable, error);
+    }
+    return load_pixbuf(fp, funcs, data, cancellable, error);
+}
+
+gboolean imageio_load_stream(const char *filename, const ImageioLoadFuncs *funcs, gpointer data,
+                             GCancellable *cancellable, GError **error) {
+    FILE *fp = g_fopen(filename, "rb");
+    if (!fp) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Could not open %s: %s", filename, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    gboolean ok = load_fp(fp, filename, funcs, data, cancellable, error);
+    fclose(fp);
+    return ok;
+}
+
+static void on_load_size(int width, int height, gpointer data) {
+    Canvas **canvas = data;
+    *canvas = canvas_new(width, height, 0);
+}
+
+static void on_load_rows(const cairo_rectangle_int_t *r, const guint8 *pixels, int stride,
+                         gpointer data) {
+    Canvas **canvas = data;
+    canvas_write(*canvas, r, pixels, stride);
+}
+
+static const ImageioLoadFuncs canvas_funcs = { on_load_size, on_load_rows };
+
+Canvas *imageio_load(const char *filename, GError **error) {
+    Canvas *canvas = NULL;
+
+    if (!imageio_load_stream(filename, &canvas_funcs, &canvas, NULL, error)) {
+        canvas_free(canvas);
+        return NULL;
+    }
+    return canvas;
+}
+
+Canvas *imageio_load_bytes(GBytes *bytes, GError **error) {
+    gsize size;
+    gconstpointer contents = g_bytes_get_data(bytes, &size);
+    FILE *fp = size > 0 ? fmemopen((void *)contents, size, "rb") : NULL;
+    if (!fp) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "No image data");
+        return NULL;
+    }
+
+    Canvas *canvas = NULL;
+    if (!load_fp(fp, "image", &canvas_funcs, &canvas, NULL, error)) {
+        g_clear_pointer(&canvas, canvas_free);
+    }
+    fclose(fp);
+    return canvas;
+}
+
+gboolean imageio_save(const Canvas *canvas, const char *filename, const ExportOptions *options,
+                      ExportProgressFunc progress, gpointer data, GError **error) {
+    ExportOptions defaults;
+    if (!options) {
+        export_options_init(&defaults, export_format_from_name(filename), EXPORT_BALANCED);
+        options = &defaults;
+    }
+
+    /* Same directory, so the final rename cannot cross file systems. */
+    char *tmp = g_strconcat(filename, ".XXXXXX", NULL);
+    int fd = g_mkstemp_full(tmp, O_WRONLY, 0666);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!fp) {
+        int saved_errno = errno;
+        if (fd >= 0) {
+            close(fd);
+            g_unlink(tmp);
+        }
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Could not write %s: %s", filename, g_strerror(saved_errno));
+        g_free(tmp);
+        return FALSE;
+    }
+
+    /* Replacing a file keeps its permissions. */
+    GStatBuf st;
+    if (g_stat(filename, &st) == 0) fchmod(fd, st.st_mode & 07777);
+
+    char message[EXPORT_MESSAGE_SIZE] = "";
+    if (!export_write(canvas, fp, options, progress, data, message)) {
+        fclose(fp);
+        g_unlink(tmp);
+        g_free(tmp);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Error saving %s: %s", filename, message);
+        return FALSE;
+    }
+
+    /* The data must be on disk before the rename makes it visible. */
+    gboolean ok = !ferror(fp) && fflush(fp) == 0 && fsync(fd) == 0;
+    int saved_errno = errno;
+    if (fclose(fp) != 0 && ok) {
+        ok = FALSE;
+        saved_errno = errno;
+    }
+    if (ok && g_rename(tmp, filename) != 0) {
+        ok = FALSE;
+        saved_errno = errno;
+    }
+
+    if (!ok) {
+        g_unlink(tmp);
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Could not write %s: %s", filename, g_strerror(saved_errno));
+    }
+    g_free(tmp);
+    return ok;
+}
+
+GBytes *imageio_encode_png(const Canvas *canvas, GError **error) {
+    char *contents = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&contents, &size);
+    if (!fp) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Could not encode PNG: %s", g_strerror(saved_errno));
+        return NULL;
+    }
+
+    /* Pasting is waiting for it. */
+    ExportOptions options;
+    export_options_init(&options, EXPORT_PNG, EXPORT_FAST);
+    char message[EXPORT_MESSAGE_SIZE] = "";
+    gboolean ok = export_write(canvas, fp, &options, NULL, NULL, message);
+    fclose(fp);
+    if (!ok) {
+        free(contents);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Could not encode PNG: %s", message);
+        return NULL;
+    }
+    return g_bytes_new_with_free_func(contents, size, free, contents);
+}
+
+GdkPixbuf *imageio_to_pixbuf(const Canvas *canvas) {
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    if (!pixbuf) return NULL;
+
+    guint8 *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    int stride = width * 4;
+    guint8 *band = g_malloc((size_t)stride * CANVAS_TILE_SIZE);
+
+    for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        canvas_read(canvas, &r, band, stride);
+        pixels_to_rgba(band, stride, pixels + (size_t)y * rowstride, rowstride, r.width, r.height);
+    }
+    g_free(band);
+    return pixbuf;
+}
@@ -0,0 +1,59 @@
+#ifndef CRAYONS_IMAGEIO_H
+#define CRAYONS_IMAGEIO_H
+
+#include <gio/gio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "canvas.h"
+#include "export.h"
+
+/*
+ * Loading and saving canvases.
+ *
+ * Non-interlaced PNGs are streamed through libpng one band of
+ * CANVAS_TILE_SIZE rows at a time, so peak memory on top of the canvas is a
+ * single band however large the image is. Other formats, and interlaced
+ * PNGs, are fed to a GdkPixbufLoader a chunk at a time. Saving goes through
+ * the encoders in export.h.
+ */
+
+/* Hooks for imageio_load_stream(). size is called once, before any rows.
+ * rows gets the premultiplied ARGB32 pixels of r as they are decoded,
+ * mostly top to bottom in bands of CANVAS_TILE_SIZE rows; interlaced images
+ * may deliver the same rows more than once. pixels is only valid during the
+ * call. Both run on the loading thread. */
+typedef struct {
+    void (*size)(int width, int height, gpointer data);
+    void (*rows)(const cairo_rectangle_int_t *r, const guint8 *pixels, int stride,
+                 gpointer data);
+} ImageioLoadFuncs;
+
+/* Decodes filename through funcs without building a canvas, so the caller
+ * can show the image while it loads. Runs on any thread. Fails with
+ * G_IO_ERROR_CANCELLED once cancellable is triggered; it may be NULL. */
+gboolean imageio_load_stream(const char *filename, const ImageioLoadFuncs *funcs, gpointer data,
+                             GCancellable *cancellable, GError **error);
+
+Canvas *imageio_load(const char *filename, GError **error);
+
+/* Like imageio_load(), for an encoded image held in memory, such as one
+ * pasted from the clipboard. */
+Canvas *imageio_load_bytes(GBytes *bytes, GError **error);
+
+/* Writes a temporary file next to filename and renames it into place once
+ * it is complete, so filename never holds a partial image. If options is
+ * NULL, the format follows the extension of filename, with the balanced
+ * preset. Runs on any thread, provided nothing writes to canvas meanwhile;
+ * to keep editing, save a canvas_snapshot(). progress may be NULL. */
+gboolean imageio_save(const Canvas *canvas, const char *filename, const ExportOptions *options,
+                      ExportProgressFunc progress, gpointer data, GError **error);
+
+/* Encodes canvas as a PNG in memory with the fast preset. Same threading
+ * rules as imageio_save(). */
+GBytes *imageio_encode_png(const Canvas *canvas, GError **error);
+
+/* Copies canvas into a new straight alpha RGBA pixbuf, or returns NULL if
+ * there is not enough memory for one. */
+GdkPixbuf *imageio_to_pixbuf(const Canvas *canvas);
+
+#endif
@@ -0,0 +1,380 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "imageio.h"
+
+typedef enum {
+    JNL_BASE = 1,       /* DISPLAY_LIST_BASE_FORMAT */
+    JNL_ADD,            /* ANNOTATION_FORMAT */
+    JNL_UNDO,
+    JNL_REDO,
+} JournalRecord;
+
+struct _Journal {
+    char *path;
+    char *tmp_path;             /* checkpoint being written */
+    int fd;                     /* -1 once logging stopped */
+    int records;                /* appended since the last checkpoint */
+
+    DisplayListBase base;       /* what JNL_BASE says */
+
+    guint sync_source;
+    GThread *syncer;
+    gint sync_done;
+
+    /* A checkpoint is serialized on the main thread into checkpoint,
+     * handed to the syncer as writing and written by it to tmp_path, which
+     * it leaves open as checkpoint_fd. Records appended from the moment it
+     * was serialized collect in pending until it replaces the journal. */
+    GBytes *checkpoint;
+    GBytes *writing;
+    int checkpoint_fd;
+    int checkpoint_errno;
+    GByteArray *pending;
+    int pending_records;
+};
+
+static Journal *journal_alloc(const char *dir) {
+    Journal *journal = g_new0(Journal, 1);
+    journal->path = g_build_filename(dir, "journal", NULL);
+    journal->tmp_path = g_strconcat(journal->path, ".tmp", NULL);
+    journal->fd = -1;
+    journal->checkpoint_fd = -1;
+    return journal;
+}
+
+static void wait_sync(Journal *journal) {
+    if (journal->syncer) {
+        g_thread_join(journal->syncer);
+        journal->syncer = NULL;
+    }
+}
+
+static gpointer sync_thread(gpointer data) {
+    Journal *journal = data;
+    fdatasync(journal->fd);
+
+    if (journal->writing) {
+        gsize size;
+        const void *bytes = g_bytes_get_data(journal->writing, &size);
+        int out = g_open(journal->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        gboolean ok = out >= 0 && write(out, bytes, size) == (gssize)size && fdatasync(out) == 0;
+        journal->checkpoint_errno = ok ? 0 : errno;
+        if (!ok && out >= 0) close(out);
+        journal->checkpoint_fd = ok ? out : -1;
+    }
+    g_atomic_int_set(&journal->sync_done, 1);
+    return NULL;
+}
+
+/* Forgets the checkpoint in progress, if any; the syncer must be done. */
+static void drop_checkpoint(Journal *journal) {
+    g_clear_pointer(&journal->checkpoint, g_bytes_unref);
+    g_clear_pointer(&journal->writing, g_bytes_unref);
+    g_clear_pointer(&journal->pending, g_byte_array_unref);
+    if (journal->checkpoint_fd >= 0) {
+        close(journal->checkpoint_fd);
+        journal->checkpoint_fd = -1;
+        g_unlink(journal->tmp_path);
+    }
+}
+
+/* Adds the records appended meanwhile to the checkpoint the syncer wrote
+ * and renames it over the journal; until then the old journal stays
+ * valid. A checkpoint that failed is tried again after another
+ * JOURNAL_CHECKPOINT_RECORDS records. */
+static void finish_checkpoint(Journal *journal) {
+    int out = journal->checkpoint_fd;
+    GByteArray *pending = journal->pending;
+    journal->checkpoint_fd = -1;
+
+    gboolean ok = out >= 0 &&
+                  write(out, pending->data, pending->len) == (gssize)pending->len &&
+                  g_rename(journal->tmp_path, journal->path) == 0;
+    if (ok) {
+        close(journal->fd);
+        journal->fd = out;
+        journal->records = journal->pending_records;
+    } else {
+        g_printerr("Could not write %s: %s\n", journal->tmp_path,
+                   g_strerror(out >= 0 ? errno : journal->checkpoint_errno));
+        if (out >= 0) close(out);
+        g_unlink(journal->tmp_path);
+        journal->records = 0;
+    }
+    g_clear_pointer(&journal->writing, g_bytes_unref);
+    g_clear_pointer(&journal->pending, g_byte_array_unref);
+}
+
+static gboolean on_sync(gpointer data) {
+    Journal *journal = data;
+
+    /* Give a slow disk the time it needs rather than queueing up. */
+    if (journal->syncer && !g_atomic_int_get(&journal->sync_done)) return G_SOURCE_CONTINUE;
+    wait_sync(journal);
+    if (journal->writing) finish_checkpoint(journal);
+
+    journal->writing = g_steal_pointer(&journal->checkpoint);
+    g_atomic_int_set(&journal->sync_done, 0);
+    journal->syncer = g_thread_new("journal-sync", sync_thread, journal);
+
+    /* Come back to put the checkpoint in place once it is written. */
+    if (journal->writing) return G_SOURCE_CONTINUE;
+    journal->sync_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_sync(Journal *journal) {
+    if (!journal->sync_source) {
+        journal->sync_source = g_timeout_add(JOURNAL_SYNC_INTERVAL_MS, on_sync, journal);
+    }
+}
+
+/* Stops any pending sync and checkpoint, so fd can be closed. */
+static void stop_sync(Journal *journal) {
+    if (journal->sync_source) {
+        g_source_remove(journal->sync_source);
+        journal->sync_source = 0;
+    }
+    wait_sync(journal);
+    drop_checkpoint(journal);
+}
+
+static void close_file(Journal *journal) {
+    stop_sync(journal);
+    if (journal->fd >= 0) close(journal->fd);
+    journal->fd = -1;
+}
+
+/* Logs nothing more. */
+static void disable(Journal *journal) {
+    g_printerr("Could not write %s: %s\n", journal->path, g_strerror(errno));
+    close_file(journal);
+    g_unlink(journal->path);
+}
+
+/* Appends a record as a type byte, its length and payload, if any. */
+static void add_record(GByteArray *out, JournalRecord type, GVariant *payload) {
+    gsize size = payload ? g_variant_get_size(payload) : 0;
+    guint32 length = GUINT32_TO_LE(size);
+    guint8 header[5] = { type };
+    memcpy(header + 1, &length, 4);
+
+    guint offset = out->len;
+    g_byte_array_append(out, header, 5);
+    g_byte_array_set_size(out, offset + 5 + size);
+    if (payload) g_variant_store(payload, out->data + offset + 5);
+}
+
+/* The compacted journal: just the base and list as it stands. */
+static GBytes *serialize(const Journal *journal, const DisplayList *list) {
+    GByteArray *out = g_byte_array_new();
+    g_byte_array_append(out, (const guint8 *)JOURNAL_MAGIC, 8);
+
+    GVariant *base = g_variant_ref_sink(
+        g_variant_new(DISPLAY_LIST_BASE_FORMAT, journal->base.width, journal->base.height,
+                      journal->base.filename ? journal->base.filename : "",
+                      journal->base.mtime, journal->base.size));
+    add_record(out, JNL_BASE, base);
+    g_variant_unref(base);
+
+    int drawn = list ? display_list_get_length(list) : 0;
+    int undone = list ? display_list_get_redo_length(list) : 0;
+    for (int i = 0; i < drawn + undone; i++) {
+        GVariant *a = g_variant_ref_sink(annotation_serialize(display_list_get_nth(list, i)));
+        add_record(out, JNL_ADD, a);
+        g_variant_unref(a);
+    }
+    for (int i = 0; i < undone; i++) add_record(out, JNL_UNDO, NULL);
+
+    return g_byte_array_free_to_bytes(out);
+}
+
+/* Writes a record in one go, so a crash can only cut the last one short. */
+static void append(Journal *journal, const DisplayList *list, JournalRecord type,
+                   GVariant *payload) {
+    if (!journal || journal->fd < 0) return;
+
+    GByteArray *record = g_byte_array_new();
+    add_record(record, type, payload);
+    if (write(journal->fd, record->data, record->len) != (gssize)record->len) {
+        g_byte_array_unref(record);
+        disable(journal);
+        return;
+    }
+    if (journal->pending) {
+        g_byte_array_append(journal->pending, record->data, record->len);
+        journal->pending_records++;
+    }
+    g_byte_array_unref(record);
+
+    if (++journal->records >= JOURNAL_CHECKPOINT_RECORDS && !journal->pending) {
+        journal->checkpoint = serialize(journal, list);
+        journal->pending = g_byte_array_new();
+        journal->pending_records = 0;
+    }
+    schedule_sync(journal);
+}
+
+Journal *journal_new(const char *dir, const char *filename, int width, int height,
+                     const DisplayList *list) {
+    if (!dir) return NULL;
+
+    GStatBuf st;
+    if (filename && g_stat(filename, &st) != 0) return NULL;
+
+    Journal *journal = journal_alloc(dir);
+    journal->base.width = width;
+    journal->base.height = height;
+    if (filename) {
+        journal->base.filename = g_canonicalize_filename(filename, NULL);
+        journal->base.mtime = st.st_mtime;
+        journal->base.size = st.st_size;
+    }
+
+    /* Written here and synced later like any record. */
+    GBytes *contents = serialize(journal, list);
+    gsize size;
+    const void *bytes = g_bytes_get_data(contents, &size);
+    journal->fd = g_open(journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (journal->fd >= 0 && write(journal->fd, bytes, size) == (gssize)size) {
+        schedule_sync(journal);
+    } else {
+        disable(journal);
+        g_clear_pointer(&journal, journal_free);
+    }
+    g_bytes_unref(contents);
+    return journal;
+}
+
+void journal_add(Journal *journal, const DisplayList *list) {
+    if (!journal || journal->fd < 0) return;
+
+    const Annotation *a = display_list_get_nth(list, display_list_get_length(list) - 1);
+    GVariant *payload = g_variant_ref_sink(annotation_serialize(a));
+    append(journal, list, JNL_ADD, payload);
+    g_variant_unref(payload);
+}
+
+void journal_undo(Journal *journal, const DisplayList *list) {
+    append(journal, list, JNL_UNDO, NULL);
+}
+
+void journal_redo(Journal *journal, const DisplayList *list) {
+    append(journal, list, JNL_REDO, NULL);
+}
+
+void journal_free(Journal *journal) {
+    if (!journal) return;
+
+    close_file(journal);
+    g_unlink(journal->path);
+    g_free(journal->base.filename);
+    g_free(journal->tmp_path);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+/* Payload of the record at *pos as a GVariant of type, advancing *pos, or
+ * NULL at the end or at a record cut short. */
+static GVariant *next_record(const guint8 *data, gsize length, gsize *pos,
+                             JournalRecord *type, const char *format) {
+    if (length - *pos < 5) return NULL;
+
+    guint32 size;
+    memcpy(&size, data + *pos + 1, 4);
+    size = GUINT32_FROM_LE(size);
+    if (length - *pos - 5 < size) return NULL;
+
+    *type = data[*pos];
+    GBytes *bytes = g_bytes_new(data + *pos + 5, size);
+    *pos += 5 + size;
+    GVariant *variant = g_variant_ref_sink(
+        g_variant_new_from_bytes(G_VARIANT_TYPE(format), bytes, FALSE));
+    g_bytes_unref(bytes);
+    return variant;
+}
+
+Journal *journal_recover(const char *dir, Canvas **canvas, DisplayList **list,
+                         DisplayListBase *base) {
+    Journal *journal = journal_alloc(dir);
+    gchar *data;
+    gsize length;
+    if (!g_file_get_contents(journal->path, &data, &length, NULL)) {
+        journal_free(journal);
+        return NULL;
+    }
+
+    gsize pos = 8;
+    JournalRecord type;
+    GVariant *first = NULL;
+    if (length >= 8 && memcmp(data, JOURNAL_MAGIC, 8) == 0) {
+        first = next_record((guint8 *)data, length, &pos, &type, DISPLAY_LIST_BASE_FORMAT);
+    }
+    if (!first || type != JNL_BASE) {
+        if (first) g_variant_unref(first);
+        g_free(data);
+        journal_free(journal);
+        return NULL;
+    }
+
+    const char *filename;
+    g_variant_get(first, "(ii&sxt)", &journal->base.width, &journal->base.height, &filename,
+                  &journal->base.mtime, &journal->base.size);
+    if (*filename) journal->base.filename = g_strdup(filename);
+    g_variant_unref(first);
+
+    int width = journal->base.width;
+    int height = journal->base.height;
+    Canvas *composite = NULL;
+    GStatBuf st;
+    if (!journal->base.filename) {
+        if (width > 0 && height > 0) composite = canvas_new(width, height, CANVAS_WHITE);
+    } else if (g_stat(journal->base.filename, &st) == 0 && st.st_mtime == journal->base.mtime &&
+               (guint64)st.st_size == journal->base.size) {
+        composite = imageio_load(journal->base.filename, NULL);
+        if (composite && (canvas_get_width(composite) != width ||
+                          canvas_get_height(composite) != height)) {
+            g_clear_pointer(&composite, canvas_free);
+        }
+    }
+    if (!composite) {
+        g_free(data);
+        journal_free(journal);
+        return NULL;
+    }
+
+    DisplayList *recovered = display_list_new(canvas_snapshot(composite));
+    GVariant *record;
+    int replayed = 0;
+    while ((record = next_record((guint8 *)data, length, &pos, &type, ANNOTATION_FORMAT))) {
+        cairo_rectangle_int_t changed;
+        replayed++;
+        Annotation *a = type == JNL_ADD ? annotation_deserialize(record) : NULL;
+        if (a) display_list_add(recovered, composite, a, &changed);
+        if (type == JNL_UNDO) display_list_undo(recovered, composite, &changed);
+        if (type == JNL_REDO) display_list_redo(recovered, composite, &changed);
+        g_variant_unref(record);
+    }
+    g_free(data);
+
+    /* Carry on after the last whole record, rather than rewriting what
+     * already is on disk. A checkpoint the crash cut short is no use. */
+    g_unlink(journal->tmp_path);
+    journal->fd = g_open(journal->path, O_WRONLY | O_CLOEXEC, 0);
+    if (journal->fd < 0 || ftruncate(journal->fd, pos) != 0 ||
+        lseek(journal->fd, pos, SEEK_SET) < 0) {
+        disable(journal);
+    }
+    journal->records = replayed;
+    *canvas = composite;
+    *list = recovered;
+    *base = journal->base;
+    base->filename = g_strdup(journal->base.filename);
+    return journal;
+}
@@ -0,0 +1,60 @@
+#ifndef CRAYONS_JOURNAL_H
+#define CRAYONS_JOURNAL_H
+
+#include "annotations.h"
+
+/*
+ * Write-ahead journals of annotations.
+ *
+ * With crash recovery on, every open image whose base can be loaded again
+ * keeps a journal in its directory next to its session file (see
+ * session.h). It logs the base image, either a blank canvas or an image
+ * file, followed by every annotation added, undone and redone, as it
+ * happens. Records are appended with a single write each and synced to
+ * disk at most every JOURNAL_SYNC_INTERVAL_MS from a helper thread. Every
+ * JOURNAL_CHECKPOINT_RECORDS records the base and the display list as it
+ * stands are serialized, and the same helper thread writes them to a
+ * compacted file; the records appended meanwhile are added to it before it
+ * replaces the journal, so drawing never waits on the disk.
+ *
+ * After a crash, the base is loaded again and the journal replayed over it,
+ * which brings back the undo history as well. An image file only counts as
+ * the base if its size and modification time are unchanged. A record cut
+ * short by the crash is dropped and the journal carries on from there.
+ *
+ * The file is JOURNAL_MAGIC followed by records of a type byte, a
+ * little-endian 32-bit payload length and the payload,
+ * DISPLAY_LIST_BASE_FORMAT for the base and ANNOTATION_FORMAT for each
+ * annotation.
+ *
+ * Journals belong to the main thread. A NULL journal ignores every call.
+ */
+
+#define JOURNAL_MAGIC "CRAYJNL2"
+#define JOURNAL_SYNC_INTERVAL_MS 1000
+#define JOURNAL_CHECKPOINT_RECORDS 256
+
+typedef struct _Journal Journal;
+
+/* Starts a journal in dir over filename, or a blank white canvas if NULL,
+ * holding what list already has drawn over it; list may be NULL. Returns
+ * NULL if dir is NULL or the journal cannot be written. */
+Journal *journal_new(const char *dir, const char *filename, int width, int height,
+                     const DisplayList *list);
+
+/* Rebuilds the canvas and display list journaled in dir by a session that
+ * did not exit cleanly and goes on logging them. base receives the image
+ * they are drawn over; free its filename with g_free(). Returns NULL if
+ * there is no journal or its base is gone. */
+Journal *journal_recover(const char *dir, Canvas **canvas, DisplayList **list,
+                         DisplayListBase *base);
+
+/* Logs the annotation list just added, undid or redid. */
+void journal_add(Journal *journal, const DisplayList *list);
+void journal_undo(Journal *journal, const DisplayList *list);
+void journal_redo(Journal *journal, const DisplayList *list);
+
+/* Closes and removes the journal, e.g. when its image is closed. */
+void journal_free(Journal *journal);
+
+#endif
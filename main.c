@@ -2,36 +2,121 @@
 #include <gdk/gdkkeysyms.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <glib.h>
 
-static cairo_surface_t *surface = NULL;
+#include "annotations.h"
+#include "batch.h"
+#include "canvas.h"
+#include "document.h"
+#include "imageio.h"
+#include "journal.h"
+#include "mipmap.h"
+#include "record.h"
+#include "redact.h"
+#include "session.h"
+#include "shapes.h"
+#include "stroke.h"
+#include "trace.h"
+#include "viewport.h"
+
+/* Composite of display_list, which owns the base image it is drawn over. */
+static Canvas *canvas = NULL;
+static DisplayList *display_list = NULL;
 static GtkWidget *window = NULL;
-static GtkWidget *scrolled_window = NULL;
 static GtkWidget *drawing_area = NULL;
-
-static GList *undo_stack = NULL;
-static GList *redo_stack = NULL;
+static GtkWidget *hscrollbar = NULL;
+static GtkWidget *vscrollbar = NULL;
+static GtkAdjustment *hadjustment = NULL;
+static GtkAdjustment *vadjustment = NULL;
+static GtkWidget *status_label = NULL;
+static GtkWidget *save_progress = NULL;
+static GtkWidget *load_progress = NULL;
 
 static int canvas_width = 800;
 static int canvas_height = 600;
 
-typedef enum {
-    TOOL_PEN,
-    TOOL_RECT,
-    TOOL_ELLIPSE,
-    TOOL_ARROW,
-    TOOL_REDACT
-} ToolType;
-
 static ToolType current_tool = TOOL_PEN;
+static RedactMode current_redact_mode = REDACT_JITTER;
 static GdkRGBA current_color = {0, 0, 0, 1}; 
 static double current_size = 3.0;
 static double zoom_level = 1.0;
+
+/* Zoom-out stops at the smallest mip level, zoom-in at a 64x pixel grid. */
+#define MIN_ZOOM (1.0 / (1 << MIPMAP_MAX_LEVELS))
+#define MAX_ZOOM 64.0
+
+/* From this zoom on, canvas pixels are drawn as sharp squares. */
+#define PIXEL_GRID_ZOOM 2.0
 static gboolean is_modified = FALSE;
 
-static double last_x = 0;
-static double last_y = 0;
+/* Bumped on every edit, so a finished save can tell whether the canvas
+ * still matches what it wrote. */
+static guint64 edit_generation = 0;
+
+/* Open images in tab order. While a document is shown its state lives in
+ * the globals above, and store_document() writes it back. */
+static GPtrArray *documents = NULL;
+static Document *active = NULL;
+static GtkWidget *notebook = NULL;
+
+/* Save running on a worker thread; there is at most one at a time. */
+typedef struct {
+    Document *doc;
+    Canvas *snapshot;
+    GBytes *annotations;        /* display list sidecar, or NULL */
+    char *filename;
+    ExportOptions options;
+    guint64 generation;     /* edit_generation the snapshot was taken at */
+    gint progress;          /* per mille written, updated by the worker */
+    gboolean ok;
+    GError *error;
+} SaveJob;
+
+static SaveJob *save_job = NULL;
+static guint save_progress_source = 0;
+
+/* What the save dialog was last left at. */
+static ExportPreset save_preset = EXPORT_BALANCED;
+static int save_quality = EXPORT_DEFAULT_QUALITY;
+static gboolean save_lossless = TRUE;
+
+/* Bands a load may decode ahead of the main loop before it waits. */
+#define LOAD_QUEUE_MAX 8
+
+/* Image decoded on a worker thread. The worker queues bands and the main
+ * loop writes them into the canvas, which stays single-threaded. */
+typedef struct {
+    gint ref_count;
+    char *filename;
+    GCancellable *cancellable;
+
+    GMutex lock;
+    GCond drained;              /* signalled when the queue gets shorter */
+    GQueue bands;               /* LoadBand, oldest first */
+    int width, height;          /* 0 until the worker knows the size */
+    gboolean done;
+    gboolean ok;
+    GError *error;
+    guint pump;                 /* idle source draining the queue, or 0 */
+
+    /* Main thread only. */
+    gint64 trace_start;
+    gboolean sized;             /* canvas has been replaced */
+    int rows_loaded;
+} LoadJob;
+
+typedef struct {
+    cairo_rectangle_int_t r;
+    guint8 *pixels;             /* packed, r.width * 4 bytes per row */
+} LoadBand;
+
+static LoadJob *load_job = NULL;
+
+/* Close the window once the running save has finished. */
+static gboolean close_after_save = FALSE;
+
 static gboolean is_drawing = FALSE;
 
 static double start_x = 0;
@@ -39,20 +124,53 @@ static double start_y = 0;
 static double end_x = 0;
 static double end_y = 0;
 
+/* Pen stroke in progress. stroke keeps every sample and is filled into the
+ * canvas once on release. Until then a cheaper fixed-width preview is drawn
+ * opaque into stroke_mask, so crossing itself never darkens a translucent
+ * colour on screen either. Motion samples collect in stroke_pending and
+ * reach the mask once per frame as one path; the first pending point is the
+ * last one already drawn. */
+static Stroke *stroke = NULL;
+static Canvas *stroke_mask = NULL;
+static GArray *stroke_pending = NULL;    /* (x, y) pairs */
+static guint stroke_tick = 0;
+static double stroke_x1, stroke_y1, stroke_x2, stroke_y2;
+
+/* Canvas-space bounds of the shape preview currently on screen. */
+static double damage_x1 = 0, damage_y1 = 0, damage_x2 = 0, damage_y2 = 0;
+static gboolean has_shape_damage = FALSE;
+
+/* Time a redact preview frame may spend rendering before it defers the
+ * rest to the next frame. */
+#define REDACT_PREVIEW_BUDGET_US 8000
+
+/* Seed of the redact drag in progress; the preview and the final result
+ * use the same one, so they only differ near the rectangle's edges (see
+ * redact.h). */
+static guint32 redact_seed = 0;
+
 /* Forward declarations */
-static void clear_surface(void);
-static void load_image_to_surface(const char *filename);
+static void load_image_to_canvas(const char *filename);
 static void on_tool_clicked(GtkToolButton *btn, gpointer data);
 static void on_color_set(GtkColorButton *widget, gpointer data);
 static void on_size_changed(GtkSpinButton *spin, gpointer data);
-static void free_stack(GList **stack);
 static void update_drawing_area_size(void);
-static void apply_redact(cairo_surface_t *surf, double sx, double sy, double ex, double ey);
 static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data);
 static gboolean perform_save(void);
 static void on_quit_menu(GtkWidget *w, gpointer data);
-
-#define CLAMP_VAL(x, min, max) ((x) < (min) ? (min) : ((x) > (max) ? (max) : (x)))
+static void cancel_load(void);
+static void queue_canvas_area(double x1, double y1, double x2, double y2);
+static void add_document(Document *doc, gboolean show);
+static void remove_document(Document *doc);
+static void close_document(Document *doc);
+static void store_document(void);
+static int document_page(Document *doc);
+
+static ShapeStyle current_style(void) {
+    ShapeStyle style = { current_color.red, current_color.green, current_color.blue,
+                         current_color.alpha, current_size };
+    return style;
+}
 
 void show_error(GtkWindow *parent, const char *message) {
     GtkWidget *dialog;
@@ -67,343 +185,705 @@ void show_error(GtkWindow *parent, const char *message) {
     gtk_widget_destroy(dialog);
 }
 
+/* Widget pixels scrolled out of view to the left and top. The drawing area
+ * only ever covers the viewport; the zoomed canvas exists just as the range
+ * of the scroll adjustments. */
+static double view_x(void) {
+    return hadjustment ? floor(gtk_adjustment_get_value(hadjustment)) : 0;
+}
+
+static double view_y(void) {
+    return vadjustment ? floor(gtk_adjustment_get_value(vadjustment)) : 0;
+}
+
+static void widget_to_canvas(double x, double y, double *cx, double *cy) {
+    *cx = (x + view_x()) / zoom_level;
+    *cy = (y + view_y()) / zoom_level;
+}
+
+static void update_adjustment(GtkAdjustment *adj, GtkWidget *scrollbar,
+                              double content, double page) {
+    double value = CLAMP(gtk_adjustment_get_value(adj), 0, MAX(0, content - page));
+    gtk_adjustment_configure(adj, value, 0, MAX(content, page),
+                             MAX(1, page / 10), MAX(1, page * 0.9), page);
+    gtk_widget_set_visible(scrollbar, content > page);
+}
+
 static void update_drawing_area_size(void) {
-    if (drawing_area) {
-        int w = canvas_width * zoom_level;
-        int h = canvas_height * zoom_level;
-        gtk_widget_set_size_request(drawing_area, w, h);
+    if (drawing_area && hadjustment) {
+        update_adjustment(hadjustment, hscrollbar, ceil(canvas_width * zoom_level),
+                          gtk_widget_get_allocated_width(drawing_area));
+        update_adjustment(vadjustment, vscrollbar, ceil(canvas_height * zoom_level),
+                          gtk_widget_get_allocated_height(drawing_area));
         gtk_widget_queue_draw(drawing_area);
     }
 }
 
-cairo_surface_t* copy_surface(cairo_surface_t *src) {
-    if (!src) return NULL;
-    cairo_surface_t *dest = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
-    cairo_t *cr = cairo_create(dest);
-    cairo_set_source_surface(cr, src, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-    return dest;
+/* Changes the zoom while keeping the canvas point under the widget
+ * position (ax, ay) in place. */
+static void set_zoom(double zoom, double ax, double ay) {
+    double cx, cy;
+    widget_to_canvas(ax, ay, &cx, &cy);
+
+    zoom_level = CLAMP(zoom, MIN_ZOOM, MAX_ZOOM);
+    update_drawing_area_size();
+
+    if (hadjustment) {
+        gtk_adjustment_set_value(hadjustment, cx * zoom_level - ax);
+        gtk_adjustment_set_value(vadjustment, cy * zoom_level - ay);
+    }
+    record_zoom(zoom_level);
 }
 
-static void push_undo() {
-    if (!surface) return;
-    free_stack(&redo_stack);
-    cairo_surface_t *copy = copy_surface(surface);
-    undo_stack = g_list_prepend(undo_stack, copy);
+static void zoom_around_center(double factor) {
+    double ax = drawing_area ? gtk_widget_get_allocated_width(drawing_area) / 2.0 : 0;
+    double ay = drawing_area ? gtk_widget_get_allocated_height(drawing_area) / 2.0 : 0;
+    set_zoom(zoom_level * factor, ax, ay);
 }
 
-static void on_undo(GtkWidget *w, gpointer data) {
-    if (!undo_stack) return;
+static void on_view_scrolled(GtkAdjustment *adj, gpointer data) {
+    if (drawing_area) gtk_widget_queue_draw(drawing_area);
+}
 
-    cairo_surface_t *current_copy = copy_surface(surface);
-    redo_stack = g_list_prepend(redo_stack, current_copy);
+/* Invalidates only the part of the drawing area that shows the given canvas
+ * rectangle, padded by a pixel for antialiasing. */
+static void queue_canvas_area(double x1, double y1, double x2, double y2) {
+    if (!drawing_area) return;
+
+    int left = (int)(floor(fmin(x1, x2) * zoom_level) - view_x()) - 1;
+    int top = (int)(floor(fmin(y1, y2) * zoom_level) - view_y()) - 1;
+    int right = (int)(ceil(fmax(x1, x2) * zoom_level) - view_x()) + 1;
+    int bottom = (int)(ceil(fmax(y1, y2) * zoom_level) - view_y()) + 1;
+    gtk_widget_queue_draw_area(drawing_area, left, top, right - left, bottom - top);
+}
 
-    cairo_surface_t *prev = (cairo_surface_t *)undo_stack->data;
-    undo_stack = g_list_delete_link(undo_stack, undo_stack);
+static void queue_canvas_rect(const cairo_rectangle_int_t *r) {
+    if (r->width <= 0 || r->height <= 0) return;
+    queue_canvas_area(r->x, r->y, r->x + r->width, r->y + r->height);
+}
+
+/* Invalidates where the shape preview was last frame and where it is now. */
+static void update_shape_damage(void) {
+    double bx1, by1, bx2, by2;
+    ShapeStyle style = current_style();
+    shape_bounds(current_tool, &style, start_x, start_y, end_x, end_y, &bx1, &by1, &bx2, &by2);
+
+    if (has_shape_damage) {
+        queue_canvas_area(damage_x1, damage_y1, damage_x2, damage_y2);
+    }
+    queue_canvas_area(bx1, by1, bx2, by2);
 
-    if (surface) cairo_surface_destroy(surface);
-    surface = prev;
+    damage_x1 = bx1;
+    damage_y1 = by1;
+    damage_x2 = bx2;
+    damage_y2 = by2;
+    has_shape_damage = TRUE;
+}
 
+static void mark_modified(void) {
     is_modified = TRUE;
-    gtk_widget_queue_draw(drawing_area);
+    edit_generation++;
 }
 
-static void on_redo(GtkWidget *w, gpointer data) {
-    if (!redo_stack) return;
+static void update_annotation_status(void) {
+    if (!status_label) return;
 
-    cairo_surface_t *current_copy = copy_surface(surface);
-    undo_stack = g_list_prepend(undo_stack, current_copy);
+    if (active && active->state != DOCUMENT_RESIDENT) {
+        gchar *text = active->error ? g_strdup_printf("Could not reopen %s", active->title)
+                                    : g_strdup_printf("Loading %s...", active->title);
+        gtk_label_set_text(GTK_LABEL(status_label), text);
+        g_free(text);
+        return;
+    }
 
-    cairo_surface_t *next = (cairo_surface_t *)redo_stack->data;
-    redo_stack = g_list_delete_link(redo_stack, redo_stack);
+    int drawn = display_list ? display_list_get_length(display_list) : 0;
+    int undone = display_list ? display_list_get_redo_length(display_list) : 0;
 
-    if (surface) cairo_surface_destroy(surface);
-    surface = next;
+    /* History costs the annotations, the base they are drawn over and the
+     * composite, which shares every tile nothing was drawn on with it. */
+    gsize history = 0;
+    if (display_list) {
+        const Canvas *base = display_list_get_base(display_list);
+        history = display_list_get_size(display_list) + canvas_get_size(canvas, NULL) +
+                  (base ? canvas_get_size(base, canvas) : 0);
+    }
+    gchar *size = g_format_size(history);
+    gchar *text = g_strdup_printf("%d annotations, %d to redo. History: %s in memory",
+                                  drawn, undone, size);
+    gtk_label_set_text(GTK_LABEL(status_label), text);
+    g_free(text);
+    g_free(size);
+}
 
-    is_modified = TRUE;
-    gtk_widget_queue_draw(drawing_area);
+/* Starts a new display list over the current canvas, which becomes its
+ * base. The base shares every tile with the canvas until one is drawn on. */
+static void reset_display_list(void) {
+    display_list_free(display_list);
+    display_list = canvas ? display_list_new(canvas_snapshot(canvas)) : NULL;
+    update_annotation_status();
 }
 
-static void on_zoom_in(GtkWidget *w, gpointer data) {
-    zoom_level *= 1.2;
-    update_drawing_area_size();
+/* Draws annotation into the canvas and records it for undo. */
+static void add_annotation(Annotation *annotation) {
+    cairo_rectangle_int_t changed;
+    gint64 start = trace_now();
+    display_list_add(display_list, canvas, annotation, &changed);
+    trace_complete("add-annotation", start);
+    journal_add(active->journal, display_list);
+
+    mipmap_invalidate(active->mipmap, changed.x, changed.y,
+                      changed.x + changed.width, changed.y + changed.height);
+    session_update(active->session, canvas, &changed);
+    queue_canvas_rect(&changed);
+    update_annotation_status();
 }
 
-static void on_zoom_out(GtkWidget *w, gpointer data) {
-    zoom_level /= 1.2;
-    update_drawing_area_size();
+static void on_undo(GtkWidget *w, gpointer data) {
+    cairo_rectangle_int_t changed;
+    if (!display_list || is_drawing) return;
+    gint64 start = trace_now();
+    if (!display_list_undo(display_list, canvas, &changed)) return;
+    trace_complete("undo", start);
+    record_undo();
+    journal_undo(active->journal, display_list);
+
+    mark_modified();
+    mipmap_invalidate(active->mipmap, changed.x, changed.y,
+                      changed.x + changed.width, changed.y + changed.height);
+    session_update(active->session, canvas, &changed);
+    queue_canvas_rect(&changed);
+    update_annotation_status();
 }
 
-static void free_stack(GList **stack) {
-    if (!*stack) return;
-    GList *l;
-    for (l = *stack; l != NULL; l = l->next) {
-        cairo_surface_destroy((cairo_surface_t *)l->data);
-    }
-    g_list_free(*stack);
-    *stack = NULL;
+static void on_redo(GtkWidget *w, gpointer data) {
+    cairo_rectangle_int_t changed;
+    if (!display_list || is_drawing) return;
+    gint64 start = trace_now();
+    if (!display_list_redo(display_list, canvas, &changed)) return;
+    trace_complete("redo", start);
+    record_redo();
+    journal_redo(active->journal, display_list);
+
+    mark_modified();
+    mipmap_invalidate(active->mipmap, changed.x, changed.y,
+                      changed.x + changed.width, changed.y + changed.height);
+    session_update(active->session, canvas, &changed);
+    queue_canvas_rect(&changed);
+    update_annotation_status();
 }
 
-static void apply_redact(cairo_surface_t *surf, double sx, double sy, double ex, double ey) {
-    cairo_surface_flush(surf);
-    
-    int x1 = (int)fmin(sx, ex);
-    int y1 = (int)fmin(sy, ey);
-    int x2 = (int)fmax(sx, ex);
-    int y2 = (int)fmax(sy, ey);
-
-    int w = cairo_image_surface_get_width(surf);
-    int h = cairo_image_surface_get_height(surf);
-    int stride = cairo_image_surface_get_stride(surf);
-    unsigned char *data = cairo_image_surface_get_data(surf);
-
-    if (x1 < 0) x1 = 0; if (y1 < 0) y1 = 0;
-    if (x2 > w) x2 = w; if (y2 > h) y2 = h;
-
-    for (int y = y1; y < y2; y++) {
-        for (int x = x1; x < x2; x++) {
-            int offset_x = (rand() % 50) - 5;
-            int offset_y = (rand() % 50) - 5;
-            
-            int src_x = CLAMP_VAL(x + offset_x, 0, w - 1);
-            int src_y = CLAMP_VAL(y + offset_y, 0, h - 1);
-
-            uint32_t *src_p = (uint32_t*)(data + src_y * stride + src_x * 4);
-            uint32_t pixel = *src_p;
-
-            int r = (pixel >> 16) & 0xFF;
-            int g = (pixel >> 8) & 0xFF;
-            int b = (pixel) & 0xFF;
-
-            r += (rand() % 40) - 20; r = CLAMP_VAL(r, 0, 255);
-            g += (rand() % 40) - 20; g = CLAMP_VAL(g, 0, 255);
-            b += (rand() % 40) - 20; b = CLAMP_VAL(b, 0, 255);
-
-            uint32_t *dst_p = (uint32_t*)(data + y * stride + x * 4);
-            *dst_p = (0xFF000000) | (r << 16) | (g << 8) | b; 
+/* Clipboard. Copying publishes a snapshot of the canvas, which costs no
+ * pixel copies, and only encodes it once another application asks for a
+ * format: PNG through imageio's encoder, anything else GdkPixbuf can write
+ * through a pixbuf. Pasting our own copy takes the snapshot as it is. */
+
+/* Snapshot on the clipboard, or NULL while another application owns it. */
+static Canvas *clipboard_canvas = NULL;
+
+/* Image pasted from another application, decoded on a worker thread. */
+typedef struct {
+    GBytes *data;
+    Canvas *canvas;
+    GError *error;
+} PasteJob;
+
+static void on_clipboard_get(GtkClipboard *clipboard, GtkSelectionData *selection,
+                             guint info, gpointer data) {
+    GdkAtom target = gtk_selection_data_get_target(selection);
+    gint64 start = trace_now();
+
+    if (target == gdk_atom_intern_static_string("image/png")) {
+        GBytes *png = imageio_encode_png(clipboard_canvas, NULL);
+        if (png) {
+            gtk_selection_data_set(selection, target, 8, g_bytes_get_data(png, NULL),
+                                   g_bytes_get_size(png));
+            g_bytes_unref(png);
+        }
+    } else {
+        GdkPixbuf *pixbuf = imageio_to_pixbuf(clipboard_canvas);
+        if (pixbuf) {
+            gtk_selection_data_set_pixbuf(selection, pixbuf);
+            g_object_unref(pixbuf);
         }
     }
-    cairo_surface_mark_dirty(surf);
+    trace_complete_on("clipboard-encode", start, TRACE_TRACK_IO);
 }
 
-void draw_shape(cairo_t *cr, ToolType tool, double x1, double y1, double x2, double y2) {
-    if (tool == TOOL_REDACT) {
-        double rx = fmin(x1, x2);
-        double ry = fmin(y1, y2);
-        double rw = fabs(x2 - x1);
-        double rh = fabs(y2 - y1);
+static void on_clipboard_clear(GtkClipboard *clipboard, gpointer data) {
+    g_clear_pointer(&clipboard_canvas, canvas_free);
+}
 
-        if (rw > 1 && rh > 1) {
-            cairo_surface_t *preview = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, (int)rw, (int)rh);
-            cairo_t *pcr = cairo_create(preview);
+static void on_copy(GtkWidget *w, gpointer data) {
+    if (!canvas || load_job) {
+        gtk_widget_error_bell(window);
+        return;
+    }
 
-            cairo_set_source_surface(pcr, surface, -rx, -ry);
-            cairo_paint(pcr);
-            cairo_destroy(pcr);
+    GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+    GtkTargetList *list = gtk_target_list_new(NULL, 0);
+    gtk_target_list_add_image_targets(list, 0, TRUE);
+    int n_targets;
+    GtkTargetEntry *targets = gtk_target_table_new_from_list(list, &n_targets);
+    gtk_target_list_unref(list);
+
+    /* Taking over the clipboard clears our previous copy first. */
+    Canvas *snapshot = canvas_snapshot(canvas);
+    if (gtk_clipboard_set_with_data(clipboard, targets, n_targets,
+                                    on_clipboard_get, on_clipboard_clear, NULL)) {
+        clipboard_canvas = snapshot;
+        /* A clipboard manager keeps a PNG once crayons exits. */
+        static const GtkTargetEntry store = { "image/png", 0, 0 };
+        gtk_clipboard_set_can_store(clipboard, &store, 1);
+    } else {
+        canvas_free(snapshot);
+    }
+    gtk_target_table_free(targets, n_targets);
+}
 
-            apply_redact(preview, 0, 0, rw, rh);
+/* Opens pasted as a new document, unsaved. */
+static void add_pasted_document(Canvas *pasted) {
+    Document *doc = document_new_canvas("Pasted", pasted, NULL);
+    doc->is_modified = TRUE;
+    add_document(doc, TRUE);
+    record_paste(pasted);
+}
 
-            cairo_set_source_surface(cr, preview, rx, ry);
-            cairo_rectangle(cr, rx, ry, rw, rh);
-            cairo_fill(cr);
+static gboolean on_paste_decoded(gpointer data) {
+    PasteJob *job = data;
+    if (job->canvas) {
+        add_pasted_document(job->canvas);
+    } else {
+        show_error(GTK_WINDOW(window), "Could not paste the image");
+        g_printerr("Could not paste the image: %s\n", job->error->message);
+        g_error_free(job->error);
+    }
+    g_bytes_unref(job->data);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
 
-            cairo_surface_destroy(preview);
+static gpointer paste_thread(gpointer data) {
+    PasteJob *job = data;
+    job->canvas = imageio_load_bytes(job->data, &job->error);
+    g_idle_add(on_paste_decoded, job);
+    return NULL;
+}
 
-            cairo_set_source_rgba(cr, 1, 0, 0, 0.5);
-            cairo_set_line_width(cr, 2.0);
+static void on_paste_contents(GtkClipboard *clipboard, GtkSelectionData *selection,
+                              gpointer data) {
+    int length;
+    const guchar *contents = gtk_selection_data_get_data_with_length(selection, &length);
+    if (!contents || length <= 0) {
+        gtk_widget_error_bell(window);
+        return;
+    }
 
-            const double dashes[] = {4.0, 1.0};
-            int num_dashes = 2;
-            double offset = 0;
+    PasteJob *job = g_new0(PasteJob, 1);
+    job->data = g_bytes_new(contents, length);
+    g_thread_unref(g_thread_new("paste", paste_thread, job));
+}
 
-            // cairo_set_dash(cr, dashes, num_dashes, offset);
-            // cairo_rectangle(cr, rx, ry, rw, rh);
-            // cairo_stroke(cr);
+/* Asks for PNG, which streams through libpng, or else the first image
+ * format GdkPixbuf can read. */
+static void on_paste_targets(GtkClipboard *clipboard, GdkAtom *targets, int n_targets,
+                             gpointer data) {
+    GdkAtom png = gdk_atom_intern_static_string("image/png");
+    GdkAtom chosen = GDK_NONE;
+    for (int i = 0; i < n_targets && chosen != png; i++) {
+        if (targets[i] == png || (chosen == GDK_NONE &&
+                                  gtk_targets_include_image(&targets[i], 1, FALSE))) {
+            chosen = targets[i];
         }
+    }
+
+    if (chosen == GDK_NONE) {
+        gtk_widget_error_bell(window);
+        return;
+    }
+    gtk_clipboard_request_contents(clipboard, chosen, on_paste_contents, NULL);
+}
+
+static void on_paste(GtkWidget *w, gpointer data) {
+    if (clipboard_canvas) {
+        add_pasted_document(canvas_snapshot(clipboard_canvas));
         return;
     }
+    gtk_clipboard_request_targets(gtk_clipboard_get(GDK_SELECTION_CLIPBOARD),
+                                  on_paste_targets, NULL);
+}
 
-    cairo_set_source_rgba(cr, current_color.red, current_color.green, current_color.blue, current_color.alpha);
-    cairo_set_line_width(cr, current_size);
+static void on_zoom_in(GtkWidget *w, gpointer data) {
+    zoom_around_center(1.2);
+}
 
-    if (tool == TOOL_RECT) {
-        cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
-        cairo_stroke(cr);
-    } 
-    else if (tool == TOOL_ELLIPSE) {
-        cairo_save(cr);
-        cairo_translate(cr, x1 + (x2 - x1) / 2.0, y1 + (y2 - y1) / 2.0);
-        cairo_scale(cr, (x2 - x1) / 2.0, (y2 - y1) / 2.0);
-        cairo_arc(cr, 0, 0, 1.0, 0, 2 * M_PI);
-        cairo_restore(cr);
-        cairo_stroke(cr);
+static void on_zoom_out(GtkWidget *w, gpointer data) {
+    zoom_around_center(1 / 1.2);
+}
+
+/* Like draw_shape(), but redact shows its cached preview. */
+static void draw_preview(cairo_t *cr, ToolType tool, double x1, double y1, double x2, double y2) {
+    if (tool == TOOL_REDACT) {
+        cairo_rectangle_int_t r;
+
+        if (redact_rect(canvas, x1, y1, x2, y2, &r) && r.width > 1 && r.height > 1) {
+            gint64 deadline = g_get_monotonic_time() + REDACT_PREVIEW_BUDGET_US;
+
+            /* Only the part inside the damaged area needs rendering;
+             * blur and pixelate still read the rest of the rectangle. */
+            double cx1, cy1, cx2, cy2;
+            cairo_clip_extents(cr, &cx1, &cy1, &cx2, &cy2);
+
+            cairo_rectangle_int_t visible;
+            visible.x = MAX(r.x, (int)floor(cx1));
+            visible.y = MAX(r.y, (int)floor(cy1));
+            visible.width = MIN(r.x + r.width, (int)ceil(cx2)) - visible.x;
+            visible.height = MIN(r.y + r.height, (int)ceil(cy2)) - visible.y;
+
+            if (visible.width > 0 && visible.height > 0 &&
+                !redact_preview_draw(cr, canvas, &r, &visible, deadline)) {
+                queue_canvas_rect(&visible);
+            }
+        }
+        return;
     }
-    else if (tool == TOOL_ARROW) {
-        double angle = atan2(y2 - y1, x2 - x1);
-        double arrow_len = 15.0 + current_size; 
-        double arrow_angle = M_PI / 6.0;
 
-        cairo_move_to(cr, x1, y1);
-        cairo_line_to(cr, x2, y2);
-        cairo_stroke(cr);
+    ShapeStyle style = current_style();
+    draw_shape(cr, tool, &style, x1, y1, x2, y2);
+}
+
+/* Strokes the pending points into the mask, opaque whatever the colour. */
+static void draw_pending_stroke(cairo_t *cr, gpointer data) {
+    ShapeStyle style = current_style();
+    style.alpha = 1;
+    draw_stroke(cr, &style, (const double *)stroke_pending->data, stroke_pending->len / 2);
+}
+
+/* Pressure of a pointer event, or 1 for devices without a pressure axis. */
+static double event_pressure(GdkEvent *event) {
+    double pressure;
+    return gdk_event_get_axis(event, GDK_AXIS_PRESSURE, &pressure) ? pressure : 1;
+}
+
+static void add_stroke_point(double x, double y, double pressure) {
+    stroke_add_point(stroke, x, y, pressure);
+    /* Drawn on the next frame clock tick. */
+    g_array_append_val(stroke_pending, x);
+    g_array_append_val(stroke_pending, y);
+}
+
+/* Draws the samples gathered since the last frame as a single path. */
+static void flush_stroke(void) {
+    int n = stroke_pending->len / 2;
+    if (n < 2) return;
+
+    double bx1, by1, bx2, by2;
+    ShapeStyle style = current_style();
+    stroke_bounds(&style, (const double *)stroke_pending->data, n, &bx1, &by1, &bx2, &by2);
+    canvas_draw(stroke_mask, bx1, by1, bx2, by2, draw_pending_stroke, NULL);
+    queue_canvas_area(bx1, by1, bx2, by2);
+
+    stroke_x1 = fmin(stroke_x1, bx1);
+    stroke_y1 = fmin(stroke_y1, by1);
+    stroke_x2 = fmax(stroke_x2, bx2);
+    stroke_y2 = fmax(stroke_y2, by2);
+    g_array_remove_range(stroke_pending, 0, stroke_pending->len - 2);
+}
+
+static gboolean on_stroke_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data) {
+    flush_stroke();
+    return G_SOURCE_CONTINUE;
+}
+
+static void begin_stroke(double x, double y, double pressure) {
+    if (!stroke_pending) stroke_pending = g_array_new(FALSE, FALSE, sizeof(double));
+    g_array_set_size(stroke_pending, 0);
+    stroke = stroke_new();
+    add_stroke_point(x, y, pressure);
+
+    stroke_mask = canvas_new(canvas_width, canvas_height, 0);
+    stroke_x1 = stroke_y1 = INFINITY;
+    stroke_x2 = stroke_y2 = -INFINITY;
+    stroke_tick = gtk_widget_add_tick_callback(drawing_area, on_stroke_tick, NULL, NULL);
+}
+
+/* Ends the stroke, adding it as an annotation if commit. */
+static void end_stroke(gboolean commit) {
+    gtk_widget_remove_tick_callback(drawing_area, stroke_tick);
+    stroke_tick = 0;
 
-        cairo_move_to(cr, x2, y2);
-        cairo_line_to(cr, x2 - arrow_len * cos(angle - arrow_angle),
-                          y2 - arrow_len * sin(angle - arrow_angle));
-        cairo_move_to(cr, x2, y2);
-        cairo_line_to(cr, x2 - arrow_len * cos(angle + arrow_angle),
-                          y2 - arrow_len * sin(angle + arrow_angle));
-        cairo_stroke(cr);
+    if (commit) {
+        ShapeStyle style = current_style();
+        add_annotation(annotation_new_stroke(&style, stroke));
+    } else {
+        stroke_free(stroke);
     }
+    if (stroke_x1 < stroke_x2) queue_canvas_area(stroke_x1, stroke_y1, stroke_x2, stroke_y2);
+
+    stroke = NULL;
+    canvas_free(stroke_mask);
+    stroke_mask = NULL;
 }
 
 static gboolean configure_event_cb(GtkWidget *widget, GdkEventConfigure *event, gpointer data) {
-    if (!surface) {
-        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
-        clear_surface();
-    }
+    update_drawing_area_size();
     return TRUE;
 }
 
-static void clear_surface(void) {
-    if (!surface) return;
-    cairo_t *cr = cairo_create(surface);
-    cairo_set_source_rgb(cr, 1, 1, 1);
-    cairo_paint(cr);
-    cairo_destroy(cr);
+/* Device-pixel copy of the visible canvas, rendered in parallel bands and
+ * blitted by draw_viewport(). */
+static cairo_surface_t *back_buffer = NULL;
+
+/* Returns the back buffer, reallocated if the drawing area changed size. */
+static cairo_surface_t *get_back_buffer(int width, int height) {
+    if (back_buffer && cairo_image_surface_get_width(back_buffer) == width &&
+        cairo_image_surface_get_height(back_buffer) == height) {
+        return back_buffer;
+    }
+    if (back_buffer) cairo_surface_destroy(back_buffer);
+    back_buffer = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    return back_buffer;
 }
 
-static gboolean on_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
-    if (!surface) return FALSE;
-    
+/* Paints the canvas and any preview under cr's clip, in widget coordinates. */
+static void draw_viewport(cairo_t *cr) {
+    if (!canvas) return;
+
+    GdkRectangle clip;
+    if (!gdk_cairo_get_clip_rectangle(cr, &clip)) return;
+
+    double vx = view_x();
+    double vy = view_y();
+
+    /* Canvas pixels under the damaged part of the viewport. */
+    double cx1 = fmax(floor((clip.x + vx) / zoom_level), 0);
+    double cy1 = fmax(floor((clip.y + vy) / zoom_level), 0);
+    double cx2 = fmin(ceil((clip.x + clip.width + vx) / zoom_level), canvas_width);
+    double cy2 = fmin(ceil((clip.y + clip.height + vy) / zoom_level), canvas_height);
+    if (cx1 >= cx2 || cy1 >= cy2) return;
+
+    /* Render the damaged device pixels into the back buffer off the main
+     * thread's cairo context, then blit them unscaled. */
+    int sf = gtk_widget_get_scale_factor(drawing_area);
+    cairo_surface_t *buffer = get_back_buffer(gtk_widget_get_allocated_width(drawing_area) * sf,
+                                              gtk_widget_get_allocated_height(drawing_area) * sf);
+    int dx1 = MAX((int)floor((cx1 * zoom_level - vx) * sf), MAX(clip.x * sf, 0));
+    int dy1 = MAX((int)floor((cy1 * zoom_level - vy) * sf), MAX(clip.y * sf, 0));
+    int dx2 = MIN((int)ceil((cx2 * zoom_level - vx) * sf),
+                  MIN((clip.x + clip.width) * sf, cairo_image_surface_get_width(buffer)));
+    int dy2 = MIN((int)ceil((cy2 * zoom_level - vy) * sf),
+                  MIN((clip.y + clip.height) * sf, cairo_image_surface_get_height(buffer)));
+    if (dx1 < dx2 && dy1 < dy2) {
+        cairo_rectangle_int_t r = { dx1, dy1, dx2 - dx1, dy2 - dy1 };
+
+        /* Zoomed out, paint from the mip level closest above the zoom so
+         * cairo never filters more than two source pixels per screen pixel.
+         * Zoomed in, every screen pixel maps to exactly one canvas pixel. */
+        int level = mipmap_level_for_scale(zoom_level);
+        cairo_filter_t filter = level == 0 && zoom_level >= PIXEL_GRID_ZOOM ?
+                                CAIRO_FILTER_NEAREST : CAIRO_FILTER_GOOD;
+        viewport_render(buffer, &r, mipmap_get_level(active->mipmap, canvas, level),
+                        sf * zoom_level * (1 << level), sf * vx, sf * vy, filter);
+
+        cairo_save(cr);
+        cairo_scale(cr, 1.0 / sf, 1.0 / sf);
+        cairo_set_source_surface(cr, buffer, 0, 0);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+        cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+        cairo_fill(cr);
+        cairo_restore(cr);
+    }
+
     cairo_save(cr);
+    cairo_translate(cr, -vx, -vy);
     cairo_scale(cr, zoom_level, zoom_level);
-    cairo_set_source_surface(cr, surface, 0, 0);
-    cairo_paint(cr);
+    cairo_rectangle(cr, cx1, cy1, cx2 - cx1, cy2 - cy1);
+    cairo_clip(cr);
+
+    if (is_drawing && current_tool == TOOL_PEN) {
+        cairo_set_source_rgba(cr, current_color.red, current_color.green, current_color.blue,
+                              current_color.alpha);
+        canvas_mask(stroke_mask, cr, cx1, cy1, cx2, cy2);
+    } else if (is_drawing) {
+        double bx1, by1, bx2, by2;
+        ShapeStyle style = current_style();
+        shape_bounds(current_tool, &style, start_x, start_y, end_x, end_y, &bx1, &by1, &bx2, &by2);
+        if (bx1 < cx2 && bx2 > cx1 && by1 < cy2 && by2 > cy1) {
+            draw_preview(cr, current_tool, start_x, start_y, end_x, end_y);
+        }
+    }
+    cairo_restore(cr);
+}
+
+/* Instrumentation overlay in the drawing area's top left corner. */
+#define HUD_X 8
+#define HUD_Y 8
+#define HUD_WIDTH 280
+#define HUD_HEIGHT 62
+
+static void draw_hud(cairo_t *cr) {
+    TraceStats stats;
+    trace_get_stats(&stats);
+
+    char lines[3][96];
+    gchar *size = g_format_size(display_list ? display_list_get_size(display_list) : 0);
+    g_snprintf(lines[0], sizeof(lines[0]), "frame %.2f ms", stats.frame_ms);
+    g_snprintf(lines[1], sizeof(lines[1]), "latency p50 %.1f ms, p99 %.1f ms (%d)",
+               stats.latency_p50_ms, stats.latency_p99_ms, stats.latency_samples);
+    g_snprintf(lines[2], sizeof(lines[2]), "history %d annotations, %s",
+               display_list ? display_list_get_length(display_list) : 0, size);
+    g_free(size);
+
+    cairo_save(cr);
+    cairo_rectangle(cr, HUD_X, HUD_Y, HUD_WIDTH, HUD_HEIGHT);
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.7);
+    cairo_fill(cr);
 
-    if (is_drawing && current_tool != TOOL_PEN) {
-        draw_shape(cr, current_tool, start_x, start_y, end_x, end_y);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 12);
+    for (int i = 0; i < 3; i++) {
+        cairo_move_to(cr, HUD_X + 6, HUD_Y + 16 + i * 18);
+        cairo_show_text(cr, lines[i]);
     }
     cairo_restore(cr);
+}
+
+static gboolean on_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    gint64 start = trace_now();
+    draw_viewport(cr);
+
+    if (trace_is_enabled()) {
+        draw_hud(cr);
+        /* Show the new latency next frame; frames without input stop there. */
+        if (trace_frame(start)) gtk_widget_queue_draw_area(widget, HUD_X, HUD_Y, HUD_WIDTH, HUD_HEIGHT);
+    }
     return FALSE;
 }
 
 static gboolean on_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data) {
-    if (event->button == GDK_BUTTON_PRIMARY && surface) {
-        push_undo();
-
+    if (event->button == GDK_BUTTON_PRIMARY && canvas) {
+        /* Rows still to come would paint over the edit. */
+        if (load_job) {
+            gtk_widget_error_bell(widget);
+            return TRUE;
+        }
+        trace_input("button-press");
         is_drawing = TRUE;
-        double wx = event->x / zoom_level;
-        double wy = event->y / zoom_level;
+        has_shape_damage = FALSE;
+        redact_seed = g_random_int();
+        if (current_tool == TOOL_REDACT) redact_preview_begin(current_redact_mode, redact_seed);
+        double wx, wy;
+        widget_to_canvas(event->x, event->y, &wx, &wy);
 
         start_x = wx;
         start_y = wy;
-        last_x = wx;
-        last_y = wy;
         end_x = wx;
         end_y = wy;
+        double pressure = event_pressure((GdkEvent *)event);
+        record_press(wx, wy, pressure, redact_seed);
+        if (current_tool == TOOL_PEN) begin_stroke(wx, wy, pressure);
     }
     return TRUE;
 }
 
 static gboolean on_motion_notify(GtkWidget *widget, GdkEventMotion *event, gpointer data) {
-    if (!is_drawing || !surface) return TRUE;
+    if (!is_drawing || !canvas) return TRUE;
+    /* Only motion that draws counts towards latency; hovering damages
+     * nothing and would wait for an unrelated frame. */
+    trace_input("motion-notify");
 
-    double wx = event->x / zoom_level;
-    double wy = event->y / zoom_level;
+    double wx, wy;
+    widget_to_canvas(event->x, event->y, &wx, &wy);
+    double pressure = event_pressure((GdkEvent *)event);
+    record_motion(wx, wy, pressure);
 
     if (current_tool == TOOL_PEN) {
-        cairo_t *cr = cairo_create(surface);
-        cairo_set_source_rgba(cr, current_color.red, current_color.green, current_color.blue, current_color.alpha);
-        cairo_set_line_width(cr, current_size);
-        cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
-        
-        cairo_move_to(cr, last_x, last_y);
-        cairo_line_to(cr, wx, wy);
-        cairo_stroke(cr);
-        cairo_destroy(cr);
-
-        last_x = wx;
-        last_y = wy;
-        gtk_widget_queue_draw(widget);
+        add_stroke_point(wx, wy, pressure);
     } 
     else {
         end_x = wx;
         end_y = wy;
-        gtk_widget_queue_draw(widget);
+        update_shape_damage();
     }
     return TRUE;
 }
 
 static gboolean on_button_release(GtkWidget *widget, GdkEventButton *event, gpointer data) {
     if (event->button == GDK_BUTTON_PRIMARY && is_drawing) {
+        trace_input("button-release");
         is_drawing = FALSE;
-        is_modified = TRUE;
-        end_x = event->x / zoom_level;
-        end_y = event->y / zoom_level;
-
-        if (current_tool == TOOL_REDACT) {
-            int redact_iterations = 10;
-            for (int i=0;i<redact_iterations;i++)
-                apply_redact(surface, start_x, start_y, end_x, end_y);
-            gtk_widget_queue_draw(widget);
+        mark_modified();
+        widget_to_canvas(event->x, event->y, &end_x, &end_y);
+        record_release(end_x, end_y);
+
+        ShapeStyle style = current_style();
+        if (current_tool == TOOL_PEN) {
+            end_stroke(TRUE);
         }
-        else if (current_tool != TOOL_PEN) {
-            cairo_t *cr = cairo_create(surface);
-            draw_shape(cr, current_tool, start_x, start_y, end_x, end_y);
-            cairo_destroy(cr);
-            gtk_widget_queue_draw(widget);
+        else if (current_tool == TOOL_REDACT) {
+            add_annotation(annotation_new_redact(start_x, start_y, end_x, end_y,
+                                                 current_redact_mode, redact_seed));
+            update_shape_damage();
         }
+        else {
+            add_annotation(annotation_new_shape(current_tool, &style, start_x, start_y, end_x, end_y));
+            update_shape_damage();
+        }
+        has_shape_damage = FALSE;
     }
     return TRUE;
 }
 
 static gboolean on_scroll_event(GtkWidget *widget, GdkEventScroll *event, gpointer data) {
+    double dx = 0, dy = 0;
+
+    switch (event->direction) {
+    case GDK_SCROLL_UP: dy = -1; break;
+    case GDK_SCROLL_DOWN: dy = 1; break;
+    case GDK_SCROLL_LEFT: dx = -1; break;
+    case GDK_SCROLL_RIGHT: dx = 1; break;
+    case GDK_SCROLL_SMOOTH: gdk_event_get_scroll_deltas((GdkEvent *)event, &dx, &dy); break;
+    }
+
     if (event->state & GDK_CONTROL_MASK) {
-        if (event->direction == GDK_SCROLL_UP) {
-            zoom_level *= 1.1;
-        } else if (event->direction == GDK_SCROLL_DOWN) {
-            zoom_level /= 1.1;
-        }
-        update_drawing_area_size();
+        if (dy != 0) set_zoom(zoom_level * pow(1.1, -dy), event->x, event->y);
         return TRUE;
     }
-    return FALSE;
+
+    if (event->state & GDK_SHIFT_MASK) {
+        double t = dx;
+        dx = dy;
+        dy = t;
+    }
+    gtk_adjustment_set_value(hadjustment, gtk_adjustment_get_value(hadjustment) +
+                             dx * gtk_adjustment_get_step_increment(hadjustment));
+    gtk_adjustment_set_value(vadjustment, gtk_adjustment_get_value(vadjustment) +
+                             dy * gtk_adjustment_get_step_increment(vadjustment));
+    return TRUE;
+}
+
+/* Nothing reaches the canvas before release; drops the preview. */
+static void cancel_drawing(void) {
+    record_cancel();
+    is_drawing = FALSE;
+    if (current_tool == TOOL_PEN) end_stroke(FALSE);
+    if (has_shape_damage) {
+        queue_canvas_area(damage_x1, damage_y1, damage_x2, damage_y2);
+        has_shape_damage = FALSE;
+    }
 }
 
 static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data) {
     if (event->keyval == GDK_KEY_Escape && is_drawing) {
-        if (undo_stack) {
-            cairo_surface_t *saved = (cairo_surface_t *)undo_stack->data;
-            if (surface) cairo_surface_destroy(surface);
-            surface = copy_surface(saved);
-            
-            cairo_surface_destroy(saved);
-            undo_stack = g_list_delete_link(undo_stack, undo_stack);
-        }
-        
-        is_drawing = FALSE;
-        gtk_widget_queue_draw(drawing_area);
+        cancel_drawing();
         return TRUE;
     }
     return FALSE;
 }
 
 static void on_new_file(GtkWidget *w, gpointer data) {
-    free_stack(&undo_stack);
-    free_stack(&redo_stack);
-    
-    canvas_width = 800;
-    canvas_height = 600;
-    
-    if (surface) cairo_surface_destroy(surface);
-    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
-    clear_surface();
-    
-    is_modified = FALSE;
-    zoom_level = 1.0;
-    update_drawing_area_size();
+    add_document(document_new_blank(800, 600), TRUE);
+    record_new(800, 600);
 }
 
 
@@ -420,8 +900,83 @@ static gchar *make_timestamped_name ()
                             tm.tm_min);
 }
 
+static void on_save_progress(double fraction, gpointer data) {
+    SaveJob *job = data;
+    g_atomic_int_set(&job->progress, (gint)(fraction * 1000));
+}
+
+static gboolean update_save_progress(gpointer data) {
+    SaveJob *job = data;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(save_progress),
+                                  g_atomic_int_get(&job->progress) / 1000.0);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_save_done(gpointer data) {
+    SaveJob *job = data;
+
+    g_source_remove(save_progress_source);
+    save_progress_source = 0;
+    gtk_widget_hide(save_progress);
+    save_job = NULL;
+
+    /* Edits made while the file was written are still unsaved. */
+    if (job->ok && job->doc == active && job->generation == edit_generation) {
+        is_modified = FALSE;
+    } else if (job->ok && job->doc != active && job->generation == job->doc->edit_generation) {
+        job->doc->is_modified = FALSE;
+    }
+    if (!job->ok) {
+        show_error(GTK_WINDOW(window), job->error->message);
+        g_error_free(job->error);
+        close_after_save = FALSE;
+    }
+    g_free(job->filename);
+    g_free(job);
+
+    /* Goes through on_delete_event() again, which asks about any edits
+     * made during the save. */
+    if (close_after_save) {
+        close_after_save = FALSE;
+        gtk_window_close(GTK_WINDOW(window));
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer save_thread(gpointer data) {
+    SaveJob *job = data;
+    gint64 start = trace_now();
+    job->ok = imageio_save(job->snapshot, job->filename, &job->options, on_save_progress, job,
+                           &job->error);
+    trace_complete("save", start);
+    canvas_free(job->snapshot);
+
+    /* The image is saved either way; only editing its annotations again
+     * depends on the sidecar. */
+    if (job->ok && job->annotations) {
+        char *sidecar = display_list_sidecar_name(job->filename);
+        GError *error = NULL;
+        if (!g_file_set_contents(sidecar, g_bytes_get_data(job->annotations, NULL),
+                                 g_bytes_get_size(job->annotations), &error)) {
+            g_printerr("Could not write %s: %s\n", sidecar, error->message);
+            g_error_free(error);
+        }
+        g_free(sidecar);
+    }
+    if (job->annotations) g_bytes_unref(job->annotations);
+    g_idle_add(on_save_done, job);
+    return NULL;
+}
+
+/* Encodes a snapshot on a worker thread, so drawing can go on meanwhile.
+ * Returns FALSE if no save was started. */
 static gboolean perform_save ()
 {
+    if (save_job || load_job || !display_list) {
+        gtk_widget_error_bell (window);
+        return FALSE;
+    }
+
     GtkWidget *dialog = gtk_file_chooser_dialog_new ("Save Drawing",
                                           GTK_WINDOW (window),
                                           GTK_FILE_CHOOSER_ACTION_SAVE,
@@ -435,49 +990,121 @@ static gboolean perform_save ()
     gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (dialog), default_name);
     g_free (default_name);
 
-    gboolean saved = FALSE;
+    /* The format follows the extension typed in; these tune the encoder. */
+    GtkWidget *options = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 6);
+    gtk_widget_set_tooltip_text (options, "Name the file .png, .jpg or .webp to pick its format");
+    GtkWidget *preset_combo = gtk_combo_box_text_new ();
+    gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (preset_combo), "Fast");
+    gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (preset_combo), "Balanced");
+    gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (preset_combo), "Smallest");
+    gtk_combo_box_set_active (GTK_COMBO_BOX (preset_combo), save_preset);
+    GtkWidget *quality_spin = gtk_spin_button_new_with_range (1, 100, 1);
+    gtk_spin_button_set_value (GTK_SPIN_BUTTON (quality_spin), save_quality);
+    gtk_widget_set_tooltip_text (quality_spin, "JPEG and lossy WebP quality");
+    GtkWidget *lossless_check = gtk_check_button_new_with_label ("Lossless WebP");
+    gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (lossless_check), save_lossless);
+    gtk_box_pack_start (GTK_BOX (options), gtk_label_new ("Preset:"), FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (options), preset_combo, FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (options), gtk_label_new ("Quality:"), FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (options), quality_spin, FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (options), lossless_check, FALSE, FALSE, 0);
+    gtk_widget_show_all (options);
+    gtk_file_chooser_set_extra_widget (GTK_FILE_CHOOSER (dialog), options);
+
+    gboolean started = FALSE;
     if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) {
-        char *filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
-        cairo_surface_write_to_png (surface, filename);
-        g_free (filename);
-        is_modified = FALSE;
-        saved = TRUE;
+        save_preset = gtk_combo_box_get_active (GTK_COMBO_BOX (preset_combo));
+        save_quality = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (quality_spin));
+        save_lossless = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (lossless_check));
+
+        save_job = g_new0 (SaveJob, 1);
+        save_job->doc = active;
+        save_job->snapshot = canvas_snapshot (canvas);
+        save_job->filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+        save_job->generation = edit_generation;
+        export_options_init (&save_job->options, export_format_from_name (save_job->filename),
+                             save_preset);
+        save_job->options.quality = save_quality;
+        save_job->options.lossless = save_lossless;
+
+        /* Only PNGs get a sidecar, and only over a base that can be loaded
+         * again; JPEG and WebP exports are for sharing. */
+        if (save_job->options.format == EXPORT_PNG &&
+            display_list_get_length (display_list) > 0 &&
+            (active->base == DOCUMENT_BASE_FILE || active->base == DOCUMENT_BASE_BLANK)) {
+            DisplayListBase base = {
+                active->base == DOCUMENT_BASE_FILE ? active->filename : NULL,
+                canvas_width, canvas_height, active->file_mtime, active->file_size,
+            };
+            save_job->annotations = display_list_serialize (display_list, &base);
+        }
+
+        gchar *base = g_path_get_basename (save_job->filename);
+        gchar *text = g_strdup_printf ("Saving %s", base);
+        gtk_progress_bar_set_text (GTK_PROGRESS_BAR (save_progress), text);
+        gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (save_progress), 0);
+        gtk_widget_show (save_progress);
+        g_free (text);
+        g_free (base);
+
+        save_progress_source = g_timeout_add (100, update_save_progress, save_job);
+        g_thread_unref (g_thread_new ("save", save_thread, save_job));
+        started = TRUE;
     }
 
     gtk_widget_destroy (dialog);
-    return saved;
+    return started;
 }
 static void on_save_file(GtkWidget *w, gpointer data) {
     perform_save();
 }
 
 static gboolean on_delete_event(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    if (!is_modified) return FALSE; /* Allow close if not modified */
-
-    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window),
-                                               GTK_DIALOG_MODAL,
-                                               GTK_MESSAGE_QUESTION,
-                                               GTK_BUTTONS_NONE,
-                                               "You have unsaved changes. Do you want to save before closing?");
-    
-    gtk_dialog_add_button(GTK_DIALOG(dialog), "Close without Saving", GTK_RESPONSE_NO);
-    gtk_dialog_add_button(GTK_DIALOG(dialog), "_Cancel", GTK_RESPONSE_CANCEL);
-    gtk_dialog_add_button(GTK_DIALOG(dialog), "_Save", GTK_RESPONSE_YES);
-
-    int result = gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+    if (save_job) {
+        close_after_save = TRUE;
+        return TRUE; /* Close once the file is complete */
+    }
+    /* Asks about one modified image at a time, showing it first. Ones
+     * closed without saving are gone before the next is asked about. */
+    for (;;) {
+        store_document();
+        Document *modified = NULL;
+        for (guint i = 0; i < documents->len && !modified; i++) {
+            Document *doc = g_ptr_array_index(documents, i);
+            if (doc->is_modified) modified = doc;
+        }
+        if (!modified) return FALSE; /* Allow close if not modified */
+        if (modified != active) {
+            gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), document_page(modified));
+        }
 
-    if (result == GTK_RESPONSE_YES) {
-        if (perform_save()) {
-            return FALSE; /* Close */
-        } else {
-            return TRUE; /* Cancel close if save failed or got cancelled */
+        GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window),
+                                                   GTK_DIALOG_MODAL,
+                                                   GTK_MESSAGE_QUESTION,
+                                                   GTK_BUTTONS_NONE,
+                                                   "%s has unsaved changes. Do you want to save it before closing?",
+                                                   modified->title);
+
+        gtk_dialog_add_button(GTK_DIALOG(dialog), "Close without Saving", GTK_RESPONSE_NO);
+        gtk_dialog_add_button(GTK_DIALOG(dialog), "_Cancel", GTK_RESPONSE_CANCEL);
+        gtk_dialog_add_button(GTK_DIALOG(dialog), "_Save", GTK_RESPONSE_YES);
+
+        int result = gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+
+        if (result == GTK_RESPONSE_YES) {
+            /* Close once the save succeeds; stay open if it fails or got cancelled */
+            close_after_save = perform_save();
+            return TRUE;
+        } else if (result != GTK_RESPONSE_NO) {
+            return TRUE; /* Cancel close */
         }
-    } else if (result == GTK_RESPONSE_NO) {
-        return FALSE; /* Close */
+        remove_document(modified);
     }
-    
-    return TRUE; /* Cancel close */
+}
+
+static void on_close_menu(GtkWidget *w, gpointer data) {
+    if (active) close_document(active);
 }
 
 static void on_quit_menu(GtkWidget *w, gpointer data) {
@@ -494,9 +1121,7 @@ static void on_open_file(GtkWidget *w, gpointer data) {
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        free_stack(&undo_stack);
-        free_stack(&redo_stack);
-        load_image_to_surface(filename);
+        add_document(document_new_file(filename), TRUE);
         g_free(filename);
     }
     gtk_widget_destroy(dialog);
@@ -510,51 +1135,504 @@ static void on_about(GtkWidget *w, gpointer data) {
                           NULL);
 }
 
-static void load_image_to_surface(const char *filename) {
-    GError *error = NULL;
-    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
-    
-    if (!pixbuf) {
-        char err_str[256];
-        snprintf(err_str, sizeof(err_str), "Error loading file: %s\n", filename);
-        show_error(GTK_WINDOW(window), err_str);
-        g_printerr("%s", err_str);
-        g_error_free(error);
-        return;
+static void load_job_unref(LoadJob *job) {
+    if (!g_atomic_int_dec_and_test(&job->ref_count)) return;
+
+    LoadBand *band;
+    while ((band = g_queue_pop_head(&job->bands))) {
+        g_free(band->pixels);
+        g_free(band);
     }
+    if (job->error) g_error_free(job->error);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->drained);
+    g_object_unref(job->cancellable);
+    g_free(job->filename);
+    g_free(job);
+}
 
-    canvas_width = gdk_pixbuf_get_width(pixbuf);
-    canvas_height = gdk_pixbuf_get_height(pixbuf);
+/* Stops the running load, if any. Bands it still queues are dropped. */
+static void cancel_load(void) {
+    if (!load_job) return;
+
+    g_cancellable_cancel(load_job->cancellable);
+    g_mutex_lock(&load_job->lock);
+    g_cond_signal(&load_job->drained);
+    g_mutex_unlock(&load_job->lock);
+
+    gtk_widget_hide(load_progress);
+    load_job_unref(load_job);
+    load_job = NULL;
+}
+
+/* Starts mirroring doc's canvas c into a session file for crash
+ * recovery, replacing any earlier one. */
+static void track_session(Document *doc, const Canvas *c) {
+    if (!doc->recovery_dir) doc->recovery_dir = session_new_dir();
+    g_clear_pointer(&doc->session, session_free);
+    doc->session = session_new(doc->recovery_dir, c);
+}
+
+/* Starts journaling doc's annotations in list for crash recovery, if its
+ * base can be loaded again. */
+static void track_journal(Document *doc, const DisplayList *list) {
+    const Canvas *base = display_list_get_base(list);
+    int width = canvas_get_width(base);
+    int height = canvas_get_height(base);
+
+    g_clear_pointer(&doc->journal, journal_free);
+    if (doc->base == DOCUMENT_BASE_FILE) {
+        doc->journal = journal_new(doc->recovery_dir, doc->filename, width, height, list);
+    } else if (doc->base == DOCUMENT_BASE_BLANK) {
+        doc->journal = journal_new(doc->recovery_dir, NULL, width, height, list);
+    }
+}
+
+/* Swaps in an empty canvas of the loading image's size, so it can be
+ * scrolled and zoomed while the rows come in. */
+static void begin_loaded_canvas(int width, int height) {
+    display_list_free(display_list);
+    display_list = NULL;
+    update_annotation_status();
+    canvas_free(canvas);
+    canvas = canvas_new(width, height, 0);
+    canvas_width = width;
+    canvas_height = height;
+    redact_preview_reset();
+    mipmap_reset(active->mipmap);
+
+    /* Rows are mirrored as they arrive; only the finished image can be
+     * loaded again for a journal. */
+    g_clear_pointer(&active->journal, journal_free);
+    track_session(active, canvas);
 
-    if (surface) cairo_surface_destroy(surface);
-    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
-                                                    
-    cairo_t *cr = cairo_create(surface);
-    gdk_cairo_set_source_pixbuf(cr, pixbuf, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
-    
-    g_object_unref(pixbuf);
-    
     is_modified = FALSE;
+    edit_generation++;
     zoom_level = 1.0;
     update_drawing_area_size();
 }
 
+/* Whatever rows arrived become the base image. */
+static void finish_load(void) {
+    trace_complete_on("load", load_job->trace_start, TRACE_TRACK_IO);
+    if (load_job->sized) {
+        reset_display_list();
+        document_set_file(active, load_job->ok ? load_job->filename : NULL);
+        active->state = DOCUMENT_RESIDENT;
+        update_annotation_status();
+        track_journal(active, display_list);
+    }
+    if (!load_job->ok) {
+        char err_str[256];
+        snprintf(err_str, sizeof(err_str), "Error loading file: %s\n", load_job->filename);
+        show_error(GTK_WINDOW(window), err_str);
+        g_printerr("%s%s\n", err_str, load_job->error->message);
+    }
+    gtk_widget_hide(load_progress);
+    gboolean sized = load_job->sized;
+    load_job_unref(load_job);
+    load_job = NULL;
+
+    /* Nothing arrived, so there is nothing to show. */
+    if (!sized) close_document(active);
+}
+
+/* Index of doc's tab. */
+static int document_page(Document *doc) {
+    for (int i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)); i++) {
+        GtkWidget *page = gtk_notebook_get_nth_page(GTK_NOTEBOOK(notebook), i);
+        if (g_object_get_data(G_OBJECT(page), "document") == doc) return i;
+    }
+    return -1;
+}
+
+/* Writes the globals back into the active document. Only a resident one
+ * has its canvas and display list there. */
+static void store_document(void) {
+    if (!active) return;
+
+    if (active->state == DOCUMENT_RESIDENT) {
+        active->canvas = canvas;
+        active->display_list = display_list;
+    }
+    active->width = canvas_width;
+    active->height = canvas_height;
+    active->zoom = zoom_level;
+    active->view_x = gtk_adjustment_get_value(hadjustment);
+    active->view_y = gtk_adjustment_get_value(vadjustment);
+    active->is_modified = is_modified;
+    active->edit_generation = edit_generation;
+}
+
+/* Puts the active document into the globals. One that is not resident
+ * shows nothing until it is. */
+static void show_document(void) {
+    gboolean resident = active->state == DOCUMENT_RESIDENT;
+    canvas = resident ? active->canvas : NULL;
+    display_list = resident ? active->display_list : NULL;
+    canvas_width = active->width;
+    canvas_height = active->height;
+    zoom_level = active->zoom;
+    is_modified = active->is_modified;
+    edit_generation = active->edit_generation;
+    redact_preview_reset();
+
+    update_drawing_area_size();
+    gtk_adjustment_set_value(hadjustment, active->view_x);
+    gtk_adjustment_set_value(vadjustment, active->view_y);
+    update_annotation_status();
+}
+
+/* Evicts the least recently shown documents until the resident ones fit
+ * the budget again. */
+static void evict_documents(void) {
+    store_document();
+
+    gsize total = 0;
+    for (guint i = 0; i < documents->len; i++) {
+        total += document_get_size(g_ptr_array_index(documents, i));
+    }
+    while (total > document_get_budget()) {
+        Document *victim = NULL;
+        for (guint i = 0; i < documents->len; i++) {
+            Document *doc = g_ptr_array_index(documents, i);
+            if (doc == active || doc->state != DOCUMENT_RESIDENT || !doc->display_list) continue;
+            if (save_job && save_job->doc == doc) continue;
+            if (!victim || doc->last_used < victim->last_used) victim = doc;
+        }
+        if (!victim) break;
+
+        total -= document_get_size(victim);
+        document_evict(victim, NULL, NULL);
+    }
+}
+
+/* A document that failed to restore stays open and evicted, so nothing
+ * in it is lost; showing it again tries once more. */
+static void on_document_restored(Document *doc, gpointer data) {
+    if (doc->error) {
+        char *text = g_strdup_printf("Could not reopen %s: %s", doc->title, doc->error->message);
+        show_error(GTK_WINDOW(window), text);
+        g_free(text);
+        if (doc == active) update_annotation_status();
+        return;
+    }
+    /* One opened with the annotations saved next to it has no recovery
+     * files yet. */
+    if (!doc->recovery_dir) {
+        track_session(doc, doc->canvas);
+        track_journal(doc, doc->display_list);
+    }
+    if (doc == active) show_document();
+    evict_documents();
+}
+
+static void on_switch_page(GtkNotebook *nb, GtkWidget *page, guint num, gpointer data) {
+    Document *doc = g_object_get_data(G_OBJECT(page), "document");
+    if (doc == active) return;
+
+    if (active) {
+        if (is_drawing) cancel_drawing();
+        /* An image still loading is decoded again when it is shown next. */
+        if (load_job) {
+            cancel_load();
+            g_clear_pointer(&canvas, canvas_free);
+            g_clear_pointer(&display_list, display_list_free);
+            g_clear_pointer(&active->session, session_free);
+            mipmap_reset(active->mipmap);
+        }
+        store_document();
+        active->last_used = g_get_monotonic_time();
+    }
+
+    active = doc;
+    record_switch(doc->number);
+    if (doc->state == DOCUMENT_EVICTED && !doc->display_list) {
+        show_document();
+        load_image_to_canvas(doc->filename);
+    } else {
+        if (doc->state == DOCUMENT_EVICTED || doc->state == DOCUMENT_EVICTING) {
+            document_restore(doc, on_document_restored, NULL);
+        }
+        show_document();
+    }
+    evict_documents();
+}
+
+static void on_close_tab(GtkButton *button, gpointer data) {
+    close_document(data);
+}
+
+/* Adds a tab for doc, switching to it if show is set. */
+static void add_document(Document *doc, gboolean show) {
+    g_ptr_array_add(documents, doc);
+
+    GtkWidget *page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    g_object_set_data(G_OBJECT(page), "document", doc);
+    gtk_widget_show(page);
+
+    GtkWidget *tab = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 4);
+    GtkWidget *close = gtk_button_new_from_icon_name("window-close-symbolic", GTK_ICON_SIZE_MENU);
+    gtk_button_set_relief(GTK_BUTTON(close), GTK_RELIEF_NONE);
+    gtk_widget_set_focus_on_click(close, FALSE);
+    g_signal_connect(close, "clicked", G_CALLBACK(on_close_tab), doc);
+    gtk_box_pack_start(GTK_BOX(tab), gtk_label_new(doc->title), TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(tab), close, FALSE, FALSE, 0);
+    gtk_widget_show_all(tab);
+
+    /* Recovered documents come with their files. */
+    if (doc->state == DOCUMENT_RESIDENT && !doc->recovery_dir) {
+        track_session(doc, doc->canvas);
+        track_journal(doc, doc->display_list);
+    }
+
+    int n = gtk_notebook_append_page(GTK_NOTEBOOK(notebook), page, tab);
+    if (show) gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), n);
+}
+
+/* Removes doc's tab and frees it, whatever edits it has. */
+static void remove_document(Document *doc) {
+    /* Removing the tab switches to another one, which must not store the
+     * globals into doc. */
+    if (doc == active) {
+        if (is_drawing) cancel_drawing();
+        cancel_load();
+        if (active->state != DOCUMENT_RESIDENT) {
+            canvas_free(canvas);
+            display_list_free(display_list);
+        }
+        active = NULL;
+        canvas = NULL;
+        display_list = NULL;
+    }
+    gtk_notebook_remove_page(GTK_NOTEBOOK(notebook), document_page(doc));
+    g_ptr_array_remove(documents, doc);
+    document_free(doc);
+}
+
+static void close_document(Document *doc) {
+    if (save_job && save_job->doc == doc) {
+        gtk_widget_error_bell(window);
+        return;
+    }
+    if (doc == active) store_document();
+    if (doc->is_modified) {
+        GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window), GTK_DIALOG_MODAL,
+                                                   GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE,
+                                                   "%s has unsaved changes. Close it anyway?",
+                                                   doc->title);
+        gtk_dialog_add_button(GTK_DIALOG(dialog), "_Cancel", GTK_RESPONSE_CANCEL);
+        gtk_dialog_add_button(GTK_DIALOG(dialog), "Close without Saving", GTK_RESPONSE_NO);
+        int result = gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+        if (result != GTK_RESPONSE_NO) return;
+    }
+
+    remove_document(doc);
+    if (documents->len == 0) on_new_file(NULL, NULL);
+}
+
+/* Documents open when a session crashed, none of them saved. Each comes
+ * back from its journal, which also brings back undo history, or else from
+ * its session file, and goes on using both. */
+static GPtrArray *recover_documents(void) {
+    GPtrArray *recovered = g_ptr_array_new();
+    char **dirs = session_list_dirs();
+
+    for (int i = 0; dirs && dirs[i]; i++) {
+        Canvas *c = NULL;
+        DisplayList *list = NULL;
+        DisplayListBase base;
+        Journal *journal = journal_recover(dirs[i], &c, &list, &base);
+        Session *session = journal ? session_new(dirs[i], c) : session_recover(dirs[i], &c);
+        if (!c) {
+            session_remove_dir(dirs[i]);
+            continue;
+        }
+
+        /* Without a journal the recovered canvas is all there is. */
+        Document *doc = document_new_canvas("Recovered", c, list);
+        if (journal && base.filename) {
+            document_set_file(doc, base.filename);
+        } else if (journal) {
+            doc->base = DOCUMENT_BASE_BLANK;
+        }
+        if (journal) g_free(base.filename);
+        doc->is_modified = TRUE;
+        doc->recovery_dir = g_strdup(dirs[i]);
+        doc->session = session;
+        doc->journal = journal;
+        g_ptr_array_add(recovered, doc);
+    }
+    g_strfreev(dirs);
+    return recovered;
+}
+
+/* Writes the bands queued so far into the canvas. */
+static gboolean pump_load(gpointer data) {
+    LoadJob *job = data;
+
+    g_mutex_lock(&job->lock);
+    job->pump = 0;
+    GQueue bands = job->bands;
+    g_queue_init(&job->bands);
+    int width = job->width, height = job->height;
+    gboolean done = job->done;
+    g_cond_signal(&job->drained);
+    g_mutex_unlock(&job->lock);
+
+    gboolean current = job == load_job;
+    if (current && !job->sized && width > 0) {
+        begin_loaded_canvas(width, height);
+        job->sized = TRUE;
+    }
+
+    LoadBand *band;
+    while ((band = g_queue_pop_head(&bands))) {
+        if (current) {
+            cairo_rectangle_int_t *r = &band->r;
+            canvas_write(canvas, r, band->pixels, r->width * 4);
+            mipmap_invalidate(active->mipmap, r->x, r->y, r->x + r->width, r->y + r->height);
+            session_update(active->session, canvas, r);
+            queue_canvas_rect(r);
+            job->rows_loaded = MAX(job->rows_loaded, r->y + r->height);
+        }
+        g_free(band->pixels);
+        g_free(band);
+    }
+
+    if (current) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(load_progress),
+                                      height > 0 ? (double)job->rows_loaded / height : 0);
+        if (done) finish_load();
+    }
+    load_job_unref(job);
+    return G_SOURCE_REMOVE;
+}
+
+/* Must be called with job->lock held. */
+static void schedule_pump(LoadJob *job) {
+    if (job->pump) return;
+    g_atomic_int_inc(&job->ref_count);
+    job->pump = g_idle_add(pump_load, job);
+}
+
+static void on_load_size(int width, int height, gpointer data) {
+    LoadJob *job = data;
+    g_mutex_lock(&job->lock);
+    job->width = width;
+    job->height = height;
+    schedule_pump(job);
+    g_mutex_unlock(&job->lock);
+}
+
+static void on_load_rows(const cairo_rectangle_int_t *r, const guint8 *pixels, int stride,
+                         gpointer data) {
+    LoadJob *job = data;
+    LoadBand *band = g_new(LoadBand, 1);
+    band->r = *r;
+    band->pixels = g_malloc((size_t)r->width * 4 * r->height);
+    for (int y = 0; y < r->height; y++) {
+        memcpy(band->pixels + (size_t)y * r->width * 4, pixels + (size_t)y * stride,
+               (size_t)r->width * 4);
+    }
+
+    g_mutex_lock(&job->lock);
+    /* Keeps a decoder that outruns the main loop from queueing the whole
+     * image. */
+    while (job->bands.length >= LOAD_QUEUE_MAX &&
+           !g_cancellable_is_cancelled(job->cancellable)) {
+        g_cond_wait(&job->drained, &job->lock);
+    }
+    g_queue_push_tail(&job->bands, band);
+    schedule_pump(job);
+    g_mutex_unlock(&job->lock);
+}
+
+static gpointer load_thread(gpointer data) {
+    static const ImageioLoadFuncs funcs = { on_load_size, on_load_rows };
+    LoadJob *job = data;
+    GError *error = NULL;
+
+    gboolean ok = imageio_load_stream(job->filename, &funcs, job, job->cancellable, &error);
+
+    g_mutex_lock(&job->lock);
+    job->ok = ok;
+    job->error = error;
+    job->done = TRUE;
+    schedule_pump(job);
+    g_mutex_unlock(&job->lock);
+
+    load_job_unref(job);
+    return NULL;
+}
+
+/* Decodes filename on a worker thread, replacing any load still running.
+ * The current image stays until the new one's size is known. */
+static void load_image_to_canvas(const char *filename) {
+    cancel_load();
+    record_load(filename);
+
+    load_job = g_new0(LoadJob, 1);
+    load_job->ref_count = 2; /* load_job and the worker */
+    load_job->filename = g_strdup(filename);
+    load_job->trace_start = trace_now();
+    load_job->cancellable = g_cancellable_new();
+    g_mutex_init(&load_job->lock);
+    g_cond_init(&load_job->drained);
+    g_queue_init(&load_job->bands);
+
+    gchar *base = g_path_get_basename(filename);
+    gchar *text = g_strdup_printf("Loading %s", base);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(load_progress), text);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(load_progress), 0);
+    gtk_widget_show(load_progress);
+    g_free(text);
+    g_free(base);
+
+    g_thread_unref(g_thread_new("load", load_thread, load_job));
+}
+
 static void on_tool_clicked(GtkToolButton *btn, gpointer data) {
     current_tool = GPOINTER_TO_INT(data);
+    record_tool(current_tool);
+}
+
+static void on_redact_mode_changed(GtkComboBox *combo, gpointer data) {
+    current_redact_mode = gtk_combo_box_get_active(combo);
+    record_redact_mode(current_redact_mode);
 }
 
 static void on_color_set(GtkColorButton *widget, gpointer data) {
     gtk_color_chooser_get_rgba(GTK_COLOR_CHOOSER(widget), &current_color);
+    ShapeStyle style = current_style();
+    record_style(&style);
 }
 
 static void on_size_changed(GtkSpinButton *spin, gpointer data) {
     current_size = gtk_spin_button_get_value(spin);
+    ShapeStyle style = current_style();
+    record_style(&style);
 }
 
 int main(int argc, char *argv[]) {
+    /* Batch and replay modes run before gtk_init() so they never need a
+     * display. */
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        return batch_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) {
+        return replay_main(argc - 1, argv + 1);
+    }
+
     gtk_init(&argc, &argv);
+    trace_init();
+    record_init();
+    session_init();
+    ShapeStyle style = current_style();
+    record_tool(current_tool);
+    record_redact_mode(current_redact_mode);
+    record_style(&style);
 
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "Crayons");
@@ -576,23 +1654,27 @@ int main(int argc, char *argv[]) {
     GtkWidget *newMi = gtk_menu_item_new_with_label("New");
     GtkWidget *openMi = gtk_menu_item_new_with_label("Open");
     GtkWidget *saveMi = gtk_menu_item_new_with_label("Save");
+    GtkWidget *closeMi = gtk_menu_item_new_with_label("Close");
     GtkWidget *quitMi = gtk_menu_item_new_with_label("Quit");
     
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(fileMi), fileMenu);
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), newMi);
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), openMi);
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), saveMi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), closeMi);
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), gtk_separator_menu_item_new());
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), quitMi);
     
     gtk_widget_add_accelerator(newMi, "activate", accel_group, GDK_KEY_n, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_widget_add_accelerator(openMi, "activate", accel_group, GDK_KEY_o, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_widget_add_accelerator(saveMi, "activate", accel_group, GDK_KEY_s, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(closeMi, "activate", accel_group, GDK_KEY_w, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_widget_add_accelerator(quitMi, "activate", accel_group, GDK_KEY_q, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
 
     g_signal_connect(newMi, "activate", G_CALLBACK(on_new_file), NULL);
     g_signal_connect(openMi, "activate", G_CALLBACK(on_open_file), NULL);
     g_signal_connect(saveMi, "activate", G_CALLBACK(on_save_file), NULL);
+    g_signal_connect(closeMi, "activate", G_CALLBACK(on_close_menu), NULL);
     g_signal_connect(quitMi, "activate", G_CALLBACK(on_quit_menu), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), fileMi);
 
@@ -600,16 +1682,25 @@ int main(int argc, char *argv[]) {
     GtkWidget *editMi = gtk_menu_item_new_with_label("Edit");
     GtkWidget *undoMi = gtk_menu_item_new_with_label("Undo");
     GtkWidget *redoMi = gtk_menu_item_new_with_label("Redo");
+    GtkWidget *copyMi = gtk_menu_item_new_with_label("Copy Image");
+    GtkWidget *pasteMi = gtk_menu_item_new_with_label("Paste Image");
 
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(editMi), editMenu);
     gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), undoMi);
     gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), redoMi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), gtk_separator_menu_item_new());
+    gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), copyMi);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), pasteMi);
     
     gtk_widget_add_accelerator(undoMi, "activate", accel_group, GDK_KEY_z, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_widget_add_accelerator(redoMi, "activate", accel_group, GDK_KEY_y, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(copyMi, "activate", accel_group, GDK_KEY_c, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+    gtk_widget_add_accelerator(pasteMi, "activate", accel_group, GDK_KEY_v, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
 
     g_signal_connect(undoMi, "activate", G_CALLBACK(on_undo), NULL);
     g_signal_connect(redoMi, "activate", G_CALLBACK(on_redo), NULL);
+    g_signal_connect(copyMi, "activate", G_CALLBACK(on_copy), NULL);
+    g_signal_connect(pasteMi, "activate", G_CALLBACK(on_paste), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), editMi);
 
     GtkWidget *viewMenu = gtk_menu_new();
@@ -685,10 +1776,22 @@ int main(int argc, char *argv[]) {
     GtkToolItem *redactTb = gtk_radio_tool_button_new(group);
     gtk_tool_button_set_label(GTK_TOOL_BUTTON(redactTb), "Redact");
     gtk_tool_button_set_icon_name(GTK_TOOL_BUTTON(redactTb), "gtk-strikethrough");
-    gtk_tool_item_set_tooltip_text(redactTb, "Redact Tool (Jitter Filter)");
+    gtk_tool_item_set_tooltip_text(redactTb, "Redact Tool");
     g_signal_connect(redactTb, "clicked", G_CALLBACK(on_tool_clicked), GINT_TO_POINTER(TOOL_REDACT));
     gtk_toolbar_insert(GTK_TOOLBAR(toolbar), redactTb, -1);
 
+    /* In RedactMode order. */
+    GtkToolItem *redactModeItem = gtk_tool_item_new();
+    GtkWidget *redactModeCombo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(redactModeCombo), "Jitter");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(redactModeCombo), "Blur");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(redactModeCombo), "Pixelate");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(redactModeCombo), current_redact_mode);
+    gtk_widget_set_tooltip_text(redactModeCombo, "Redaction filter");
+    g_signal_connect(redactModeCombo, "changed", G_CALLBACK(on_redact_mode_changed), NULL);
+    gtk_container_add(GTK_CONTAINER(redactModeItem), redactModeCombo);
+    gtk_toolbar_insert(GTK_TOOLBAR(toolbar), redactModeItem, -1);
+
     gtk_toolbar_insert(GTK_TOOLBAR(toolbar), gtk_separator_tool_item_new(), -1);
 
     GtkToolItem *colorItem = gtk_tool_item_new();
@@ -713,13 +1816,34 @@ int main(int argc, char *argv[]) {
     gtk_container_add(GTK_CONTAINER(sizeItem), sizeBox);
     gtk_toolbar_insert(GTK_TOOLBAR(toolbar), sizeItem, -1);
 
-    scrolled_window = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
-                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+    /* Tabs only; their pages are empty and every document is shown in the
+     * one drawing area below. */
+    documents = g_ptr_array_new();
+    notebook = gtk_notebook_new();
+    gtk_notebook_set_scrollable(GTK_NOTEBOOK(notebook), TRUE);
+    gtk_notebook_set_show_border(GTK_NOTEBOOK(notebook), FALSE);
+    gtk_widget_set_can_focus(notebook, FALSE);
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(on_switch_page), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), notebook, FALSE, FALSE, 0);
+
+    /* The drawing area is only as big as the viewport and scrolls itself,
+     * so zooming in never grows a widget or its backing store. */
+    GtkWidget *view_grid = gtk_grid_new();
+    gtk_box_pack_start(GTK_BOX(vbox), view_grid, TRUE, TRUE, 0);
+
+    hadjustment = gtk_adjustment_new(0, 0, 0, 0, 0, 0);
+    vadjustment = gtk_adjustment_new(0, 0, 0, 0, 0, 0);
+    g_signal_connect(hadjustment, "value-changed", G_CALLBACK(on_view_scrolled), NULL);
+    g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_view_scrolled), NULL);
 
     drawing_area = gtk_drawing_area_new();
-    gtk_container_add(GTK_CONTAINER(scrolled_window), drawing_area);
+    gtk_widget_set_hexpand(drawing_area, TRUE);
+    gtk_widget_set_vexpand(drawing_area, TRUE);
+    hscrollbar = gtk_scrollbar_new(GTK_ORIENTATION_HORIZONTAL, hadjustment);
+    vscrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, vadjustment);
+    gtk_grid_attach(GTK_GRID(view_grid), drawing_area, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(view_grid), vscrollbar, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(view_grid), hscrollbar, 0, 1, 1, 1);
 
     g_signal_connect(drawing_area, "draw", G_CALLBACK(on_draw), NULL);
     g_signal_connect(drawing_area, "configure-event", G_CALLBACK(configure_event_cb), NULL);
@@ -732,18 +1856,60 @@ int main(int argc, char *argv[]) {
                                       | GDK_BUTTON_PRESS_MASK
                                       | GDK_POINTER_MOTION_MASK
                                       | GDK_BUTTON_RELEASE_MASK
-                                      | GDK_SCROLL_MASK);
+                                      | GDK_SCROLL_MASK
+                                      | GDK_SMOOTH_SCROLL_MASK);
+
+    GtkWidget *status_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), status_box, FALSE, FALSE, 2);
+
+    status_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(status_label), 0.0);
+    gtk_widget_set_margin_start(status_label, 5);
+    gtk_box_pack_start(GTK_BOX(status_box), status_label, TRUE, TRUE, 0);
+
+    save_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(save_progress), TRUE);
+    gtk_widget_set_valign(save_progress, GTK_ALIGN_CENTER);
+    gtk_widget_set_margin_end(save_progress, 5);
+    gtk_widget_set_no_show_all(save_progress, TRUE);
+    gtk_box_pack_end(GTK_BOX(status_box), save_progress, FALSE, FALSE, 0);
+
+    load_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(load_progress), TRUE);
+    gtk_widget_set_valign(load_progress, GTK_ALIGN_CENTER);
+    gtk_widget_set_margin_end(load_progress, 5);
+    gtk_widget_set_no_show_all(load_progress, TRUE);
+    gtk_box_pack_end(GTK_BOX(status_box), load_progress, FALSE, FALSE, 0);
+
+    update_annotation_status();
 
     gtk_widget_show_all(window);
 
-    if (argc > 1) {
-        while(gtk_events_pending()) gtk_main_iteration();
-        load_image_to_surface(argv[1]);
-    } else {
-        on_new_file(NULL, NULL);
+    /* Every pointer sample reaches the pen, not just the last one per
+     * frame; they are still drawn once per frame. */
+    gdk_window_set_event_compression(gtk_widget_get_window(drawing_area), FALSE);
+
+    /* Recovered before any image gets recovery files of its own, and
+     * opened next to the images asked for. */
+    GPtrArray *recovered = recover_documents();
+    /* Only the first image is decoded now, the others once shown. */
+    for (int i = 1; i < argc; i++) add_document(document_new_file(argv[i]), i == 1);
+    for (guint i = 0; i < recovered->len; i++) {
+        add_document(g_ptr_array_index(recovered, i), argc == 1 && i == 0);
     }
+    if (documents->len == 0) on_new_file(NULL, NULL);
+    g_ptr_array_free(recovered, TRUE);
 
     gtk_main();
 
+    /* Stops the helper threads before every recovery file goes. */
+    for (guint i = 0; i < documents->len; i++) {
+        Document *doc = g_ptr_array_index(documents, i);
+        g_clear_pointer(&doc->journal, journal_free);
+        g_clear_pointer(&doc->session, session_free);
+    }
+    session_close();
+    trace_write();
+    record_finish(canvas);
     return 0;
 }
@@ -0,0 +1,230 @@
+#include "mipmap.h"
+#include "parallel.h"
+
+#include <math.h>
+
+typedef struct {
+    Canvas *canvas;
+    cairo_region_t *dirty;      /* canvas-space area that is out of date */
+} MipLevel;
+
+typedef struct {
+    const Canvas *src;
+    Canvas *dst;
+    int x1, x2;
+} DownsampleJob;
+
+struct _Mipmap {
+    /* levels[0] is unused; level 0 is the canvas. */
+    MipLevel levels[MIPMAP_MAX_LEVELS + 1];
+    int width, height;          /* of the canvas the levels were built from */
+};
+
+Mipmap *mipmap_new(void) {
+    return g_new0(Mipmap, 1);
+}
+
+void mipmap_free(Mipmap *mipmap) {
+    if (!mipmap) return;
+    mipmap_reset(mipmap);
+    g_free(mipmap);
+}
+
+int mipmap_level_for_scale(double scale) {
+    if (scale >= 1.0 || scale <= 0.0) return 0;
+
+    int level = (int)floor(-log2(scale) + 1e-9);
+    return MIN(level, MIPMAP_MAX_LEVELS);
+}
+
+static guint32 *tile_row(cairo_surface_t *tile, int y) {
+    return (guint32 *)(cairo_image_surface_get_data(tile) +
+                       (size_t)y * cairo_image_surface_get_stride(tile));
+}
+
+/* Averages 2x2 blocks of premultiplied ARGB. Two channels are summed per
+ * 32 bit word; four bytes add up to at most 1020 so they cannot overflow
+ * into each other. */
+static guint32 average4(guint32 a, guint32 b, guint32 c, guint32 d) {
+    guint32 lo = (a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) + (d & 0x00FF00FF);
+    guint32 hi = ((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) +
+                 ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF);
+    lo = ((lo + 0x00020002) >> 2) & 0x00FF00FF;
+    hi = ((hi + 0x00020002) >> 2) & 0x00FF00FF;
+    return lo | (hi << 8);
+}
+
+/* Destination tile (tx, ty) is fed by source tiles (2tx, 2ty) to
+ * (2tx + 1, 2ty + 1). The tile size is even, so the two source rows and
+ * columns of a destination pixel always share a source tile. */
+static void downsample_rows(int y0, int y1, gpointer data) {
+    const DownsampleJob *job = data;
+    const int src_w = canvas_get_width(job->src);
+    const int src_h = canvas_get_height(job->src);
+    const guint32 fill = canvas_get_fill(job->src);
+    const int half = CANVAS_TILE_SIZE / 2;
+
+    for (int y = y0; y < y1; y++) {
+        int ty = y / CANVAS_TILE_SIZE;
+        int sy0 = 2 * y;
+        int sy1 = MIN(sy0 + 1, src_h - 1);
+
+        for (int tx = job->x1 / CANVAS_TILE_SIZE; tx <= (job->x2 - 1) / CANVAS_TILE_SIZE; tx++) {
+            cairo_surface_t *dst = canvas_peek_tile(job->dst, tx, ty);
+            if (!dst) continue;
+            guint32 *out = tile_row(dst, y % CANVAS_TILE_SIZE) - tx * CANVAS_TILE_SIZE;
+
+            for (int stx = 2 * tx; stx <= 2 * tx + 1; stx++) {
+                int xa = MAX(job->x1, stx * half);
+                int xb = MIN(job->x2, (stx + 1) * half);
+                if (xa >= xb) continue;
+
+                cairo_surface_t *src = canvas_peek_tile(job->src, stx, sy0 / CANVAS_TILE_SIZE);
+                if (!src) {
+                    for (int x = xa; x < xb; x++) out[x] = fill;
+                    continue;
+                }
+
+                const guint32 *r0 = tile_row(src, sy0 % CANVAS_TILE_SIZE) - stx * CANVAS_TILE_SIZE;
+                const guint32 *r1 = tile_row(src, sy1 % CANVAS_TILE_SIZE) - stx * CANVAS_TILE_SIZE;
+                for (int x = xa; x < xb; x++) {
+                    int sx0 = 2 * x;
+                    int sx1 = MIN(sx0 + 1, src_w - 1);
+                    out[x] = average4(r0[sx0], r0[sx1], r1[sx0], r1[sx1]);
+                }
+            }
+        }
+    }
+}
+
+/* Allocates the destination tiles of r whose sources are not all blank and
+ * flushes every tile the filter touches, or marks them dirty once done.
+ * Tile allocation must not happen on the worker threads. */
+static void prepare_tiles(const Canvas *src, Canvas *dst, const cairo_rectangle_int_t *r,
+                          gboolean done) {
+    int src_tx = (canvas_get_width(src) + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    int src_ty = (canvas_get_height(src) + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+
+    for (int ty = r->y / CANVAS_TILE_SIZE; ty <= (r->y + r->height - 1) / CANVAS_TILE_SIZE; ty++) {
+        for (int tx = r->x / CANVAS_TILE_SIZE; tx <= (r->x + r->width - 1) / CANVAS_TILE_SIZE; tx++) {
+            gboolean used = FALSE;
+            for (int sty = 2 * ty; sty <= MIN(2 * ty + 1, src_ty - 1); sty++) {
+                for (int stx = 2 * tx; stx <= MIN(2 * tx + 1, src_tx - 1); stx++) {
+                    cairo_surface_t *tile = canvas_peek_tile(src, stx, sty);
+                    if (!tile) continue;
+                    if (!done) cairo_surface_flush(tile);
+                    used = TRUE;
+                }
+            }
+
+            if (done) {
+                cairo_surface_t *tile = canvas_peek_tile(dst, tx, ty);
+                if (tile) cairo_surface_mark_dirty(tile);
+            } else if (used || canvas_peek_tile(dst, tx, ty)) {
+                cairo_surface_flush(canvas_get_tile(dst, tx, ty));
+            }
+        }
+    }
+}
+
+static Canvas *level_source(Mipmap *mipmap, Canvas *src, int level);
+
+/* Refilters the dirty part of level from the level below it. */
+static void level_update(Mipmap *mipmap, Canvas *src, int level) {
+    MipLevel *l = &mipmap->levels[level];
+    if (cairo_region_is_empty(l->dirty)) return;
+
+    DownsampleJob job;
+    job.src = level_source(mipmap, src, level - 1);
+    job.dst = l->canvas;
+
+    int w = canvas_get_width(l->canvas);
+    int h = canvas_get_height(l->canvas);
+    int step = 1 << level;
+
+    for (int i = 0; i < cairo_region_num_rectangles(l->dirty); i++) {
+        cairo_rectangle_int_t r;
+        cairo_region_get_rectangle(l->dirty, i, &r);
+
+        /* Every level pixel any part of r falls into. */
+        cairo_rectangle_int_t lr;
+        lr.x = MAX(0, r.x / step);
+        lr.y = MAX(0, r.y / step);
+        lr.width = MIN(w, (r.x + r.width + step - 1) / step) - lr.x;
+        lr.height = MIN(h, (r.y + r.height + step - 1) / step) - lr.y;
+        if (lr.width <= 0 || lr.height <= 0) continue;
+
+        job.x1 = lr.x;
+        job.x2 = lr.x + lr.width;
+        prepare_tiles(job.src, job.dst, &lr, FALSE);
+        parallel_rows(lr.y, lr.y + lr.height, downsample_rows, &job);
+        prepare_tiles(job.src, job.dst, &lr, TRUE);
+    }
+
+    cairo_region_destroy(l->dirty);
+    l->dirty = cairo_region_create();
+}
+
+static Canvas *level_source(Mipmap *mipmap, Canvas *src, int level) {
+    if (level == 0) return src;
+
+    MipLevel *l = &mipmap->levels[level];
+    if (!l->canvas) {
+        int step = 1 << level;
+        cairo_rectangle_int_t all = { 0, 0, mipmap->width, mipmap->height };
+
+        l->canvas = canvas_new((mipmap->width + step - 1) / step,
+                               (mipmap->height + step - 1) / step, canvas_get_fill(src));
+        if (l->dirty) cairo_region_destroy(l->dirty);
+        l->dirty = cairo_region_create_rectangle(&all);
+    }
+    level_update(mipmap, src, level);
+    return l->canvas;
+}
+
+Canvas *mipmap_get_level(Mipmap *mipmap, Canvas *src, int level) {
+    int w = canvas_get_width(src);
+    int h = canvas_get_height(src);
+
+    if (w != mipmap->width || h != mipmap->height) {
+        mipmap_reset(mipmap);
+        mipmap->width = w;
+        mipmap->height = h;
+    }
+
+    return level_source(mipmap, src, CLAMP(level, 0, MIPMAP_MAX_LEVELS));
+}
+
+void mipmap_invalidate(Mipmap *mipmap, double x1, double y1, double x2, double y2) {
+    cairo_rectangle_int_t r;
+    r.x = (int)floor(fmin(x1, x2));
+    r.y = (int)floor(fmin(y1, y2));
+    r.width = (int)ceil(fmax(x1, x2)) - r.x;
+    r.height = (int)ceil(fmax(y1, y2)) - r.y;
+    if (r.width <= 0 || r.height <= 0) return;
+
+    for (int i = 1; i <= MIPMAP_MAX_LEVELS; i++) {
+        MipLevel *l = &mipmap->levels[i];
+        if (l->canvas) cairo_region_union_rectangle(l->dirty, &r);
+    }
+}
+
+gsize mipmap_get_size(const Mipmap *mipmap) {
+    gsize size = 0;
+    for (int i = 1; i <= MIPMAP_MAX_LEVELS; i++) {
+        if (mipmap->levels[i].canvas) size += canvas_get_size(mipmap->levels[i].canvas, NULL);
+    }
+    return size;
+}
+
+void mipmap_reset(Mipmap *mipmap) {
+    for (int i = 1; i <= MIPMAP_MAX_LEVELS; i++) {
+        MipLevel *l = &mipmap->levels[i];
+        canvas_free(l->canvas);
+        if (l->dirty) cairo_region_destroy(l->dirty);
+        l->canvas = NULL;
+        l->dirty = NULL;
+    }
+    mipmap->width = 0;
+    mipmap->height = 0;
+}
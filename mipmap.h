@@ -0,0 +1,44 @@
+#ifndef CRAYONS_MIPMAP_H
+#define CRAYONS_MIPMAP_H
+
+#include "canvas.h"
+
+/*
+ * Mip pyramid of the canvas for zoomed-out drawing.
+ *
+ * Level n is the canvas box-filtered down by 2^n, stored as a tiled canvas
+ * itself. Levels are built the first time they are asked for and afterwards
+ * only the areas invalidated since the last request are filtered again, so a
+ * redraw never has to resample more than twice the pixels it shows. Blank
+ * canvas tiles stay blank, and unallocated, in every level.
+ *
+ * Each pyramid belongs to one canvas, so switching between canvases keeps
+ * the levels of both.
+ */
+
+#define MIPMAP_MAX_LEVELS 8
+
+typedef struct _Mipmap Mipmap;
+
+/* An empty pyramid; levels are added as they are asked for. */
+Mipmap *mipmap_new(void);
+void mipmap_free(Mipmap *mipmap);
+
+/* Picks the smallest level that still has at least scale pixels per canvas
+ * pixel. Level 0 is the canvas itself. */
+int mipmap_level_for_scale(double scale);
+
+/* Returns level of src, bringing it up to date first. Levels above 0 are
+ * owned by the pyramid and stay valid until the next reset. */
+Canvas *mipmap_get_level(Mipmap *mipmap, Canvas *src, int level);
+
+/* Marks the given canvas-space bounds as changed in every level. */
+void mipmap_invalidate(Mipmap *mipmap, double x1, double y1, double x2, double y2);
+
+/* Bytes of pixels held by the levels. */
+gsize mipmap_get_size(const Mipmap *mipmap);
+
+/* Drops all levels, e.g. when the canvas is replaced. */
+void mipmap_reset(Mipmap *mipmap);
+
+#endif
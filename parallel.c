@@ -0,0 +1,89 @@
+#include "parallel.h"
+
+/* Bands smaller than this are not worth a hand-off to another thread. */
+#define MIN_BAND_ROWS 16
+
+typedef struct {
+    ParallelRowsFunc func;
+    gpointer data;
+    int y0, y1;
+    int band;
+    int n_bands;
+    gint next;
+
+    GMutex lock;
+    GCond done;
+    int helpers;        /* pool tasks that have not returned yet */
+} ParallelJob;
+
+static GThreadPool *pool = NULL;
+static int n_threads = 0;
+
+static void run_bands(ParallelJob *job) {
+    for (;;) {
+        int i = g_atomic_int_add(&job->next, 1);
+        if (i >= job->n_bands) break;
+
+        int a = job->y0 + i * job->band;
+        int b = MIN(a + job->band, job->y1);
+        job->func(a, b, job->data);
+    }
+}
+
+static void worker(gpointer data, gpointer user_data) {
+    ParallelJob *job = data;
+    run_bands(job);
+
+    g_mutex_lock(&job->lock);
+    if (--job->helpers == 0) g_cond_signal(&job->done);
+    g_mutex_unlock(&job->lock);
+}
+
+int parallel_threads(void) {
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        n_threads = MAX(1, (int)g_get_num_processors());
+        if (n_threads > 1) {
+            pool = g_thread_pool_new(worker, NULL, n_threads - 1, TRUE, NULL);
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+    return n_threads;
+}
+
+void parallel_rows(int y0, int y1, ParallelRowsFunc func, gpointer data) {
+    int rows = y1 - y0;
+    if (rows <= 0) return;
+
+    int threads = parallel_threads();
+    if (threads == 1 || rows < 2 * MIN_BAND_ROWS) {
+        func(y0, y1, data);
+        return;
+    }
+
+    ParallelJob job;
+    job.func = func;
+    job.data = data;
+    job.y0 = y0;
+    job.y1 = y1;
+    /* A few bands per thread so uneven rows still balance out. */
+    job.band = MAX(MIN_BAND_ROWS, (rows + threads * 4 - 1) / (threads * 4));
+    job.n_bands = (rows + job.band - 1) / job.band;
+    job.next = 0;
+    job.helpers = MIN(threads - 1, job.n_bands - 1);
+    g_mutex_init(&job.lock);
+    g_cond_init(&job.done);
+
+    for (int i = 0, n = job.helpers; i < n; i++) {
+        g_thread_pool_push(pool, &job, NULL);
+    }
+    run_bands(&job);
+
+    g_mutex_lock(&job.lock);
+    while (job.helpers > 0) g_cond_wait(&job.done, &job.lock);
+    g_mutex_unlock(&job.lock);
+
+    g_mutex_clear(&job.lock);
+    g_cond_clear(&job.done);
+}
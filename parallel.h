@@ -0,0 +1,22 @@
+#ifndef CRAYONS_PARALLEL_H
+#define CRAYONS_PARALLEL_H
+
+#include <glib.h>
+
+/*
+ * Shared worker pool for splitting per-pixel kernels across cores.
+ *
+ * parallel_rows() cuts [y0, y1) into bands, runs func on them from the pool
+ * and the calling thread, and returns once every band is done. func must be
+ * safe to run concurrently on disjoint bands and must not call
+ * parallel_rows() itself.
+ */
+
+typedef void (*ParallelRowsFunc)(int y0, int y1, gpointer data);
+
+void parallel_rows(int y0, int y1, ParallelRowsFunc func, gpointer data);
+
+/* Number of threads parallel_rows() may use, including the caller. */
+int parallel_threads(void);
+
+#endif
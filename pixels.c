@@ -0,0 +1,203 @@
+#include "pixels.h"
+#include "parallel.h"
+
+#include <string.h>
+
+/* Like the redact kernel, rows are processed LANES pixels at a time with
+ * GCC vector extensions, lowered to SSE2 or scalar code, and the row
+ * functions are cloned for AVX2 and picked at load time. */
+#define LANES 8
+
+typedef guint32 vuint __attribute__((vector_size(LANES * 4)));
+typedef gint32 vint __attribute__((vector_size(LANES * 4)));
+typedef float vfloat __attribute__((vector_size(LANES * 4)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+#pragma GCC diagnostic ignored "-Wpsabi"
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+typedef struct {
+    const guint8 *src;
+    int src_stride;
+    int channels;
+    guint8 *dst;
+    int dst_stride;
+    int width;
+} PixelsJob;
+
+/* c * a / 255, rounded, for every colour channel. Exact for a == 255 and
+ * a == 0, so opaque and clear pixels need no special case. */
+KERNEL_INLINE vuint premultiply(vuint p) {
+    vuint a = p >> 24;
+    vuint out = a << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        vuint t = ((p >> shift) & 0xFF) * a + 0x80;
+        out |= ((t + (t >> 8)) >> 8) << shift;
+    }
+    return out;
+}
+
+/* (c * 255 + a / 2) / a, capped at 255. The quotient is estimated in float
+ * and then corrected by one either way, which makes it exact. */
+KERNEL_INLINE vuint unpremultiply(vuint p) {
+    const vint zero = { 0 };
+    vint a = (vint)(p >> 24);
+    vint div = a + ((a == 0) & 1);
+    vfloat inv = 1.0f / __builtin_convertvector(div, vfloat);
+
+    vint out = a << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        vint num = (vint)((p >> shift) & 0xFF) * 255 + (a >> 1);
+        vint q = __builtin_convertvector(__builtin_convertvector(num, vfloat) * inv, vint);
+        q -= (q * div > num) & 1;
+        q += ((q + 1) * div <= num) & 1;
+        q += ((q > 255) & (255 - q));
+        out |= q << shift;
+    }
+
+    /* Clear pixels keep whatever colour they had. */
+    vint clear = a == zero;
+    return (vuint)((out & ~clear) | ((vint)p & clear));
+}
+
+/* Straight ARGB32 to RGBA in memory order. */
+KERNEL_INLINE vuint to_rgba(vuint p) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    return (p & 0xFF00FF00u) | (p >> 16 & 0xFF) | (p & 0xFF) << 16;
+#else
+    return p << 8 | p >> 24;
+#endif
+}
+
+KERNEL_INLINE vuint unpremultiply_to_rgba(vuint p) {
+    return to_rgba(unpremultiply(p));
+}
+
+/* Runs kernel over n pixels of row, the tail through a scratch vector. */
+#define FOR_EACH_LANES(row, n, kernel)                                                  \
+    do {                                                                                \
+        int x = 0;                                                                      \
+        for (; x + LANES <= (n); x += LANES) {                                          \
+            vuint v;                                                                    \
+            memcpy(&v, (row) + x, sizeof(v));                                           \
+            v = kernel(v);                                                              \
+            memcpy((row) + x, &v, sizeof(v));                                           \
+        }                                                                               \
+        if (x < (n)) {                                                                  \
+            vuint v = { 0 };                                                            \
+            memcpy(&v, (row) + x, (size_t)((n) - x) * 4);                               \
+            v = kernel(v);                                                              \
+            memcpy((row) + x, &v, (size_t)((n) - x) * 4);                               \
+        }                                                                               \
+    } while (0)
+
+KERNEL_CLONES
+static void premultiply_rows(int y0, int y1, gpointer data) {
+    const PixelsJob *job = data;
+    for (int y = y0; y < y1; y++) {
+        guint32 *row = (guint32 *)(job->dst + (size_t)y * job->dst_stride);
+        FOR_EACH_LANES(row, job->width, premultiply);
+    }
+}
+
+KERNEL_CLONES
+static void unpremultiply_rows(int y0, int y1, gpointer data) {
+    const PixelsJob *job = data;
+    for (int y = y0; y < y1; y++) {
+        guint32 *row = (guint32 *)(job->dst + (size_t)y * job->dst_stride);
+        FOR_EACH_LANES(row, job->width, unpremultiply);
+    }
+}
+
+KERNEL_CLONES
+static void from_rgba_rows(int y0, int y1, gpointer data) {
+    const PixelsJob *job = data;
+    const int channels = job->channels;
+
+    for (int y = y0; y < y1; y++) {
+        const guint8 *in = job->src + (size_t)y * job->src_stride;
+        guint32 *row = (guint32 *)(job->dst + (size_t)y * job->dst_stride);
+
+        /* Gather into ARGB first, then premultiply in place. */
+        if (channels == 4) {
+            for (int x = 0; x < job->width; x++, in += 4) {
+                row[x] = (guint32)in[3] << 24 | (guint32)in[0] << 16 | (guint32)in[1] << 8 | in[2];
+            }
+        } else {
+            for (int x = 0; x < job->width; x++, in += channels) {
+                row[x] = 0xFF000000u | (guint32)in[0] << 16 | (guint32)in[1] << 8 | in[2];
+            }
+        }
+        if (channels == 4) FOR_EACH_LANES(row, job->width, premultiply);
+    }
+}
+
+KERNEL_CLONES
+static void to_rgba_rows(int y0, int y1, gpointer data) {
+    const PixelsJob *job = data;
+    for (int y = y0; y < y1; y++) {
+        guint32 *row = (guint32 *)(job->dst + (size_t)y * job->dst_stride);
+        memcpy(row, job->src + (size_t)y * job->src_stride, (size_t)job->width * 4);
+        FOR_EACH_LANES(row, job->width, unpremultiply_to_rgba);
+    }
+}
+
+KERNEL_CLONES
+static void to_rgb_rows(int y0, int y1, gpointer data) {
+    const PixelsJob *job = data;
+    for (int y = y0; y < y1; y++) {
+        const guint32 *in = (const guint32 *)(job->src + (size_t)y * job->src_stride);
+        guint8 *out = job->dst + (size_t)y * job->dst_stride;
+
+        /* Over white, a premultiplied colour just gains what alpha leaves. */
+        for (int x = 0; x < job->width; x++, out += 3) {
+            guint32 p = in[x];
+            guint32 white = 255 - (p >> 24);
+            out[0] = (p >> 16 & 0xFF) + white;
+            out[1] = (p >> 8 & 0xFF) + white;
+            out[2] = (p & 0xFF) + white;
+        }
+    }
+}
+
+void pixels_premultiply(guint8 *data, int stride, int width, int height) {
+    PixelsJob job = { .dst = data, .dst_stride = stride, .width = width };
+    if (width > 0) parallel_rows(0, height, premultiply_rows, &job);
+}
+
+void pixels_unpremultiply(guint8 *data, int stride, int width, int height) {
+    PixelsJob job = { .dst = data, .dst_stride = stride, .width = width };
+    if (width > 0) parallel_rows(0, height, unpremultiply_rows, &job);
+}
+
+void pixels_from_rgba(const guint8 *src, int src_stride, int channels,
+                      guint8 *dst, int dst_stride, int width, int height) {
+    PixelsJob job = {
+        .src = src, .src_stride = src_stride, .channels = channels,
+        .dst = dst, .dst_stride = dst_stride, .width = width,
+    };
+    if (width > 0) parallel_rows(0, height, from_rgba_rows, &job);
+}
+
+void pixels_to_rgba(const guint8 *src, int src_stride,
+                    guint8 *dst, int dst_stride, int width, int height) {
+    PixelsJob job = {
+        .src = src, .src_stride = src_stride,
+        .dst = dst, .dst_stride = dst_stride, .width = width,
+    };
+    if (width > 0) parallel_rows(0, height, to_rgba_rows, &job);
+}
+
+void pixels_to_rgb(const guint8 *src, int src_stride,
+                   guint8 *dst, int dst_stride, int width, int height) {
+    PixelsJob job = {
+        .src = src, .src_stride = src_stride,
+        .dst = dst, .dst_stride = dst_stride, .width = width,
+    };
+    if (width > 0) parallel_rows(0, height, to_rgb_rows, &job);
+}
@@ -0,0 +1,37 @@
+#ifndef CRAYONS_PIXELS_H
+#define CRAYONS_PIXELS_H
+
+#include <glib.h>
+
+/*
+ * Conversions between the canvas's native-endian, premultiplied ARGB32 and
+ * the straight alpha pixels that image files hold.
+ *
+ * Each call is a single pass over the rows, vectorized and split across
+ * parallel_rows(), so callers should hand over whole bands rather than
+ * single rows.
+ */
+
+/* Premultiplies width x height ARGB32 pixels in place. */
+void pixels_premultiply(guint8 *data, int stride, int width, int height);
+
+/* Undoes pixels_premultiply(); fully transparent pixels are left as they are. */
+void pixels_unpremultiply(guint8 *data, int stride, int width, int height);
+
+/* Converts RGB (channels 3) or RGBA (channels 4) bytes with straight alpha,
+ * as GdkPixbuf stores them, to premultiplied ARGB32. src and dst must not
+ * overlap. */
+void pixels_from_rgba(const guint8 *src, int src_stride, int channels,
+                      guint8 *dst, int dst_stride, int width, int height);
+
+/* The reverse for RGBA: converts premultiplied ARGB32 to straight alpha
+ * RGBA bytes. src and dst must not overlap. */
+void pixels_to_rgba(const guint8 *src, int src_stride,
+                    guint8 *dst, int dst_stride, int width, int height);
+
+/* Converts premultiplied ARGB32 to RGB bytes composited over white, for
+ * formats without alpha. src and dst must not overlap. */
+void pixels_to_rgb(const guint8 *src, int src_stride,
+                   guint8 *dst, int dst_stride, int width, int height);
+
+#endif
@@ -0,0 +1,556 @@
+#include "record.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annotations.h"
+#include "imageio.h"
+#include "stroke.h"
+
+typedef enum {
+    REC_NEW = 1,        /* i32 width, i32 height */
+    REC_LOAD,           /* u32 length, filename bytes */
+    REC_TOOL,           /* u8 tool */
+    REC_STYLE,          /* d red, green, blue, alpha, size */
+    REC_ZOOM,           /* d zoom */
+    REC_PRESS,          /* d x, y, pressure, u32 seed */
+    REC_MOTION,         /* d x, y, pressure */
+    REC_RELEASE,        /* d x, y */
+    REC_CANCEL,
+    REC_UNDO,
+    REC_REDO,
+    REC_END,            /* u32 length, hex checksum */
+    REC_REDACT_MODE,    /* u8 mode; after REC_END so older recordings keep their types */
+    REC_SWITCH,         /* u32 document number */
+    REC_PASTE,          /* u32 width, height, premultiplied ARGB32 pixels */
+    N_RECORD_TYPES
+} RecordType;
+
+static const char *record_names[N_RECORD_TYPES] = {
+    [REC_NEW] = "new",
+    [REC_LOAD] = "load",
+    [REC_TOOL] = "tool",
+    [REC_STYLE] = "style",
+    [REC_ZOOM] = "zoom",
+    [REC_PRESS] = "press",
+    [REC_MOTION] = "motion",
+    [REC_RELEASE] = "release",
+    [REC_CANCEL] = "cancel",
+    [REC_UNDO] = "undo",
+    [REC_REDO] = "redo",
+    [REC_END] = "end",
+    [REC_REDACT_MODE] = "redact",
+    [REC_SWITCH] = "switch",
+    [REC_PASTE] = "paste",
+};
+
+static FILE *out = NULL;
+static char *out_name = NULL;
+static gint64 last_time = 0;
+
+void record_init(void) {
+    const char *file = g_getenv("CRAYONS_RECORD");
+    if (!file || !*file) return;
+
+    out = fopen(file, "wb");
+    if (!out) {
+        g_printerr("Could not write %s: %s\n", file, g_strerror(errno));
+        return;
+    }
+    out_name = g_strdup(file);
+    fputs(RECORD_MAGIC, out);
+    last_time = g_get_monotonic_time();
+}
+
+static void put_u32(guint32 v) {
+    v = GUINT32_TO_LE(v);
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+static void put_double(double v) {
+    guint64 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits = GUINT64_TO_LE(bits);
+    fwrite(&bits, sizeof(bits), 1, out);
+}
+
+static void put_string(const char *s) {
+    put_u32(strlen(s));
+    fputs(s, out);
+}
+
+static void begin_record(RecordType type) {
+    gint64 now = g_get_monotonic_time();
+    guint64 delay = now - last_time;
+    last_time = now;
+
+    fputc(type, out);
+    do {
+        fputc((delay & 0x7F) | (delay >= 0x80 ? 0x80 : 0), out);
+        delay >>= 7;
+    } while (delay);
+}
+
+void record_switch(int document) {
+    if (!out) return;
+    begin_record(REC_SWITCH);
+    put_u32(document);
+}
+
+void record_new(int width, int height) {
+    if (!out) return;
+    begin_record(REC_NEW);
+    put_u32(width);
+    put_u32(height);
+}
+
+void record_load(const char *filename) {
+    if (!out) return;
+    char *path = g_canonicalize_filename(filename, NULL);
+    begin_record(REC_LOAD);
+    put_string(path);
+    g_free(path);
+}
+
+void record_paste(const Canvas *canvas) {
+    if (!out) return;
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    begin_record(REC_PASTE);
+    put_u32(width);
+    put_u32(height);
+
+    /* Pasted images can be large, so they go out a band at a time. */
+    guint32 *band = g_new(guint32, (gsize)width * CANVAS_TILE_SIZE);
+    for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t r = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+        gsize n = (gsize)width * r.height;
+        canvas_read(canvas, &r, (guint8 *)band, width * 4);
+        for (gsize i = 0; i < n; i++) band[i] = GUINT32_TO_LE(band[i]);
+        fwrite(band, 4, n, out);
+    }
+    g_free(band);
+}
+
+void record_tool(ToolType tool) {
+    if (!out) return;
+    begin_record(REC_TOOL);
+    fputc(tool, out);
+}
+
+void record_redact_mode(RedactMode mode) {
+    if (!out) return;
+    begin_record(REC_REDACT_MODE);
+    fputc(mode, out);
+}
+
+void record_style(const ShapeStyle *style) {
+    if (!out) return;
+    begin_record(REC_STYLE);
+    put_double(style->red);
+    put_double(style->green);
+    put_double(style->blue);
+    put_double(style->alpha);
+    put_double(style->size);
+}
+
+void record_zoom(double zoom) {
+    if (!out) return;
+    begin_record(REC_ZOOM);
+    put_double(zoom);
+}
+
+void record_press(double x, double y, double pressure, guint32 seed) {
+    if (!out) return;
+    begin_record(REC_PRESS);
+    put_double(x);
+    put_double(y);
+    put_double(pressure);
+    put_u32(seed);
+}
+
+void record_motion(double x, double y, double pressure) {
+    if (!out) return;
+    begin_record(REC_MOTION);
+    put_double(x);
+    put_double(y);
+    put_double(pressure);
+}
+
+void record_release(double x, double y) {
+    if (!out) return;
+    begin_record(REC_RELEASE);
+    put_double(x);
+    put_double(y);
+}
+
+void record_cancel(void) {
+    if (!out) return;
+    begin_record(REC_CANCEL);
+}
+
+void record_undo(void) {
+    if (!out) return;
+    begin_record(REC_UNDO);
+}
+
+void record_redo(void) {
+    if (!out) return;
+    begin_record(REC_REDO);
+}
+
+void record_finish(const Canvas *canvas) {
+    if (!out) return;
+
+    if (canvas) {
+        char *checksum = canvas_checksum(canvas);
+        begin_record(REC_END);
+        put_string(checksum);
+        g_free(checksum);
+    }
+    if (fclose(out) != 0) g_printerr("Could not write %s: %s\n", out_name, g_strerror(errno));
+    out = NULL;
+    g_free(out_name);
+    out_name = NULL;
+}
+
+/* Replay */
+
+typedef struct {
+    const guint8 *p, *end;
+    gboolean ok;
+} Reader;
+
+static const guint8 *take(Reader *r, gsize n) {
+    if (!r->ok || (gsize)(r->end - r->p) < n) {
+        r->ok = FALSE;
+        return NULL;
+    }
+    const guint8 *at = r->p;
+    r->p += n;
+    return at;
+}
+
+static guint8 get_byte(Reader *r) {
+    const guint8 *at = take(r, 1);
+    return at ? *at : 0;
+}
+
+static guint64 get_varint(Reader *r) {
+    guint64 v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        guint8 b = get_byte(r);
+        v |= (guint64)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    r->ok = FALSE;
+    return 0;
+}
+
+static guint32 get_u32(Reader *r) {
+    guint32 v = 0;
+    const guint8 *at = take(r, sizeof(v));
+    if (at) memcpy(&v, at, sizeof(v));
+    return GUINT32_FROM_LE(v);
+}
+
+static double get_double(Reader *r) {
+    guint64 bits = 0;
+    const guint8 *at = take(r, sizeof(bits));
+    if (at) memcpy(&bits, at, sizeof(bits));
+    bits = GUINT64_FROM_LE(bits);
+
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static char *get_string(Reader *r) {
+    guint32 length = get_u32(r);
+    const guint8 *at = take(r, length);
+    return at ? g_strndup((const char *)at, length) : NULL;
+}
+
+/* A document switched away from. */
+typedef struct {
+    Canvas *canvas;
+    DisplayList *list;
+} ReplayDocument;
+
+/* Editor state the inputs act on, mirroring main.c. canvas and list belong
+ * to the current document; documents holds the others by number. */
+typedef struct {
+    Canvas *canvas;
+    DisplayList *list;
+    GHashTable *documents;      /* number -> ReplayDocument */
+    guint current;
+    ToolType tool;
+    RedactMode redact_mode;
+    ShapeStyle style;
+    gboolean drawing;
+    double start_x, start_y;
+    guint32 seed;
+    Stroke *stroke;
+} Replay;
+
+static void replace_canvas(Replay *rp, Canvas *canvas) {
+    stroke_free(rp->stroke);
+    rp->stroke = NULL;
+    rp->drawing = FALSE;
+    display_list_free(rp->list);
+    canvas_free(rp->canvas);
+    rp->canvas = canvas;
+    rp->list = display_list_new(canvas_snapshot(canvas));
+}
+
+static void replay_document_free(ReplayDocument *doc) {
+    display_list_free(doc->list);
+    canvas_free(doc->canvas);
+    g_free(doc);
+}
+
+/* Puts the current document away and takes out document, which has no
+ * canvas yet if it was never switched to. Like the editor, drops any drag
+ * in progress. */
+static void switch_document(Replay *rp, guint document) {
+    stroke_free(rp->stroke);
+    rp->stroke = NULL;
+    rp->drawing = FALSE;
+
+    ReplayDocument *from = g_new(ReplayDocument, 1);
+    from->canvas = rp->canvas;
+    from->list = rp->list;
+    g_hash_table_replace(rp->documents, GUINT_TO_POINTER(rp->current), from);
+
+    ReplayDocument *to = NULL;
+    g_hash_table_steal_extended(rp->documents, GUINT_TO_POINTER(document), NULL, (gpointer *)&to);
+    rp->canvas = to ? to->canvas : NULL;
+    rp->list = to ? to->list : NULL;
+    rp->current = document;
+    g_free(to);
+}
+
+static void add(Replay *rp, Annotation *annotation) {
+    cairo_rectangle_int_t changed;
+    display_list_add(rp->list, rp->canvas, annotation, &changed);
+}
+
+/* Applies one record; returns FALSE with error set if it cannot. */
+static gboolean apply(Replay *rp, RecordType type, Reader *r, GError **error) {
+    cairo_rectangle_int_t changed;
+
+    if (type != REC_NEW && type != REC_LOAD && type != REC_TOOL && type != REC_REDACT_MODE &&
+        type != REC_STYLE && type != REC_ZOOM && type != REC_SWITCH && type != REC_PASTE &&
+        type != REC_END && !rp->canvas) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s before any image",
+                    record_names[type]);
+        return FALSE;
+    }
+
+    switch (type) {
+    case REC_SWITCH: {
+        guint document = get_u32(r);
+        if (!r->ok) break;
+        if (document != rp->current) switch_document(rp, document);
+        break;
+    }
+    case REC_NEW: {
+        int width = get_u32(r);
+        int height = get_u32(r);
+        if (!r->ok || width <= 0 || height <= 0) break;
+        replace_canvas(rp, canvas_new(width, height, CANVAS_WHITE));
+        break;
+    }
+    case REC_LOAD: {
+        char *filename = get_string(r);
+        if (!filename) break;
+        Canvas *canvas = imageio_load(filename, error);
+        g_free(filename);
+        if (!canvas) return FALSE;
+        replace_canvas(rp, canvas);
+        break;
+    }
+    case REC_PASTE: {
+        int width = get_u32(r);
+        int height = get_u32(r);
+        if (!r->ok || width <= 0 || height <= 0) break;
+        if ((gsize)height > G_MAXSIZE / 4 / width) {
+            r->ok = FALSE;
+            break;
+        }
+        const guint8 *pixels = take(r, (gsize)width * height * 4);
+        if (!pixels) break;
+
+        Canvas *canvas = canvas_new(width, height, 0);
+        guint32 *band = g_new(guint32, (gsize)width * CANVAS_TILE_SIZE);
+        for (int y = 0; y < height; y += CANVAS_TILE_SIZE) {
+            cairo_rectangle_int_t rect = { 0, y, width, MIN(CANVAS_TILE_SIZE, height - y) };
+            gsize n = (gsize)width * rect.height;
+            memcpy(band, pixels + (gsize)width * y * 4, n * 4);
+            for (gsize i = 0; i < n; i++) band[i] = GUINT32_FROM_LE(band[i]);
+            canvas_write(canvas, &rect, (const guint8 *)band, width * 4);
+        }
+        g_free(band);
+        replace_canvas(rp, canvas);
+        break;
+    }
+    case REC_TOOL:
+        rp->tool = get_byte(r);
+        break;
+    case REC_REDACT_MODE:
+        rp->redact_mode = get_byte(r);
+        break;
+    case REC_STYLE:
+        rp->style.red = get_double(r);
+        rp->style.green = get_double(r);
+        rp->style.blue = get_double(r);
+        rp->style.alpha = get_double(r);
+        rp->style.size = get_double(r);
+        break;
+    case REC_ZOOM:
+        /* Only changes the view. */
+        get_double(r);
+        break;
+    case REC_PRESS: {
+        double x = get_double(r), y = get_double(r), pressure = get_double(r);
+        rp->seed = get_u32(r);
+        rp->start_x = x;
+        rp->start_y = y;
+        rp->drawing = TRUE;
+        if (rp->tool == TOOL_PEN) {
+            rp->stroke = stroke_new();
+            stroke_add_point(rp->stroke, x, y, pressure);
+        }
+        break;
+    }
+    case REC_MOTION: {
+        double x = get_double(r), y = get_double(r), pressure = get_double(r);
+        if (rp->drawing && rp->stroke) stroke_add_point(rp->stroke, x, y, pressure);
+        break;
+    }
+    case REC_RELEASE: {
+        double x = get_double(r), y = get_double(r);
+        if (!rp->drawing) break;
+        rp->drawing = FALSE;
+
+        if (rp->tool == TOOL_PEN) {
+            add(rp, annotation_new_stroke(&rp->style, rp->stroke));
+            rp->stroke = NULL;
+        } else if (rp->tool == TOOL_REDACT) {
+            add(rp, annotation_new_redact(rp->start_x, rp->start_y, x, y,
+                                          rp->redact_mode, rp->seed));
+        } else {
+            add(rp, annotation_new_shape(rp->tool, &rp->style, rp->start_x, rp->start_y, x, y));
+        }
+        break;
+    }
+    case REC_CANCEL:
+        rp->drawing = FALSE;
+        stroke_free(rp->stroke);
+        rp->stroke = NULL;
+        break;
+    case REC_UNDO:
+        display_list_undo(rp->list, rp->canvas, &changed);
+        break;
+    case REC_REDO:
+        display_list_redo(rp->list, rp->canvas, &changed);
+        break;
+    default:
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "unknown record type %d", type);
+        return FALSE;
+    }
+
+    if (!r->ok) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "truncated %s record",
+                    record_names[type]);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int replay_main(int argc, char **argv) {
+    if (argc != 2) {
+        g_printerr("Usage: crayons --replay FILE\n");
+        return EXIT_FAILURE;
+    }
+
+    char *contents;
+    gsize length;
+    GError *error = NULL;
+    if (!g_file_get_contents(argv[1], &contents, &length, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+
+    Reader r = { (const guint8 *)contents, (const guint8 *)contents + length, TRUE };
+    const guint8 *magic = take(&r, strlen(RECORD_MAGIC));
+    if (!magic || memcmp(magic, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0) {
+        g_printerr("%s is not a Crayons recording\n", argv[1]);
+        g_free(contents);
+        return EXIT_FAILURE;
+    }
+
+    Replay rp = { 0 };
+    rp.documents = g_hash_table_new_full(NULL, NULL, NULL,
+                                         (GDestroyNotify)replay_document_free);
+    rp.style = (ShapeStyle){ 0, 0, 0, 1, 3.0 };
+    gint64 spent[N_RECORD_TYPES] = { 0 };
+    int counts[N_RECORD_TYPES] = { 0 };
+    guint64 recorded_us = 0;
+    char *expected = NULL;
+    int status = EXIT_SUCCESS;
+
+    gint64 start = g_get_monotonic_time();
+    while (r.p < r.end) {
+        RecordType type = get_byte(&r);
+        recorded_us += get_varint(&r);
+        if (type == REC_END) {
+            expected = get_string(&r);
+            break;
+        }
+        if (type <= 0 || type >= N_RECORD_TYPES) type = N_RECORD_TYPES;
+
+        gint64 t0 = g_get_monotonic_time();
+        if (type == N_RECORD_TYPES || !apply(&rp, type, &r, &error)) {
+            g_printerr("%s: %s\n", argv[1], error ? error->message : "corrupt record");
+            g_clear_error(&error);
+            status = EXIT_FAILURE;
+            break;
+        }
+        spent[type] += g_get_monotonic_time() - t0;
+        counts[type]++;
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    if (status == EXIT_SUCCESS) {
+        g_print("Replayed %.2f s of input in %.1f ms\n", recorded_us / 1e6, elapsed / 1e3);
+        for (int i = 1; i < N_RECORD_TYPES; i++) {
+            if (!counts[i]) continue;
+            g_print("  %-8s %7d  %9.1f ms  %7.1f us each\n", record_names[i], counts[i],
+                    spent[i] / 1e3, (double)spent[i] / counts[i]);
+        }
+
+        char *checksum = rp.canvas ? canvas_checksum(rp.canvas) : NULL;
+        if (!expected) {
+            g_print("No recorded checksum; canvas is %s\n", checksum ? checksum : "empty");
+        } else if (g_strcmp0(checksum, expected) == 0) {
+            g_print("Canvas matches the recording (%s)\n", checksum);
+        } else {
+            g_printerr("Canvas %s differs from the recorded %s\n",
+                       checksum ? checksum : "(none)", expected);
+            status = EXIT_FAILURE;
+        }
+        g_free(checksum);
+    }
+
+    g_free(expected);
+    stroke_free(rp.stroke);
+    display_list_free(rp.list);
+    canvas_free(rp.canvas);
+    g_hash_table_destroy(rp.documents);
+    g_free(contents);
+    return status;
+}
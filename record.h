@@ -0,0 +1,58 @@
+#ifndef CRAYONS_RECORD_H
+#define CRAYONS_RECORD_H
+
+#include "shapes.h"
+
+/*
+ * Input recording and headless replay.
+ *
+ * Running the editor with CRAYONS_RECORD=FILE logs every input that
+ * reaches the canvas, in canvas coordinates and with the time since the
+ * previous one: tab switches, new, loaded and pasted images, tool, redact
+ * mode, colour, size and zoom changes, presses with their redact seed,
+ * motion, releases, cancels, undo and redo.
+ * On exit the final canvas checksum is appended.
+ *
+ *     crayons --replay FILE
+ *
+ * feeds the inputs through the same annotation code without a display and
+ * as fast as possible, prints the total and per-input time, and fails if the
+ * resulting canvas does not match the recorded checksum.
+ *
+ * The file is RECORD_MAGIC followed by records of a type byte, the delay in
+ * microseconds as a LEB128 varint and a little-endian payload. Coordinates
+ * are stored as doubles, exactly as the editor used them.
+ *
+ * With several images open, each switch to another tab records the
+ * document's number, and every other input goes to the document switched
+ * to last. New, loaded and pasted images replace that document's canvas;
+ * pasted ones are stored whole, since the clipboard is gone by replay.
+ */
+
+#define RECORD_MAGIC "CRAYREC1"
+
+/* Reads CRAYONS_RECORD. */
+void record_init(void);
+
+void record_switch(int document);
+void record_new(int width, int height);
+void record_load(const char *filename);
+void record_paste(const Canvas *canvas);
+void record_tool(ToolType tool);
+void record_redact_mode(RedactMode mode);
+void record_style(const ShapeStyle *style);
+void record_zoom(double zoom);
+void record_press(double x, double y, double pressure, guint32 seed);
+void record_motion(double x, double y, double pressure);
+void record_release(double x, double y);
+void record_cancel(void);
+void record_undo(void);
+void record_redo(void);
+
+/* Appends canvas's checksum and closes the file. */
+void record_finish(const Canvas *canvas);
+
+/* argv[0] is "--replay". Returns the process exit status. */
+int replay_main(int argc, char **argv);
+
+#endif
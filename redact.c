@@ -0,0 +1,724 @@
+#include "redact.h"
+#include "parallel.h"
+
+#include <string.h>
+
+#define MAX_PASSES 32
+
+/* Largest window, in multiples of out, that redact_render() copies. */
+#define WINDOW_MAX_RATIO 4
+
+typedef struct {
+    const Canvas *src;
+    int src_width, src_height;
+    guint8 *dst;
+    int dst_stride;
+    cairo_rectangle_int_t out;
+    cairo_rectangle_int_t active;
+    guint32 seed;
+    int passes;
+
+    /* Pixels chains can end on, or NULL to read them from src. */
+    guint32 *window;
+    cairo_rectangle_int_t window_rect;
+} RedactJob;
+
+/* Chains are walked LANES pixels at a time in lockstep, using GCC vector
+ * extensions. Without AVX2 the compiler lowers them to SSE2 or scalar code;
+ * redact_rows() is additionally cloned for AVX2 and picked at load time. */
+#define LANES 8
+
+typedef gint32 vint __attribute__((vector_size(LANES * 4)));
+typedef guint32 vuint __attribute__((vector_size(LANES * 4)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL_CLONES
+#endif
+
+/* Everything below is inlined into redact_rows(), so the vector calling
+ * convention never crosses a real call. */
+#pragma GCC diagnostic ignored "-Wpsabi"
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+/* lowbias32 over the pixel coordinates, keyed by seed and pass. */
+KERNEL_INLINE vuint redact_hash(guint32 seed, guint32 pass, vint x, vint y) {
+    vuint h = ((vuint)x * 0x9E3779B1u) ^ ((vuint)y * 0x85EBCA77u) ^ (seed + pass * 0xC2B2AE3Du);
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Maps a 6 bit field of h onto [0, range). */
+#define FIELD(h, shift, range) ((vint)((((h) >> (shift)) & 0x3F) * (range) >> 6))
+
+/* Offsets cover [-5, 44] and channel jitter [-20, 19], like the original
+ * rand() based filter. */
+#define OFFSET_RANGE (REDACT_JITTER_REACH_BEFORE + REDACT_JITTER_REACH_AFTER + 1)
+#define OFFSET_X(h) (FIELD(h, 0, OFFSET_RANGE) - REDACT_JITTER_REACH_BEFORE)
+#define OFFSET_Y(h) (FIELD(h, 6, OFFSET_RANGE) - REDACT_JITTER_REACH_BEFORE)
+#define JITTER_B(h) (FIELD(h, 12, 40) - 20)
+#define JITTER_G(h) (FIELD(h, 18, 40) - 20)
+#define JITTER_R(h) (FIELD(h, 24, 40) - 20)
+
+/* Lane-wise select: mask lanes are all ones or all zeros. */
+KERNEL_INLINE vint select(vint mask, vint a, vint b) {
+    return (a & mask) | (b & ~mask);
+}
+
+KERNEL_INLINE vint clamp(vint v, vint lo, vint hi) {
+    v = select(v < lo, lo, v);
+    return select(v > hi, hi, v);
+}
+
+KERNEL_INLINE void redact_lanes(const RedactJob *job, int x, int y, guint32 *out, int n) {
+    const cairo_rectangle_int_t *a = &job->active;
+    const vint zero = { 0 };
+    const vint max_x = zero + (job->src_width - 1);
+    const vint max_y = zero + (job->src_height - 1);
+    const vint max_c = zero + 255;
+
+    vuint hashes[MAX_PASSES + 1];
+    vint px, py, depth;
+    vint live = zero - 1;
+
+    for (int l = 0; l < LANES; l++) px[l] = x + l;
+    py = zero + y;
+    depth = zero + job->passes + 1;
+
+    /* Walk every chain back from the last pass. A chain ends as soon as it
+     * leaves the active rectangle, since pixels outside it are never
+     * modified by any pass. */
+    for (int j = job->passes; j >= 1; j--) {
+        vuint h = redact_hash(job->seed, j, px, py);
+        vint nx = clamp(px + OFFSET_X(h), zero, max_x);
+        vint ny = clamp(py + OFFSET_Y(h), zero, max_y);
+
+        hashes[j] = h;
+        depth = select(live, zero + j, depth);
+        px = select(live, nx, px);
+        py = select(live, ny, py);
+        live &= (nx >= a->x) & (nx < a->x + a->width) & (ny >= a->y) & (ny < a->y + a->height);
+    }
+
+    /* Lanes past the end of the row start beyond out and can end beyond
+     * the window, so only the n lanes written are gathered. */
+    vuint pixel = { 0 };
+    if (job->window) {
+        const cairo_rectangle_int_t *w = &job->window_rect;
+        for (int l = 0; l < n; l++) {
+            pixel[l] = job->window[(size_t)(py[l] - w->y) * w->width + (px[l] - w->x)];
+        }
+    } else {
+        for (int l = 0; l < n; l++) pixel[l] = canvas_get_pixel(job->src, px[l], py[l]);
+    }
+    vint r = (vint)(pixel >> 16) & 0xFF;
+    vint g = (vint)(pixel >> 8) & 0xFF;
+    vint b = (vint)pixel & 0xFF;
+
+    /* Replay the channel jitter forward for the passes each chain saw. */
+    for (int j = 1; j <= job->passes; j++) {
+        vint on = depth <= j;
+        r = clamp(r + (JITTER_R(hashes[j]) & on), zero, max_c);
+        g = clamp(g + (JITTER_G(hashes[j]) & on), zero, max_c);
+        b = clamp(b + (JITTER_B(hashes[j]) & on), zero, max_c);
+    }
+
+    vuint pixels = (vuint)((r << 16) | (g << 8) | b) | 0xFF000000u;
+    memcpy(out, &pixels, (size_t)n * 4);
+}
+
+KERNEL_CLONES
+static void redact_rows(int y0, int y1, gpointer data) {
+    const RedactJob *job = data;
+    const int x0 = job->out.x;
+    const int x1 = job->out.x + job->out.width;
+
+    for (int y = y0; y < y1; y++) {
+        guint32 *row = (guint32 *)(job->dst + (size_t)(y - job->out.y) * job->dst_stride);
+        for (int x = x0; x < x1; x += LANES) {
+            redact_lanes(job, x, y, row + (x - x0), MIN(LANES, x1 - x));
+        }
+    }
+}
+
+static void window_rows(int y0, int y1, gpointer data) {
+    const RedactJob *job = data;
+    const cairo_rectangle_int_t *w = &job->window_rect;
+    cairo_rectangle_int_t r = { w->x, y0, w->width, y1 - y0 };
+
+    canvas_read(job->src, &r, (guint8 *)(job->window + (size_t)(y0 - w->y) * w->width),
+                w->width * 4);
+}
+
+/* Chains end on pixels at most passes steps from where they start and at
+ * most one step outside active, so this covers every pixel out needs. */
+static cairo_rectangle_int_t window_rect(const RedactJob *job) {
+    const cairo_rectangle_int_t *o = &job->out, *a = &job->active;
+    const int before = REDACT_JITTER_REACH_BEFORE, after = REDACT_JITTER_REACH_AFTER;
+
+    int x1 = MAX(MAX(o->x - before * job->passes, a->x - before), 0);
+    int y1 = MAX(MAX(o->y - before * job->passes, a->y - before), 0);
+    int x2 = MIN(MIN(o->x + o->width + after * job->passes, a->x + a->width + after), job->src_width);
+    int y2 = MIN(MIN(o->y + o->height + after * job->passes, a->y + a->height + after), job->src_height);
+    return (cairo_rectangle_int_t){ x1, y1, x2 - x1, y2 - y1 };
+}
+
+void redact_render(const Canvas *src, guint8 *dst, int dst_stride,
+                   const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                   guint32 seed, int passes) {
+    if (out->width <= 0 || out->height <= 0) return;
+
+    RedactJob job = {
+        .src = src,
+        .src_width = canvas_get_width(src), .src_height = canvas_get_height(src),
+        .dst = dst, .dst_stride = dst_stride,
+        .out = *out, .active = *active,
+        .seed = seed, .passes = CLAMP(passes, 1, MAX_PASSES),
+    };
+
+    /* Looking a pixel up in src costs a tile lookup, so gather from a copy
+     * of everything chains can reach instead, unless out is too thin for
+     * the copy to pay off, like the strips the preview exposes. */
+    job.window_rect = window_rect(&job);
+    gsize window_size = (gsize)job.window_rect.width * job.window_rect.height;
+    if (window_size <= WINDOW_MAX_RATIO * (gsize)out->width * out->height) {
+        job.window = g_new(guint32, window_size);
+        parallel_rows(job.window_rect.y, job.window_rect.y + job.window_rect.height,
+                      window_rows, &job);
+    }
+
+    parallel_rows(out->y, out->y + out->height, redact_rows, &job);
+    g_free(job.window);
+}
+
+/* Blur and pixelate work on whole pixels, one lane per channel. Channels
+ * are premultiplied, so plain means of them stay valid pixels. */
+typedef guint32 v4u __attribute__((vector_size(16)));
+typedef float v4f __attribute__((vector_size(16)));
+
+KERNEL_INLINE v4u unpack(guint32 pixel) {
+    const v4u shifts = { 0, 8, 16, 24 };
+    return ((v4u){ 0 } + pixel) >> shifts & 0xFF;
+}
+
+/* Rounds mean to the nearest pixel. */
+KERNEL_INLINE guint32 pack(v4f mean) {
+    v4u c = __builtin_convertvector(mean + 0.5f, v4u);
+    return c[0] | c[1] << 8 | c[2] << 16 | c[3] << 24;
+}
+
+/* Every box is summed separably with running sums: down each column as
+ * the rows advance, then along the row. Sums of at most (2 * radius + 1)^2
+ * channel values cannot overflow 32 bits. */
+typedef struct {
+    const Canvas *src;
+    guint8 *dst;
+    int dst_stride;
+    cairo_rectangle_int_t out;
+    cairo_rectangle_int_t area;     /* out grown by radius, within active */
+    int radius;
+    int radii[REDACT_BLUR_BOXES];   /* boxes grow evenly up to radius */
+} BlurJob;
+
+/* Blurs columns x0 to x1 of out, top to bottom. Only the area rows the
+ * largest box can reach are kept, in a ring. */
+KERNEL_CLONES
+static void blur_columns(int x0, int x1, gpointer data) {
+    const BlurJob *job = data;
+    const cairo_rectangle_int_t *area = &job->area;
+    const int h = area->height;
+    const int radius = job->radius;
+
+    /* Area columns the boxes of x0 to x1 reach, relative to the area. */
+    const int c0 = MAX(x0 - radius, area->x) - area->x;
+    const int c1 = MIN(x1 + radius, area->x + area->width) - area->x;
+    const int width = c1 - c0;
+    const int ring_rows = 2 * radius + 2;
+    guint32 *ring = g_new(guint32, (size_t)width * ring_rows);
+    v4u *columns = g_new0(v4u, (size_t)width * REDACT_BLUR_BOXES);
+    int loaded = 0;                 /* area rows read so far */
+
+    for (int y = job->out.y; y < job->out.y + job->out.height; y++) {
+        const int ly = y - area->y;
+        int height[REDACT_BLUR_BOXES];
+
+        /* Every row starts the boxes one lower: the row coming into each
+         * is added to its column sums and the one dropping out taken
+         * away. The first row sums the whole boxes. */
+        const int first = y == job->out.y;
+        int need = MIN(ly + radius + 1, h);
+        for (; loaded < need; loaded++) {
+            cairo_rectangle_int_t r = { area->x + c0, area->y + loaded, width, 1 };
+            canvas_read(job->src, &r, (guint8 *)(ring + (size_t)(loaded % ring_rows) * width),
+                        width * 4);
+        }
+        for (int k = 0; k < REDACT_BLUR_BOXES; k++) {
+            const int a = MAX(ly - job->radii[k], 0);
+            const int b = MIN(ly + job->radii[k] + 1, h);
+            v4u *sums = columns + (size_t)k * width;
+            height[k] = b - a;
+
+            if (first) {
+                for (int row = a; row < b; row++) {
+                    const guint32 *pixels = ring + (size_t)(row % ring_rows) * width;
+                    for (int x = 0; x < width; x++) sums[x] += unpack(pixels[x]);
+                }
+                continue;
+            }
+            if (ly + job->radii[k] < h) {
+                const guint32 *pixels = ring + (size_t)((b - 1) % ring_rows) * width;
+                for (int x = 0; x < width; x++) sums[x] += unpack(pixels[x]);
+            }
+            if (ly - job->radii[k] - 1 >= 0) {
+                const guint32 *pixels = ring + (size_t)((a - 1) % ring_rows) * width;
+                for (int x = 0; x < width; x++) sums[x] -= unpack(pixels[x]);
+            }
+        }
+
+        guint32 *out = (guint32 *)(job->dst + (size_t)(y - job->out.y) * job->dst_stride);
+        v4u box[REDACT_BLUR_BOXES];
+        for (int x = x0; x < x1; x++) {
+            const int lx = x - area->x;
+            v4f mean = { 0 };
+
+            /* Boxes are clipped to the area, which only cuts them at the
+             * edges of active; the rest of the area is at least a radius
+             * away from out. Along the row they slide one column at a
+             * time, like the column sums do down it. */
+            for (int k = 0; k < REDACT_BLUR_BOXES; k++) {
+                const int r = job->radii[k];
+                const v4u *sums = columns + (size_t)k * width;
+                const int a = MAX(lx - r, 0);
+                const int b = MIN(lx + r + 1, area->width);
+
+                if (x == x0) {
+                    box[k] = (v4u){ 0 };
+                    for (int i = a; i < b; i++) box[k] += sums[i - c0];
+                } else {
+                    if (lx + r < area->width) box[k] += sums[lx + r - c0];
+                    if (lx - r - 1 >= 0) box[k] -= sums[lx - r - 1 - c0];
+                }
+                mean += __builtin_convertvector(box[k], v4f) / (float)((b - a) * height[k]);
+            }
+            out[x - job->out.x] = pack(mean / (float)REDACT_BLUR_BOXES);
+        }
+    }
+
+    g_free(columns);
+    g_free(ring);
+}
+
+void redact_blur_render(const Canvas *src, guint8 *dst, int dst_stride,
+                        const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                        int radius) {
+    if (out->width <= 0 || out->height <= 0) return;
+
+    BlurJob job = {
+        .src = src,
+        .dst = dst, .dst_stride = dst_stride,
+        .out = *out,
+        .radius = MAX(radius, 1),
+    };
+    for (int k = 0; k < REDACT_BLUR_BOXES; k++) {
+        job.radii[k] = MAX(1, job.radius * (k + 1) / REDACT_BLUR_BOXES);
+    }
+    int x1 = MAX(out->x - job.radius, active->x);
+    int y1 = MAX(out->y - job.radius, active->y);
+    int x2 = MIN(out->x + out->width + job.radius, active->x + active->width);
+    int y2 = MIN(out->y + out->height + job.radius, active->y + active->height);
+    job.area = (cairo_rectangle_int_t){ x1, y1, x2 - x1, y2 - y1 };
+
+    /* Column sums run down the whole of out, so threads split it into
+     * columns rather than rows. */
+    parallel_rows(out->x, out->x + out->width, blur_columns, &job);
+}
+
+/* Blocks are REDACT_PIXELATE_SIZE squares from the top left corner of
+ * active, cut short at its far edges; area covers the blocks out touches. */
+typedef struct {
+    const Canvas *src;
+    guint8 *dst;
+    int dst_stride;
+    cairo_rectangle_int_t out;
+    cairo_rectangle_int_t area;
+    int size;
+    int blocks_x, blocks_y;
+    v4u *row_sums;                  /* per area row and block column */
+    guint32 *means;                 /* per block */
+} PixelateJob;
+
+KERNEL_CLONES
+static void pixelate_sum_rows(int y0, int y1, gpointer data) {
+    const PixelateJob *job = data;
+    guint32 *pixels = g_new(guint32, job->area.width);
+
+    for (int y = y0; y < y1; y++) {
+        cairo_rectangle_int_t r = { job->area.x, y, job->area.width, 1 };
+        canvas_read(job->src, &r, (guint8 *)pixels, job->area.width * 4);
+
+        v4u *sums = job->row_sums + (size_t)(y - job->area.y) * job->blocks_x;
+        for (int bx = 0; bx < job->blocks_x; bx++) {
+            int x2 = MIN((bx + 1) * job->size, job->area.width);
+            v4u sum = { 0 };
+            for (int x = bx * job->size; x < x2; x++) sum += unpack(pixels[x]);
+            sums[bx] = sum;
+        }
+    }
+    g_free(pixels);
+}
+
+static void pixelate_means(PixelateJob *job) {
+    for (int by = 0; by < job->blocks_y; by++) {
+        int y1 = by * job->size;
+        int y2 = MIN(y1 + job->size, job->area.height);
+        for (int bx = 0; bx < job->blocks_x; bx++) {
+            int width = MIN((bx + 1) * job->size, job->area.width) - bx * job->size;
+            v4u sum = { 0 };
+            for (int y = y1; y < y2; y++) sum += job->row_sums[(size_t)y * job->blocks_x + bx];
+            job->means[by * job->blocks_x + bx] =
+                pack(__builtin_convertvector(sum, v4f) / (float)(width * (y2 - y1)));
+        }
+    }
+}
+
+KERNEL_CLONES
+static void pixelate_rows(int y0, int y1, gpointer data) {
+    const PixelateJob *job = data;
+
+    for (int y = y0; y < y1; y++) {
+        guint32 *out = (guint32 *)(job->dst + (size_t)(y - job->out.y) * job->dst_stride);
+        const guint32 *means = job->means + (y - job->area.y) / job->size * job->blocks_x;
+        for (int x = job->out.x; x < job->out.x + job->out.width; x++) {
+            out[x - job->out.x] = means[(x - job->area.x) / job->size];
+        }
+    }
+}
+
+void redact_pixelate_render(const Canvas *src, guint8 *dst, int dst_stride,
+                            const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                            int size) {
+    if (out->width <= 0 || out->height <= 0) return;
+
+    size = MAX(size, 1);
+    int x1 = active->x + (out->x - active->x) / size * size;
+    int y1 = active->y + (out->y - active->y) / size * size;
+    int x2 = MIN(active->x + ((out->x + out->width - active->x + size - 1) / size) * size,
+                 active->x + active->width);
+    int y2 = MIN(active->y + ((out->y + out->height - active->y + size - 1) / size) * size,
+                 active->y + active->height);
+
+    PixelateJob job = {
+        .src = src,
+        .dst = dst, .dst_stride = dst_stride,
+        .out = *out,
+        .area = { x1, y1, x2 - x1, y2 - y1 },
+        .size = size,
+        .blocks_x = (x2 - x1 + size - 1) / size,
+        .blocks_y = (y2 - y1 + size - 1) / size,
+    };
+    job.row_sums = g_new(v4u, (size_t)job.area.height * job.blocks_x);
+    job.means = g_new(guint32, (size_t)job.blocks_y * job.blocks_x);
+
+    parallel_rows(y1, y2, pixelate_sum_rows, &job);
+    pixelate_means(&job);
+    parallel_rows(out->y, out->y + out->height, pixelate_rows, &job);
+
+    g_free(job.means);
+    g_free(job.row_sums);
+}
+
+static void render_mode(const Canvas *src, guint8 *dst, int dst_stride,
+                        const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                        RedactMode mode, guint32 seed) {
+    switch (mode) {
+    case REDACT_JITTER:
+        redact_render(src, dst, dst_stride, out, active, seed, REDACT_PASSES);
+        break;
+    case REDACT_BLUR:
+        redact_blur_render(src, dst, dst_stride, out, active, REDACT_BLUR_RADIUS);
+        break;
+    case REDACT_PIXELATE:
+        redact_pixelate_render(src, dst, dst_stride, out, active, REDACT_PIXELATE_SIZE);
+        break;
+    }
+}
+
+void redact_apply(Canvas *canvas, const cairo_rectangle_int_t *rect,
+                  RedactMode mode, guint32 seed) {
+    int w = canvas_get_width(canvas);
+    int h = canvas_get_height(canvas);
+
+    cairo_rectangle_int_t r = *rect;
+    int x2 = MIN(r.x + r.width, w);
+    int y2 = MIN(r.y + r.height, h);
+    r.x = MAX(r.x, 0);
+    r.y = MAX(r.y, 0);
+    r.width = x2 - r.x;
+    r.height = y2 - r.y;
+    if (r.width <= 0 || r.height <= 0) return;
+
+    /* Filters read the untouched image, so they render from a snapshot,
+     * which costs no pixel copies, and the result goes back a band at a
+     * time. Bands start at the top of rect, so pixelate blocks never
+     * straddle two of them. */
+    G_STATIC_ASSERT(CANVAS_TILE_SIZE % REDACT_PIXELATE_SIZE == 0);
+    Canvas *src = canvas_snapshot(canvas);
+    int stride = r.width * 4;
+    guint8 *band = g_malloc((size_t)stride * MIN(r.height, CANVAS_TILE_SIZE));
+    for (int y = r.y; y < r.y + r.height; y += CANVAS_TILE_SIZE) {
+        cairo_rectangle_int_t out = { r.x, y, r.width, MIN(CANVAS_TILE_SIZE, r.y + r.height - y) };
+        render_mode(src, band, stride, &out, &r, mode, seed);
+        canvas_write(canvas, &out, band, stride);
+    }
+    g_free(band);
+    canvas_free(src);
+}
+
+/* Preview cache. While a jitter rectangle is dragged the preview renders
+ * with the whole canvas as the active area, so every pixel only depends on
+ * the seed and its position and stays valid as the rectangle changes. Only
+ * the strips a growing rectangle newly exposes need rendering. Blur and
+ * pixelate depend on the whole rectangle and go through preview_scratch
+ * instead, rendered from the top until the deadline and carried on by
+ * later frames for as long as the rectangle and visible part stay put. */
+
+/* Rows per thread rendered between deadline checks. */
+#define PREVIEW_BAND_ROWS 16
+
+static cairo_surface_t *preview_cache = NULL;
+static cairo_rectangle_int_t preview_area;     /* canvas area preview_cache covers */
+static cairo_region_t *preview_valid = NULL;   /* canvas area already rendered */
+static guint32 preview_seed = 0;
+static RedactMode preview_mode = REDACT_JITTER;
+static cairo_surface_t *preview_scratch = NULL;
+static cairo_rectangle_int_t preview_scratch_rect;     /* what preview_scratch is of */
+static cairo_rectangle_int_t preview_scratch_visible;
+static int preview_scratch_rows = 0;                   /* rendered from the top */
+
+void redact_preview_begin(RedactMode mode, guint32 seed) {
+    preview_mode = mode;
+    preview_seed = seed;
+    if (preview_valid) cairo_region_destroy(preview_valid);
+    preview_valid = cairo_region_create();
+    preview_scratch_rows = 0;
+}
+
+/* Makes preview_cache cover rect, keeping what is already rendered. The
+ * buffer grows with some slack so a steady drag does not reallocate on
+ * every frame. */
+static void preview_reserve(const cairo_rectangle_int_t *rect, int canvas_w, int canvas_h) {
+    if (preview_cache &&
+        rect->x >= preview_area.x && rect->y >= preview_area.y &&
+        rect->x + rect->width <= preview_area.x + preview_area.width &&
+        rect->y + rect->height <= preview_area.y + preview_area.height) {
+        return;
+    }
+
+    int slack_x = MAX(rect->width / 2, 128);
+    int slack_y = MAX(rect->height / 2, 128);
+    int x1 = rect->x - slack_x;
+    int y1 = rect->y - slack_y;
+    int x2 = rect->x + rect->width + slack_x;
+    int y2 = rect->y + rect->height + slack_y;
+    if (preview_cache) {
+        x1 = MIN(x1, preview_area.x);
+        y1 = MIN(y1, preview_area.y);
+        x2 = MAX(x2, preview_area.x + preview_area.width);
+        y2 = MAX(y2, preview_area.y + preview_area.height);
+    }
+
+    cairo_rectangle_int_t area;
+    area.x = MAX(x1, 0);
+    area.y = MAX(y1, 0);
+    area.width = MIN(x2, canvas_w) - area.x;
+    area.height = MIN(y2, canvas_h) - area.y;
+
+    cairo_surface_t *cache = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, area.width, area.height);
+
+    if (preview_cache) {
+        guint8 *src = cairo_image_surface_get_data(preview_cache);
+        int src_stride = cairo_image_surface_get_stride(preview_cache);
+        guint8 *dst = cairo_image_surface_get_data(cache);
+        int dst_stride = cairo_image_surface_get_stride(cache);
+
+        cairo_region_intersect_rectangle(preview_valid, &preview_area);
+        for (int i = 0; i < cairo_region_num_rectangles(preview_valid); i++) {
+            cairo_rectangle_int_t r;
+            cairo_region_get_rectangle(preview_valid, i, &r);
+            for (int y = r.y; y < r.y + r.height; y++) {
+                memcpy(dst + (size_t)(y - area.y) * dst_stride + (size_t)(r.x - area.x) * 4,
+                       src + (size_t)(y - preview_area.y) * src_stride + (size_t)(r.x - preview_area.x) * 4,
+                       (size_t)r.width * 4);
+            }
+        }
+        cairo_surface_destroy(preview_cache);
+    } else {
+        cairo_region_destroy(preview_valid);
+        preview_valid = cairo_region_create();
+    }
+
+    preview_cache = cache;
+    preview_area = area;
+}
+
+static gboolean same_rect(const cairo_rectangle_int_t *a, const cairo_rectangle_int_t *b) {
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+/* Renders visible with all of rect as the active area, as redact_apply()
+ * would, band by band until deadline, and paints it. */
+static gboolean preview_draw_scratch(cairo_t *cr, const Canvas *src,
+                                     const cairo_rectangle_int_t *rect,
+                                     const cairo_rectangle_int_t *visible, gint64 deadline) {
+    if (!preview_scratch ||
+        cairo_image_surface_get_width(preview_scratch) < visible->width ||
+        cairo_image_surface_get_height(preview_scratch) < visible->height) {
+        int w = visible->width, h = visible->height;
+        if (preview_scratch) {
+            w = MAX(w, cairo_image_surface_get_width(preview_scratch));
+            h = MAX(h, cairo_image_surface_get_height(preview_scratch));
+            cairo_surface_destroy(preview_scratch);
+        }
+        preview_scratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+        preview_scratch_rows = 0;
+    }
+    if (!same_rect(rect, &preview_scratch_rect) || !same_rect(visible, &preview_scratch_visible)) {
+        preview_scratch_rect = *rect;
+        preview_scratch_visible = *visible;
+        preview_scratch_rows = 0;
+    }
+
+    /* Blur bands sum the rows around them again, so they are kept tall
+     * enough for that to stay a small part of the work. */
+    guint8 *data = cairo_image_surface_get_data(preview_scratch);
+    int stride = cairo_image_surface_get_stride(preview_scratch);
+    int band_rows = MAX(PREVIEW_BAND_ROWS * parallel_threads(), 4 * REDACT_BLUR_RADIUS);
+    gboolean rendered = FALSE;
+    cairo_surface_flush(preview_scratch);
+    while (preview_scratch_rows < visible->height) {
+        /* Always make some progress, even on a frame that is late. */
+        if (rendered && g_get_monotonic_time() > deadline) break;
+        rendered = TRUE;
+        cairo_rectangle_int_t band = {
+            visible->x, visible->y + preview_scratch_rows,
+            visible->width, MIN(band_rows, visible->height - preview_scratch_rows),
+        };
+        render_mode(src, data + (size_t)preview_scratch_rows * stride, stride, &band, rect,
+                    preview_mode, preview_seed);
+        preview_scratch_rows += band.height;
+    }
+    cairo_surface_mark_dirty(preview_scratch);
+
+    cairo_save(cr);
+    cairo_rectangle(cr, visible->x, visible->y, visible->width, preview_scratch_rows);
+    cairo_set_source_surface(cr, preview_scratch, visible->x, visible->y);
+    cairo_fill(cr);
+
+    /* Rows not rendered yet are greyed out until a later frame gets to
+     * them. */
+    gboolean complete = preview_scratch_rows == visible->height;
+    if (!complete) {
+        cairo_rectangle(cr, visible->x, visible->y + preview_scratch_rows, visible->width,
+                        visible->height - preview_scratch_rows);
+        cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 0.6);
+        cairo_fill(cr);
+    }
+    cairo_restore(cr);
+    return complete;
+}
+
+/* Paints the cached jitter preview of rect, rendering what is missing. */
+static gboolean preview_draw_cached(cairo_t *cr, const Canvas *src,
+                                    const cairo_rectangle_int_t *rect, gint64 deadline) {
+    if (!preview_valid) redact_preview_begin(preview_mode, preview_seed);
+
+    int w = canvas_get_width(src);
+    int h = canvas_get_height(src);
+    preview_reserve(rect, w, h);
+
+    guint8 *cache_data = cairo_image_surface_get_data(preview_cache);
+    int cache_stride = cairo_image_surface_get_stride(preview_cache);
+    const cairo_rectangle_int_t canvas = { 0, 0, w, h };
+
+    cairo_region_t *missing = cairo_region_create_rectangle(rect);
+    cairo_region_subtract(missing, preview_valid);
+
+    int band_rows = PREVIEW_BAND_ROWS * parallel_threads();
+    gboolean complete = TRUE;
+    gboolean rendered = FALSE;
+    for (int i = 0; i < cairo_region_num_rectangles(missing) && complete; i++) {
+        cairo_rectangle_int_t r;
+        cairo_region_get_rectangle(missing, i, &r);
+
+        for (int y = r.y; y < r.y + r.height; y += band_rows) {
+            /* Always make some progress, even on a frame that is late. */
+            if (rendered && g_get_monotonic_time() > deadline) {
+                complete = FALSE;
+                break;
+            }
+            rendered = TRUE;
+            cairo_rectangle_int_t band = { r.x, y, r.width, MIN(band_rows, r.y + r.height - y) };
+            redact_render(src,
+                          cache_data + (size_t)(band.y - preview_area.y) * cache_stride
+                                     + (size_t)(band.x - preview_area.x) * 4,
+                          cache_stride, &band, &canvas, preview_seed, REDACT_PASSES);
+            cairo_region_union_rectangle(preview_valid, &band);
+        }
+    }
+    cairo_region_destroy(missing);
+    cairo_surface_mark_dirty(preview_cache);
+
+    /* Rendered parts show the preview, the rest is greyed out until a later
+     * frame gets to it. */
+    cairo_region_t *shown = cairo_region_copy(preview_valid);
+    cairo_region_intersect_rectangle(shown, rect);
+
+    cairo_save(cr);
+    for (int i = 0; i < cairo_region_num_rectangles(shown); i++) {
+        cairo_rectangle_int_t r;
+        cairo_region_get_rectangle(shown, i, &r);
+        cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+    }
+    cairo_set_source_surface(cr, preview_cache, preview_area.x, preview_area.y);
+    cairo_fill(cr);
+
+    if (!complete) {
+        cairo_region_t *pending = cairo_region_create_rectangle(rect);
+        cairo_region_subtract(pending, shown);
+        for (int i = 0; i < cairo_region_num_rectangles(pending); i++) {
+            cairo_rectangle_int_t r;
+            cairo_region_get_rectangle(pending, i, &r);
+            cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+        }
+        cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 0.6);
+        cairo_fill(cr);
+        cairo_region_destroy(pending);
+    }
+    cairo_restore(cr);
+
+    cairo_region_destroy(shown);
+    return complete;
+}
+
+gboolean redact_preview_draw(cairo_t *cr, const Canvas *src,
+                             const cairo_rectangle_int_t *rect,
+                             const cairo_rectangle_int_t *visible, gint64 deadline) {
+    if (preview_mode == REDACT_JITTER) return preview_draw_cached(cr, src, visible, deadline);
+
+    return preview_draw_scratch(cr, src, rect, visible, deadline);
+}
+
+void redact_preview_reset(void) {
+    if (preview_cache) cairo_surface_destroy(preview_cache);
+    preview_cache = NULL;
+    if (preview_scratch) cairo_surface_destroy(preview_scratch);
+    preview_scratch = NULL;
+    preview_scratch_rows = 0;
+    if (preview_valid) cairo_region_destroy(preview_valid);
+    preview_valid = NULL;
+}
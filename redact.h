@@ -0,0 +1,96 @@
+#ifndef CRAYONS_REDACT_H
+#define CRAYONS_REDACT_H
+
+#include "canvas.h"
+
+/*
+ * Redaction filters.
+ *
+ * Jitter: every pass replaces each pixel inside the redacted rectangle with a
+ * randomly offset neighbour and nudges its colour channels. The random
+ * numbers come from a counter-based hash of (seed, pass, x, y), so the result
+ * only depends on the seed and not on how rows are split between threads.
+ * All passes are fused: each output pixel follows its chain of offsets back
+ * through the passes and reads the original image once.
+ *
+ * Blur: every pixel becomes the mean of REDACT_BLUR_BOXES nested boxes
+ * around it, the largest REDACT_BLUR_RADIUS pixels from the centre, which
+ * together approximate a Gaussian. Boxes are summed with running sums,
+ * down the columns and then along each row, so a pixel costs the same
+ * whatever the radius, and the only scratch memory is the 2 * radius + 2
+ * rows the largest box spans.
+ *
+ * Pixelate: the rectangle is cut into REDACT_PIXELATE_SIZE squares from
+ * its top left corner and each one is filled with its mean colour.
+ *
+ * Blur and pixelate only read pixels inside the redacted rectangle and
+ * need no seed. Every filter is vectorized and split across
+ * parallel_rows().
+ */
+
+typedef enum {
+    REDACT_JITTER,
+    REDACT_BLUR,
+    REDACT_PIXELATE
+} RedactMode;
+
+#define REDACT_PASSES 10
+
+/* Jitter offsets reach this far left of and above a pixel, and this far
+ * right of and below it. Chains stop at their first step outside the
+ * rectangle, so a redaction reads that much around it as well. */
+#define REDACT_JITTER_REACH_BEFORE 5
+#define REDACT_JITTER_REACH_AFTER 44
+#define REDACT_BLUR_RADIUS 24
+#define REDACT_BLUR_BOXES 3
+#define REDACT_PIXELATE_SIZE 16
+
+/* Renders the jittered pixels of out into dst. Passes only modify pixels
+ * inside active; out must lie within active. src is read-only and may be the
+ * canvas the result is later copied into. Unless out is much thinner than
+ * the area its chains reach, that area is copied out of src first. */
+void redact_render(const Canvas *src, guint8 *dst, int dst_stride,
+                   const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                   guint32 seed, int passes);
+
+/* Render the blurred or pixelated pixels of out into dst, reading only
+ * pixels inside active, which out must lie within. */
+void redact_blur_render(const Canvas *src, guint8 *dst, int dst_stride,
+                        const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                        int radius);
+void redact_pixelate_render(const Canvas *src, guint8 *dst, int dst_stride,
+                            const cairo_rectangle_int_t *out, const cairo_rectangle_int_t *active,
+                            int size);
+
+/* Redacts rect of canvas in place; seed only matters for jitter. */
+void redact_apply(Canvas *canvas, const cairo_rectangle_int_t *rect,
+                  RedactMode mode, guint32 seed);
+
+/*
+ * Preview for a redact rectangle being dragged.
+ *
+ * For jitter, the preview treats the whole canvas as the active area, so it only differs
+ * from redact_apply() with the same seed near the rectangle's edges, where
+ * final chains stop at the border. Pixels stay cached across frames and
+ * drags reuse the buffer; growing the rectangle only renders the newly
+ * exposed strips. Blur and pixelate depend on the whole rectangle, so they
+ * are rendered exactly as they are applied, from the top, and a rectangle
+ * that changes starts over.
+ */
+
+/* Starts a new drag: forgets rendered pixels but keeps the buffer. */
+void redact_preview_begin(RedactMode mode, guint32 seed);
+
+/* Paints the preview of the visible part of rect from src into cr, which
+ * must be in canvas coordinates. Rendering stops at deadline
+ * (g_get_monotonic_time() units) and the unrendered part is drawn greyed
+ * out; returns FALSE in that case so the caller can schedule another
+ * frame. */
+gboolean redact_preview_draw(cairo_t *cr, const Canvas *src,
+                             const cairo_rectangle_int_t *rect,
+                             const cairo_rectangle_int_t *visible, gint64 deadline);
+
+/* Frees the preview buffer, e.g. when the canvas is replaced. */
+void redact_preview_reset(void);
+
+#endif
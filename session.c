@@ -0,0 +1,337 @@
+#include "session.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+/* Start of the file, in native byte order; it never leaves this machine. */
+typedef struct {
+    char magic[8];
+    gint32 width;
+    gint32 height;
+    guint32 fill;
+} SessionHeader;
+
+#define TILE_BYTES ((gsize)CANVAS_TILE_SIZE * CANVAS_TILE_SIZE * 4)
+
+struct _Session {
+    char *path;
+    int fd;
+    guint8 *map;
+    gsize map_size;
+    int width, height;
+    int tiles_x, tiles_y;
+    guint8 *written;            /* per tile, in the mapping */
+    gsize tiles_offset;         /* of tile (0, 0) in the mapping */
+
+    /* Bytes of the mapping changed since the last flush was started. */
+    gsize dirty_start, dirty_end;
+    guint flush_source;
+
+    /* Thread writing back [flush_offset, flush_offset + flush_length). */
+    GThread *flusher;
+    gint flush_done;
+    gsize flush_offset, flush_length;
+};
+
+static char *dir_path = NULL;       /* crayons/, while holding the lock */
+static int lock_fd = -1;            /* crayons/lock, held until exit */
+
+#define DIR_PREFIX "doc-"
+
+void session_init(void) {
+    const char *value = g_getenv("CRAYONS_SESSION");
+    if (!value || !*value) return;
+
+    char *dir = g_build_filename(g_get_user_cache_dir(), "crayons", NULL);
+    char *lock = g_build_filename(dir, "lock", NULL);
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_printerr("Could not create %s: %s\n", dir, g_strerror(errno));
+    } else if ((lock_fd = g_open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        g_printerr("Could not open %s: %s\n", lock, g_strerror(errno));
+    } else if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            g_printerr("Crash recovery is off, another crayons is using %s\n", dir);
+        } else {
+            g_printerr("Could not lock %s: %s\n", lock, g_strerror(errno));
+        }
+        close(lock_fd);
+        lock_fd = -1;
+    } else {
+        dir_path = g_strdup(dir);
+    }
+    g_free(lock);
+    g_free(dir);
+}
+
+char *session_new_dir(void) {
+    if (!dir_path) return NULL;
+
+    char *dir = g_build_filename(dir_path, DIR_PREFIX "XXXXXX", NULL);
+    if (!g_mkdtemp_full(dir, 0700)) {
+        g_printerr("Could not create %s: %s\n", dir, g_strerror(errno));
+        g_clear_pointer(&dir, g_free);
+    }
+    return dir;
+}
+
+char **session_list_dirs(void) {
+    if (!dir_path) return NULL;
+
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir) return NULL;
+
+    GPtrArray *dirs = g_ptr_array_new();
+    const char *name;
+    while ((name = g_dir_read_name(dir))) {
+        char *path = g_build_filename(dir_path, name, NULL);
+        if (g_str_has_prefix(name, DIR_PREFIX) && g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            g_ptr_array_add(dirs, path);
+        } else {
+            g_free(path);
+        }
+    }
+    g_dir_close(dir);
+
+    if (dirs->len == 0) {
+        g_ptr_array_free(dirs, TRUE);
+        return NULL;
+    }
+    g_ptr_array_add(dirs, NULL);
+    return (char **)g_ptr_array_free(dirs, FALSE);
+}
+
+void session_remove_dir(const char *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (!dir) return;
+
+    const char *name;
+    while ((name = g_dir_read_name(dir))) {
+        char *file = g_build_filename(path, name, NULL);
+        g_unlink(file);
+        g_free(file);
+    }
+    g_dir_close(dir);
+    g_rmdir(path);
+}
+
+static void wait_flush(Session *session) {
+    if (session->flusher) {
+        g_thread_join(session->flusher);
+        session->flusher = NULL;
+    }
+}
+
+static gpointer flush_thread(gpointer data) {
+    Session *session = data;
+    msync(session->map + session->flush_offset, session->flush_length, MS_SYNC);
+    g_atomic_int_set(&session->flush_done, 1);
+    return NULL;
+}
+
+static gboolean on_flush(gpointer data) {
+    Session *session = data;
+
+    /* Give a slow disk the time it needs rather than queueing up. */
+    if (session->flusher && !g_atomic_int_get(&session->flush_done)) return G_SOURCE_CONTINUE;
+    wait_flush(session);
+
+    gsize page = sysconf(_SC_PAGESIZE);
+    session->flush_offset = session->dirty_start / page * page;
+    session->flush_length = session->dirty_end - session->flush_offset;
+    session->dirty_start = session->map_size;
+    session->dirty_end = 0;
+
+    g_atomic_int_set(&session->flush_done, 0);
+    session->flusher = g_thread_new("session-flush", flush_thread, session);
+    session->flush_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void mark_dirty(Session *session, gsize start, gsize end) {
+    session->dirty_start = MIN(session->dirty_start, start);
+    session->dirty_end = MAX(session->dirty_end, end);
+    if (!session->flush_source) {
+        session->flush_source = g_timeout_add(SESSION_FLUSH_INTERVAL_MS, on_flush, session);
+    }
+}
+
+/* Tiles start after the header and the table of written tiles, on a
+ * SESSION_HEADER_SIZE boundary. */
+static gsize tiles_offset(int tiles_x, int tiles_y) {
+    gsize table_end = SESSION_HEADER_SIZE + (gsize)tiles_x * tiles_y;
+    return (table_end + SESSION_HEADER_SIZE - 1) / SESSION_HEADER_SIZE * SESSION_HEADER_SIZE;
+}
+
+/* Opens dir's session file and maps it for an image of the given size. If
+ * reset is set, the file is emptied and resized first, which leaves every
+ * tile a hole that takes no disk space. */
+static Session *map_file(const char *dir, int flags, int width, int height, gboolean reset) {
+    char *path = g_build_filename(dir, "session", NULL);
+    int fd = g_open(path, flags | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        if (reset) g_printerr("Could not write %s: %s\n", path, g_strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+
+    int tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    int tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    gsize offset = tiles_offset(tiles_x, tiles_y);
+    gsize size = offset + (gsize)tiles_x * tiles_y * TILE_BYTES;
+    void *data = MAP_FAILED;
+    if (reset && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+        g_printerr("Could not resize %s: %s\n", path, g_strerror(errno));
+    } else if ((data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        g_printerr("Could not map %s: %s\n", path, g_strerror(errno));
+    }
+    if (data == MAP_FAILED) {
+        close(fd);
+        g_free(path);
+        return NULL;
+    }
+
+    Session *session = g_new0(Session, 1);
+    session->path = path;
+    session->fd = fd;
+    session->map = data;
+    session->map_size = size;
+    session->width = width;
+    session->height = height;
+    session->tiles_x = tiles_x;
+    session->tiles_y = tiles_y;
+    session->written = session->map + SESSION_HEADER_SIZE;
+    session->tiles_offset = offset;
+    session->dirty_start = size;
+    return session;
+}
+
+/* Where the pixel at (x, y) of tile (tx, ty) is in the mapping. */
+static guint8 *tile_pixel(const Session *session, int tx, int ty, int x, int y) {
+    gsize tile = (gsize)ty * session->tiles_x + tx;
+    return session->map + session->tiles_offset + tile * TILE_BYTES +
+           ((gsize)(y % CANVAS_TILE_SIZE) * CANVAS_TILE_SIZE + x % CANVAS_TILE_SIZE) * 4;
+}
+
+Session *session_recover(const char *dir, Canvas **canvas) {
+    char *path = g_build_filename(dir, "session", NULL);
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    g_free(path);
+    if (fd < 0) return NULL;
+
+    SessionHeader header;
+    struct stat st;
+    gboolean valid = fstat(fd, &st) == 0 &&
+                     pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) == 0 &&
+                     header.width > 0 && header.height > 0;
+    close(fd);
+    if (!valid) return NULL;
+
+    Session *session = map_file(dir, O_RDWR, header.width, header.height, FALSE);
+    if (!session) return NULL;
+    if ((gsize)st.st_size != session->map_size) {
+        session_free(session);
+        return NULL;
+    }
+
+    /* Tiles never written stay unallocated, as they were. */
+    *canvas = canvas_new(header.width, header.height, header.fill);
+    for (int ty = 0; ty < session->tiles_y; ty++) {
+        for (int tx = 0; tx < session->tiles_x; tx++) {
+            if (!session->written[(gsize)ty * session->tiles_x + tx]) continue;
+            cairo_rectangle_int_t r = { tx * CANVAS_TILE_SIZE, ty * CANVAS_TILE_SIZE };
+            r.width = MIN(CANVAS_TILE_SIZE, header.width - r.x);
+            r.height = MIN(CANVAS_TILE_SIZE, header.height - r.y);
+            canvas_write(*canvas, &r, tile_pixel(session, tx, ty, 0, 0), CANVAS_TILE_SIZE * 4);
+        }
+    }
+    return session;
+}
+
+Session *session_new(const char *dir, const Canvas *canvas) {
+    if (!dir) return NULL;
+
+    int width = canvas_get_width(canvas);
+    int height = canvas_get_height(canvas);
+    Session *session = map_file(dir, O_RDWR | O_CREAT, width, height, TRUE);
+    if (!session) return NULL;
+
+    /* Only written tiles are copied. The magic goes in last, so a crash
+     * halfway leaves nothing to recover. */
+    SessionHeader *header = (SessionHeader *)session->map;
+    header->width = width;
+    header->height = height;
+    header->fill = canvas_get_fill(canvas);
+    cairo_rectangle_int_t all = { 0, 0, width, height };
+    session_update(session, canvas, &all);
+    memcpy(header->magic, SESSION_MAGIC, sizeof(header->magic));
+    mark_dirty(session, 0, sizeof(SessionHeader));
+    return session;
+}
+
+void session_update(Session *session, const Canvas *canvas, const cairo_rectangle_int_t *r) {
+    if (!session || r->width <= 0 || r->height <= 0) return;
+
+    int tx1 = r->x / CANVAS_TILE_SIZE, tx2 = (r->x + r->width - 1) / CANVAS_TILE_SIZE;
+    int ty1 = r->y / CANVAS_TILE_SIZE, ty2 = (r->y + r->height - 1) / CANVAS_TILE_SIZE;
+    for (int ty = ty1; ty <= ty2; ty++) {
+        for (int tx = tx1; tx <= tx2; tx++) {
+            gsize tile = (gsize)ty * session->tiles_x + tx;
+            gboolean allocated = canvas_peek_tile(canvas, tx, ty) != NULL;
+            if (!allocated && !session->written[tile]) continue;
+
+            /* A tile written for the first time is copied whole, since its
+             * slot is a hole or holds an older tile. One that reads as the
+             * fill again is only marked unwritten. */
+            cairo_rectangle_int_t t = { tx * CANVAS_TILE_SIZE, ty * CANVAS_TILE_SIZE };
+            t.width = MIN(CANVAS_TILE_SIZE, session->width - t.x);
+            t.height = MIN(CANVAS_TILE_SIZE, session->height - t.y);
+            if (allocated && session->written[tile]) {
+                int x2 = MIN(t.x + t.width, r->x + r->width);
+                int y2 = MIN(t.y + t.height, r->y + r->height);
+                t.x = MAX(t.x, r->x);
+                t.y = MAX(t.y, r->y);
+                t.width = x2 - t.x;
+                t.height = y2 - t.y;
+            }
+            if (allocated) {
+                guint8 *start = tile_pixel(session, tx, ty, t.x, t.y);
+                canvas_read(canvas, &t, start, CANVAS_TILE_SIZE * 4);
+                mark_dirty(session, start - session->map,
+                           tile_pixel(session, tx, ty, t.x + t.width - 1, t.y + t.height - 1) +
+                               4 - session->map);
+            }
+            session->written[tile] = allocated;
+            mark_dirty(session, SESSION_HEADER_SIZE + tile, SESSION_HEADER_SIZE + tile + 1);
+        }
+    }
+}
+
+void session_free(Session *session) {
+    if (!session) return;
+
+    if (session->flush_source) g_source_remove(session->flush_source);
+    wait_flush(session);
+    munmap(session->map, session->map_size);
+    close(session->fd);
+    g_unlink(session->path);
+    g_free(session->path);
+    g_free(session);
+}
+
+void session_close(void) {
+    if (!dir_path) return;
+
+    char **dirs = session_list_dirs();
+    for (int i = 0; dirs && dirs[i]; i++) session_remove_dir(dirs[i]);
+    g_strfreev(dirs);
+    g_clear_pointer(&dir_path, g_free);
+    close(lock_fd);
+    lock_fd = -1;
+}
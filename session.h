@@ -0,0 +1,80 @@
+#ifndef CRAYONS_SESSION_H
+#define CRAYONS_SESSION_H
+
+#include "canvas.h"
+
+/*
+ * Crash recovery through memory-mapped session files.
+ *
+ * Setting CRAYONS_SESSION to a non-empty value gives every open image a
+ * directory of its own under crayons/ in the user's cache directory, which
+ * also holds its journal (see journal.h). Its session file mirrors the
+ * image's canvas tile by tile: a SESSION_HEADER_SIZE header, a byte per
+ * tile saying whether it was ever written, and then a slot per tile of raw
+ * premultiplied ARGB32 pixels, CANVAS_TILE_SIZE pixels to a row. Only
+ * written tiles are copied in; the rest stay holes in a sparse file and
+ * read as the canvas fill, so a huge canvas that is mostly untouched costs
+ * neither copying nor disk space. The file is mapped shared so that every
+ * change is in the page cache as soon as it is copied in. The kernel pages
+ * the mapping like any file, and dirty pages are written back at most
+ * every SESSION_FLUSH_INTERVAL_MS from a helper thread, so drawing never
+ * waits on the disk. Switching images copies nothing; each file keeps
+ * mirroring its own canvas.
+ *
+ * The canvas keeps its own tiles, which it shares copy-on-write with its
+ * undo base and snapshots, so the mapping is a mirror rather than where
+ * the pixels live; its pages can be dropped by the kernel at any time.
+ *
+ * Closing an image removes its directory, and a clean exit all of them. A
+ * directory still there on the next start belongs to an image that was
+ * open when the editor crashed; its pixels are read straight from the
+ * mapping, with no decoding. Undo history is not part of the session.
+ *
+ * The files are only for one running editor at a time: the first one to
+ * start holds an flock() on crayons/lock until it exits, and any other
+ * keeps crash recovery off, so it neither recovers nor removes files that
+ * are still in use.
+ *
+ * Everything here belongs to the main thread. While crash recovery is off
+ * there are no directories, and a NULL session ignores every call.
+ */
+
+#define SESSION_MAGIC "CRAYSES2"
+#define SESSION_HEADER_SIZE 4096
+#define SESSION_FLUSH_INTERVAL_MS 2000
+
+typedef struct _Session Session;
+
+/* Reads CRAYONS_SESSION and takes the lock. */
+void session_init(void);
+
+/* A new, empty directory for an image's recovery files, or NULL while
+ * crash recovery is off. */
+char *session_new_dir(void);
+
+/* Directories left behind by a session that did not exit cleanly, or NULL
+ * if there are none. Must be called before session_new_dir(). */
+char **session_list_dirs(void);
+
+/* Removes dir and everything in it. */
+void session_remove_dir(const char *dir);
+
+/* Starts mirroring canvas into a session file in dir, copying its written
+ * tiles. Returns NULL if dir is NULL or the file cannot be written. */
+Session *session_new(const char *dir, const Canvas *canvas);
+
+/* Canvas left in dir's session file by a session that did not exit
+ * cleanly, or NULL. The file is kept and mirrors the returned canvas from
+ * then on. */
+Session *session_recover(const char *dir, Canvas **canvas);
+
+/* Copies r of the mirrored canvas into the file after it changed. */
+void session_update(Session *session, const Canvas *canvas, const cairo_rectangle_int_t *r);
+
+/* Unmaps and removes the file, e.g. when its image is closed. */
+void session_free(Session *session);
+
+/* Removes every directory and gives up the lock, e.g. on a clean exit. */
+void session_close(void);
+
+#endif
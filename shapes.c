@@ -0,0 +1,117 @@
+#include "shapes.h"
+
+#include <math.h>
+
+#include "redact.h"
+
+void draw_shape(cairo_t *cr, ToolType tool, const ShapeStyle *style,
+                double x1, double y1, double x2, double y2) {
+    cairo_set_source_rgba(cr, style->red, style->green, style->blue, style->alpha);
+    cairo_set_line_width(cr, style->size);
+
+    if (tool == TOOL_RECT) {
+        cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
+        cairo_stroke(cr);
+    } 
+    else if (tool == TOOL_ELLIPSE) {
+        cairo_save(cr);
+        cairo_translate(cr, x1 + (x2 - x1) / 2.0, y1 + (y2 - y1) / 2.0);
+        cairo_scale(cr, (x2 - x1) / 2.0, (y2 - y1) / 2.0);
+        cairo_arc(cr, 0, 0, 1.0, 0, 2 * M_PI);
+        cairo_restore(cr);
+        cairo_stroke(cr);
+    }
+    else if (tool == TOOL_ARROW) {
+        double angle = atan2(y2 - y1, x2 - x1);
+        double arrow_len = 15.0 + style->size; 
+        double arrow_angle = M_PI / 6.0;
+
+        cairo_move_to(cr, x1, y1);
+        cairo_line_to(cr, x2, y2);
+        cairo_stroke(cr);
+
+        cairo_move_to(cr, x2, y2);
+        cairo_line_to(cr, x2 - arrow_len * cos(angle - arrow_angle),
+                          y2 - arrow_len * sin(angle - arrow_angle));
+        cairo_move_to(cr, x2, y2);
+        cairo_line_to(cr, x2 - arrow_len * cos(angle + arrow_angle),
+                          y2 - arrow_len * sin(angle + arrow_angle));
+        cairo_stroke(cr);
+    }
+}
+
+void shape_bounds(ToolType tool, const ShapeStyle *style,
+                  double x1, double y1, double x2, double y2,
+                  double *bx1, double *by1, double *bx2, double *by2) {
+    double pad = 0;
+
+    if (tool == TOOL_RECT || tool == TOOL_ELLIPSE) {
+        pad = style->size + 1;
+    } else if (tool == TOOL_ARROW) {
+        pad = 15.0 + 2 * style->size + 1;
+    }
+
+    *bx1 = fmin(x1, x2) - pad;
+    *by1 = fmin(y1, y2) - pad;
+    *bx2 = fmax(x1, x2) + pad;
+    *by2 = fmax(y1, y2) + pad;
+}
+
+void draw_stroke(cairo_t *cr, const ShapeStyle *style, const double *points, int n_points) {
+    if (n_points < 1) return;
+
+    cairo_set_source_rgba(cr, style->red, style->green, style->blue, style->alpha);
+    cairo_set_line_width(cr, style->size);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+
+    cairo_move_to(cr, points[0], points[1]);
+    for (int i = 1; i < n_points; i++) {
+        cairo_line_to(cr, points[2 * i], points[2 * i + 1]);
+    }
+    cairo_stroke(cr);
+}
+
+void stroke_bounds(const ShapeStyle *style, const double *points, int n_points,
+                   double *bx1, double *by1, double *bx2, double *by2) {
+    double pad = style->size / 2.0 + 1;
+
+    *bx1 = *by1 = INFINITY;
+    *bx2 = *by2 = -INFINITY;
+    for (int i = 0; i < n_points; i++) {
+        *bx1 = fmin(*bx1, points[2 * i] - pad);
+        *by1 = fmin(*by1, points[2 * i + 1] - pad);
+        *bx2 = fmax(*bx2, points[2 * i] + pad);
+        *by2 = fmax(*by2, points[2 * i + 1] + pad);
+    }
+}
+
+gboolean redact_rect(const Canvas *target, double sx, double sy, double ex, double ey,
+                     cairo_rectangle_int_t *r) {
+    int x1 = (int)fmin(sx, ex);
+    int y1 = (int)fmin(sy, ey);
+    int x2 = (int)fmax(sx, ex);
+    int y2 = (int)fmax(sy, ey);
+
+    int w = canvas_get_width(target);
+    int h = canvas_get_height(target);
+
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > w) x2 = w;
+    if (y2 > h) y2 = h;
+
+    r->x = x1;
+    r->y = y1;
+    r->width = x2 - x1;
+    r->height = y2 - y1;
+    return r->width > 0 && r->height > 0;
+}
+
+void apply_redact(Canvas *target, double sx, double sy, double ex, double ey,
+                  RedactMode mode, guint32 seed) {
+    cairo_rectangle_int_t r;
+    if (redact_rect(target, sx, sy, ex, ey, &r)) {
+        redact_apply(target, &r, mode, seed);
+    }
+}
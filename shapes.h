@@ -0,0 +1,50 @@
+#ifndef CRAYONS_SHAPES_H
+#define CRAYONS_SHAPES_H
+
+#include "canvas.h"
+#include "redact.h"
+
+/*
+ * Annotation shapes, shared by the editor and batch mode.
+ *
+ * Nothing here touches GTK or global state, so shapes can be drawn into
+ * different canvases from several threads at once.
+ */
+
+typedef enum {
+    TOOL_PEN,
+    TOOL_RECT,
+    TOOL_ELLIPSE,
+    TOOL_ARROW,
+    TOOL_REDACT
+} ToolType;
+
+typedef struct {
+    double red, green, blue, alpha;
+    double size;                /* line width in canvas pixels */
+} ShapeStyle;
+
+/* Strokes a rectangle, ellipse or arrow dragged from (x1, y1) to (x2, y2).
+ * Pen and redact have their own functions below. */
+void draw_shape(cairo_t *cr, ToolType tool, const ShapeStyle *style,
+                double x1, double y1, double x2, double y2);
+
+/* Conservative canvas-space bounds of everything draw_shape() may touch. */
+void shape_bounds(ToolType tool, const ShapeStyle *style,
+                  double x1, double y1, double x2, double y2,
+                  double *bx1, double *by1, double *bx2, double *by2);
+
+/* Strokes a pen line through n_points (x, y) pairs. */
+void draw_stroke(cairo_t *cr, const ShapeStyle *style, const double *points, int n_points);
+
+void stroke_bounds(const ShapeStyle *style, const double *points, int n_points,
+                   double *bx1, double *by1, double *bx2, double *by2);
+
+/* Integer rectangle covered by a redact drag, clipped to target. */
+gboolean redact_rect(const Canvas *target, double sx, double sy, double ex, double ey,
+                     cairo_rectangle_int_t *r);
+
+void apply_redact(Canvas *target, double sx, double sy, double ex, double ey,
+                  RedactMode mode, guint32 seed);
+
+#endif
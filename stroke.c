@@ -0,0 +1,239 @@
+#include "stroke.h"
+
+#include <math.h>
+
+/* Pressure is simplified like a third coordinate with its own tolerance. */
+#define PRESSURE_TOLERANCE 0.05
+
+/* Light touches still leave a visible line. */
+#define MIN_PRESSURE 0.2
+
+/* Longest resampled segment along the spline, in canvas pixels. */
+#define SPLINE_STEP 4.0
+#define MAX_SPLINE_STEPS 32
+
+typedef struct {
+    double x, y, pressure;
+} StrokePoint;
+
+struct _Stroke {
+    GArray *points;             /* StrokePoint, simplified once finished */
+    GArray *outline;            /* StrokePoint along the spline, NULL until finished */
+};
+
+Stroke *stroke_new(void) {
+    Stroke *stroke = g_new0(Stroke, 1);
+    stroke->points = g_array_new(FALSE, FALSE, sizeof(StrokePoint));
+    return stroke;
+}
+
+void stroke_free(Stroke *stroke) {
+    if (!stroke) return;
+
+    g_array_free(stroke->points, TRUE);
+    if (stroke->outline) g_array_free(stroke->outline, TRUE);
+    g_free(stroke);
+}
+
+void stroke_add_point(Stroke *stroke, double x, double y, double pressure) {
+    g_return_if_fail(!stroke->outline);
+
+    StrokePoint p = { x, y, CLAMP(pressure, 0, 1) };
+    if (stroke->points->len > 0) {
+        const StrokePoint *last = &g_array_index(stroke->points, StrokePoint, stroke->points->len - 1);
+        if (last->x == p.x && last->y == p.y && last->pressure == p.pressure) return;
+    }
+    g_array_append_val(stroke->points, p);
+}
+
+int stroke_get_n_points(const Stroke *stroke) {
+    return stroke->points->len;
+}
+
+void stroke_get_point(const Stroke *stroke, int i, double *x, double *y, double *pressure) {
+    const StrokePoint *p = &g_array_index(stroke->points, StrokePoint, i);
+    *x = p->x;
+    *y = p->y;
+    *pressure = p->pressure;
+}
+
+gsize stroke_get_size(const Stroke *stroke) {
+    gsize points = stroke->points->len + (stroke->outline ? stroke->outline->len : 0);
+    return sizeof(Stroke) + points * sizeof(StrokePoint);
+}
+
+/* What stroke_fill() draws through. */
+static const GArray *drawn_points(const Stroke *stroke) {
+    return stroke->outline ? stroke->outline : stroke->points;
+}
+
+/* How far p strays from the segment a-b, in units of the tolerances. */
+static double simplify_error(const StrokePoint *a, const StrokePoint *b, const StrokePoint *p) {
+    double dx = b->x - a->x, dy = b->y - a->y;
+    double len2 = dx * dx + dy * dy;
+    double t = len2 > 0 ? CLAMP(((p->x - a->x) * dx + (p->y - a->y) * dy) / len2, 0, 1) : 0;
+
+    double dist = hypot(p->x - (a->x + t * dx), p->y - (a->y + t * dy));
+    double dp = fabs(p->pressure - (a->pressure + t * (b->pressure - a->pressure)));
+    return fmax(dist / STROKE_TOLERANCE, dp / PRESSURE_TOLERANCE);
+}
+
+/* Ramer-Douglas-Peucker with an explicit stack, since a long stroke may
+ * need thousands of levels. */
+static GArray *simplify(const GArray *in) {
+    int n = in->len;
+    const StrokePoint *p = (const StrokePoint *)in->data;
+    gboolean *keep = g_new0(gboolean, n);
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(int));
+
+    keep[0] = keep[n - 1] = TRUE;
+    int range[2] = { 0, n - 1 };
+    g_array_append_vals(stack, range, 2);
+
+    while (stack->len > 0) {
+        int first = g_array_index(stack, int, stack->len - 2);
+        int last = g_array_index(stack, int, stack->len - 1);
+        g_array_set_size(stack, stack->len - 2);
+
+        int worst = -1;
+        double worst_error = 1;
+        for (int i = first + 1; i < last; i++) {
+            double error = simplify_error(&p[first], &p[last], &p[i]);
+            if (error > worst_error) {
+                worst = i;
+                worst_error = error;
+            }
+        }
+        if (worst < 0) continue;
+
+        keep[worst] = TRUE;
+        int left[2] = { first, worst };
+        int right[2] = { worst, last };
+        g_array_append_vals(stack, left, 2);
+        g_array_append_vals(stack, right, 2);
+    }
+
+    GArray *out = g_array_new(FALSE, FALSE, sizeof(StrokePoint));
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) g_array_append_val(out, p[i]);
+    }
+    g_array_free(stack, TRUE);
+    g_free(keep);
+    return out;
+}
+
+static double catmull_rom(double p0, double p1, double p2, double p3, double t) {
+    return 0.5 * (2 * p1 + (p2 - p0) * t + (2 * p0 - 5 * p1 + 4 * p2 - p3) * t * t
+                  + (3 * p1 - p0 - 3 * p2 + p3) * t * t * t);
+}
+
+static void finish(Stroke *stroke, gboolean simplified) {
+    if (stroke->outline) return;
+    if (stroke->points->len < 3) {
+        stroke->outline = g_array_copy(stroke->points);
+        return;
+    }
+
+    GArray *key = stroke->points;
+    if (!simplified) {
+        key = simplify(stroke->points);
+        g_array_free(stroke->points, TRUE);
+        stroke->points = key;
+    }
+    const StrokePoint *q = (const StrokePoint *)key->data;
+    int m = key->len;
+
+    GArray *out = g_array_new(FALSE, FALSE, sizeof(StrokePoint));
+    g_array_append_val(out, q[0]);
+
+    for (int i = 0; i + 1 < m; i++) {
+        const StrokePoint *p0 = &q[MAX(i - 1, 0)];
+        const StrokePoint *p1 = &q[i];
+        const StrokePoint *p2 = &q[i + 1];
+        const StrokePoint *p3 = &q[MIN(i + 2, m - 1)];
+        int steps = CLAMP((int)ceil(hypot(p2->x - p1->x, p2->y - p1->y) / SPLINE_STEP),
+                          1, MAX_SPLINE_STEPS);
+
+        for (int s = 1; s <= steps; s++) {
+            double t = (double)s / steps;
+            StrokePoint p = {
+                catmull_rom(p0->x, p1->x, p2->x, p3->x, t),
+                catmull_rom(p0->y, p1->y, p2->y, p3->y, t),
+                p1->pressure + t * (p2->pressure - p1->pressure),
+            };
+            g_array_append_val(out, p);
+        }
+    }
+
+    stroke->outline = out;
+}
+
+void stroke_finish(Stroke *stroke) {
+    finish(stroke, FALSE);
+}
+
+void stroke_finish_simplified(Stroke *stroke) {
+    finish(stroke, TRUE);
+}
+
+static double point_radius(const StrokePoint *p, const ShapeStyle *style) {
+    return style->size / 2.0 * MAX(p->pressure, MIN_PRESSURE);
+}
+
+/* Adds the convex hull of the circles around a and b as one closed subpath.
+ * Every subpath winds the same way, so the nonzero rule fills their union. */
+static void add_capsule(cairo_t *cr, const StrokePoint *a, double ra,
+                        const StrokePoint *b, double rb) {
+    double dx = b->x - a->x, dy = b->y - a->y;
+    double len = hypot(dx, dy);
+
+    cairo_new_sub_path(cr);
+    if (len <= fabs(ra - rb)) {
+        /* One circle holds the other. */
+        const StrokePoint *c = ra > rb ? a : b;
+        cairo_arc(cr, c->x, c->y, MAX(ra, rb), 0, 2 * M_PI);
+        cairo_close_path(cr);
+        return;
+    }
+
+    /* The outer tangents touch both circles at this angle from the axis. */
+    double angle = atan2(dy, dx);
+    double spread = acos((ra - rb) / len);
+    cairo_arc(cr, b->x, b->y, rb, angle - spread, angle + spread);
+    cairo_arc(cr, a->x, a->y, ra, angle + spread, angle - spread + 2 * M_PI);
+    cairo_close_path(cr);
+}
+
+void stroke_fill(cairo_t *cr, const Stroke *stroke, const ShapeStyle *style) {
+    const GArray *points = drawn_points(stroke);
+    const StrokePoint *p = (const StrokePoint *)points->data;
+    int n = points->len;
+    if (n < 1) return;
+
+    cairo_new_path(cr);
+    if (n == 1) {
+        add_capsule(cr, &p[0], point_radius(&p[0], style), &p[0], point_radius(&p[0], style));
+    }
+    for (int i = 0; i + 1 < n; i++) {
+        add_capsule(cr, &p[i], point_radius(&p[i], style), &p[i + 1], point_radius(&p[i + 1], style));
+    }
+
+    cairo_set_source_rgba(cr, style->red, style->green, style->blue, style->alpha);
+    cairo_set_fill_rule(cr, CAIRO_FILL_RULE_WINDING);
+    cairo_fill(cr);
+}
+
+void stroke_get_bounds(const Stroke *stroke, const ShapeStyle *style,
+                       double *bx1, double *by1, double *bx2, double *by2) {
+    *bx1 = *by1 = INFINITY;
+    *bx2 = *by2 = -INFINITY;
+    const GArray *points = drawn_points(stroke);
+    for (guint i = 0; i < points->len; i++) {
+        const StrokePoint *p = &g_array_index(points, StrokePoint, i);
+        double pad = point_radius(p, style) + 1;
+        *bx1 = fmin(*bx1, p->x - pad);
+        *by1 = fmin(*by1, p->y - pad);
+        *bx2 = fmax(*bx2, p->x + pad);
+        *by2 = fmax(*by2, p->y + pad);
+    }
+}
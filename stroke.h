@@ -0,0 +1,55 @@
+#ifndef CRAYONS_STROKE_H
+#define CRAYONS_STROKE_H
+
+#include "shapes.h"
+
+/*
+ * Pen stroke geometry.
+ *
+ * A stroke keeps its input samples until it is finished. Finishing drops
+ * samples that Ramer-Douglas-Peucker says add nothing within
+ * STROKE_TOLERANCE, then resamples the rest along a Catmull-Rom spline. The
+ * outline is the union of one round-ended, tapered capsule per resampled
+ * segment, whose radius follows the pen pressure, filled in a single pass
+ * with the nonzero rule. Overlaps are therefore covered once and translucent
+ * colours stay even.
+ *
+ * Like shapes, strokes do not touch GTK or global state.
+ */
+
+/* Largest distance in canvas pixels a simplified stroke may stray from its
+ * input samples. */
+#define STROKE_TOLERANCE 0.5
+
+typedef struct _Stroke Stroke;
+
+Stroke *stroke_new(void);
+void stroke_free(Stroke *stroke);
+
+/* Appends an input sample. pressure runs from 0 to 1; pass 1 for devices
+ * without a pressure axis. */
+void stroke_add_point(Stroke *stroke, double x, double y, double pressure);
+
+/* Simplifies and resamples the input. No points may be added afterwards. */
+void stroke_finish(Stroke *stroke);
+
+/* Finishes a stroke whose samples were already simplified, e.g. ones read
+ * back with stroke_get_point(), keeping every one of them so the outline
+ * comes out as before. */
+void stroke_finish_simplified(Stroke *stroke);
+
+/* Input samples before stroke_finish(), the simplified ones after. */
+int stroke_get_n_points(const Stroke *stroke);
+void stroke_get_point(const Stroke *stroke, int i, double *x, double *y, double *pressure);
+
+/* Bytes held by the stroke's points. */
+gsize stroke_get_size(const Stroke *stroke);
+
+/* Fills the finished stroke's outline, style->size wide at full pressure. */
+void stroke_fill(cairo_t *cr, const Stroke *stroke, const ShapeStyle *style);
+
+/* Canvas-space bounds of everything stroke_fill() may touch. */
+void stroke_get_bounds(const Stroke *stroke, const ShapeStyle *style,
+                       double *bx1, double *by1, double *bx2, double *by2);
+
+#endif
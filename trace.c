@@ -0,0 +1,144 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char *name;
+    char phase;                 /* 'X' complete or 'i' instant */
+    int tid;
+    gint64 ts, dur;             /* microseconds */
+} TraceEvent;
+
+static gboolean enabled = FALSE;
+static char *filename = NULL;
+
+static GMutex lock;
+static GArray *events = NULL;   /* TraceEvent */
+static guint dropped = 0;
+static gint next_tid = 1;       /* TRACE_TRACK_IO is 0 */
+static GPrivate thread_tid;
+
+/* Main thread only. */
+static gint64 pending_input = 0;    /* first input since the last frame, or 0 */
+static double latencies[TRACE_LATENCY_SAMPLES];
+static int n_latencies = 0;
+static int next_latency = 0;
+static double frame_ms = 0;
+
+void trace_init(void) {
+    const char *file = g_getenv("CRAYONS_TRACE");
+    if (!file || !*file) return;
+
+    filename = g_strdup(file);
+    events = g_array_new(FALSE, FALSE, sizeof(TraceEvent));
+    enabled = TRUE;
+}
+
+gboolean trace_is_enabled(void) {
+    return enabled;
+}
+
+gint64 trace_now(void) {
+    return enabled ? g_get_monotonic_time() : 0;
+}
+
+static int current_tid(void) {
+    int tid = GPOINTER_TO_INT(g_private_get(&thread_tid));
+    if (!tid) {
+        tid = g_atomic_int_add(&next_tid, 1);
+        g_private_set(&thread_tid, GINT_TO_POINTER(tid));
+    }
+    return tid;
+}
+
+static void record(const char *name, char phase, int tid, gint64 ts, gint64 dur) {
+    TraceEvent event = { name, phase, tid, ts, dur };
+
+    g_mutex_lock(&lock);
+    if (events->len < TRACE_MAX_EVENTS) g_array_append_val(events, event);
+    else dropped++;
+    g_mutex_unlock(&lock);
+}
+
+void trace_complete_on(const char *name, gint64 start, int track) {
+    if (!enabled) return;
+    record(name, 'X', track, start, g_get_monotonic_time() - start);
+}
+
+void trace_complete(const char *name, gint64 start) {
+    if (!enabled) return;
+    trace_complete_on(name, start, current_tid());
+}
+
+void trace_input(const char *name) {
+    if (!enabled) return;
+
+    gint64 now = g_get_monotonic_time();
+    if (!pending_input) pending_input = now;
+    record(name, 'i', current_tid(), now, 0);
+}
+
+gboolean trace_frame(gint64 start) {
+    if (!enabled) return FALSE;
+
+    gint64 now = g_get_monotonic_time();
+    int tid = current_tid();
+    record("draw", 'X', tid, start, now - start);
+    frame_ms = (now - start) / 1e3;
+
+    if (pending_input) {
+        record("input-to-frame", 'X', tid, pending_input, now - pending_input);
+        latencies[next_latency] = (now - pending_input) / 1e3;
+        next_latency = (next_latency + 1) % TRACE_LATENCY_SAMPLES;
+        n_latencies = MIN(n_latencies + 1, TRACE_LATENCY_SAMPLES);
+        pending_input = 0;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void trace_get_stats(TraceStats *stats) {
+    double sorted[TRACE_LATENCY_SAMPLES];
+    memcpy(sorted, latencies, n_latencies * sizeof(double));
+    qsort(sorted, n_latencies, sizeof(double), compare_doubles);
+
+    stats->frame_ms = frame_ms;
+    stats->latency_samples = n_latencies;
+    stats->latency_p50_ms = n_latencies ? sorted[n_latencies / 2] : 0;
+    stats->latency_p99_ms = n_latencies ? sorted[(n_latencies - 1) * 99 / 100] : 0;
+}
+
+void trace_write(void) {
+    if (!enabled) return;
+
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        g_printerr("Could not write %s: %s\n", filename, g_strerror(errno));
+        return;
+    }
+
+    g_mutex_lock(&lock);
+    fputs("{\"traceEvents\":[\n", out);
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                 "\"args\":{\"name\":\"io\"}}", TRACE_TRACK_IO);
+    for (guint i = 0; i < events->len; i++) {
+        const TraceEvent *e = &g_array_index(events, TraceEvent, i);
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT,
+                e->name, e->phase, e->tid, e->ts);
+        if (e->phase == 'X') fprintf(out, ",\"dur\":%" G_GINT64_FORMAT, e->dur);
+        else fputs(",\"s\":\"t\"", out);
+        fputc('}', out);
+    }
+    fprintf(out, "\n],\"otherData\":{\"dropped\":%u}}\n", dropped);
+    g_mutex_unlock(&lock);
+
+    if (fclose(out) != 0) g_printerr("Could not write %s: %s\n", filename, g_strerror(errno));
+}
@@ -0,0 +1,60 @@
+#ifndef CRAYONS_TRACE_H
+#define CRAYONS_TRACE_H
+
+#include <glib.h>
+
+/*
+ * Opt-in latency instrumentation.
+ *
+ * Setting CRAYONS_TRACE=FILE enables it: input events, frames and slow
+ * operations are recorded and written to FILE on exit in Chrome's
+ * trace-event JSON format (load it in chrome://tracing or Perfetto). Input
+ * latency is measured from the first input event after a frame until the
+ * next frame has been drawn. While disabled every call returns at once.
+ *
+ * Recording is safe from any thread, except that inputs, frames and stats
+ * belong to the main thread. Event names must be static strings.
+ */
+
+/* Events past this many are not recorded. */
+#define TRACE_MAX_EVENTS (1 << 20)
+
+/* Pseudo-thread for operations that span several main loop iterations,
+ * such as a progressive load, so they do not overlap main thread events. */
+#define TRACE_TRACK_IO 0
+
+#define TRACE_LATENCY_SAMPLES 512
+
+typedef struct {
+    double frame_ms;            /* last frame's drawing time */
+    double latency_p50_ms;      /* over the last TRACE_LATENCY_SAMPLES inputs */
+    double latency_p99_ms;
+    int latency_samples;
+} TraceStats;
+
+/* Reads CRAYONS_TRACE. */
+void trace_init(void);
+gboolean trace_is_enabled(void);
+
+/* Timestamp to pass to the functions below; 0 while disabled. */
+gint64 trace_now(void);
+
+/* Records name as running from start until now on the calling thread. */
+void trace_complete(const char *name, gint64 start);
+
+/* Same on track, e.g. TRACE_TRACK_IO. */
+void trace_complete_on(const char *name, gint64 start, int track);
+
+/* Records an input event; its latency ends at the next trace_frame(). */
+void trace_input(const char *name);
+
+/* Records a frame drawn from start until now. Returns TRUE if it ended the
+ * latency of an input, i.e. the stats changed. */
+gboolean trace_frame(gint64 start);
+
+void trace_get_stats(TraceStats *stats);
+
+/* Writes the trace file. Called once on exit. */
+void trace_write(void);
+
+#endif
@@ -0,0 +1,55 @@
+#include "viewport.h"
+#include "parallel.h"
+
+#include <math.h>
+
+typedef struct {
+    guint8 *data;
+    int stride;
+    cairo_rectangle_int_t r;
+    const Canvas *source;
+    double scale, ox, oy;
+    cairo_filter_t filter;
+} ViewportJob;
+
+static void render_band(int y0, int y1, gpointer data) {
+    const ViewportJob *job = data;
+    const cairo_rectangle_int_t *r = &job->r;
+
+    cairo_surface_t *band = cairo_image_surface_create_for_data(
+        job->data + (size_t)y0 * job->stride + (size_t)r->x * 4,
+        CAIRO_FORMAT_ARGB32, r->width, y1 - y0, job->stride);
+    cairo_t *cr = cairo_create(band);
+
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    /* Band pixel (0, 0) is target pixel (r->x, y0). */
+    cairo_translate(cr, -r->x - job->ox, -y0 - job->oy);
+    cairo_scale(cr, job->scale, job->scale);
+
+    /* Source pixels under the band; canvas_paint() clips them to source. */
+    double sx1 = floor((r->x + job->ox) / job->scale);
+    double sy1 = floor((y0 + job->oy) / job->scale);
+    double sx2 = ceil((r->x + r->width + job->ox) / job->scale);
+    double sy2 = ceil((y1 + job->oy) / job->scale);
+    canvas_paint(job->source, cr, sx1, sy1, sx2, sy2, job->filter);
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(band);
+}
+
+void viewport_render(cairo_surface_t *target, const cairo_rectangle_int_t *r,
+                     const Canvas *source, double scale, double ox, double oy,
+                     cairo_filter_t filter) {
+    if (r->width <= 0 || r->height <= 0) return;
+
+    cairo_surface_flush(target);
+    ViewportJob job = {
+        cairo_image_surface_get_data(target), cairo_image_surface_get_stride(target),
+        *r, source, scale, ox, oy, filter,
+    };
+    parallel_rows(r->y, r->y + r->height, render_band, &job);
+    cairo_surface_mark_dirty_rectangle(target, r->x, r->y, r->width, r->height);
+}
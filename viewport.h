@@ -0,0 +1,24 @@
+#ifndef CRAYONS_VIEWPORT_H
+#define CRAYONS_VIEWPORT_H
+
+#include "canvas.h"
+
+/*
+ * Parallel scaling of the canvas into a back buffer.
+ *
+ * The area to render is cut into horizontal bands that are scaled and
+ * composited concurrently on the parallel_rows() pool, each through its own
+ * cairo context on a view of the buffer's rows. Every device pixel depends
+ * only on its own position, so the result is the same as painting the area
+ * in one go.
+ */
+
+/* Renders r of target, an ARGB32 image surface, from source so that source
+ * pixel (sx, sy) lands on target pixel (sx * scale - ox, sy * scale - oy).
+ * Pixels of r outside source are left transparent. source must not be
+ * written to meanwhile. */
+void viewport_render(cairo_surface_t *target, const cairo_rectangle_int_t *r,
+                     const Canvas *source, double scale, double ox, double oy,
+                     cairo_filter_t filter);
+
+#endif